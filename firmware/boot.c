@@ -0,0 +1,85 @@
+//
+// Bootloader, at the start of flash, built as boot.elf. It has the audio
+// receiver (piezo.c and what it uses) and update.c, which the application
+// shares rather than having copies of its own (see SHARED_OBJS in the
+// Makefile), so that it can receive an update without the application. If
+// the application has asked for an update (update_request()), or an update
+// was interrupted and the application is only partly there, it listens for
+// the update, which is written straight over the application. It does the
+// same if the application wasn't linked against this bootloader (see
+// update.h). Then the application is started.
+//
+
+#include <stddef.h>
+#include <stm32f0xx.h>
+#include <flash.h>
+#include <update.h>
+#include <piezo.h>
+
+// 16 for the core, 32 for the STM32F030's interrupts. Both linker scripts
+// leave this much room at the start of RAM.
+#define BOOT_VECTORS       48
+
+// Either the application asked for an update, or one was interrupted.
+static bool update_wanted(const update_control_t *c)
+{
+    return c->requested == UPDATE_FLAG_SET ||
+           (c->magic == UPDATE_CONTROL_MAGIC && c->verified != UPDATE_FLAG_SET);
+}
+
+// There's an application linked to go after this bootloader, and against
+// it: one linked against another bootloader would call its shared code at
+// the wrong addresses.
+static bool application_ok()
+{
+    const uint32_t *vectors = (const uint32_t *)UPDATE_APP_ADDRESS;
+    uint32_t sp = vectors[0], reset = vectors[1];
+    if ((sp & 0xFFFFF000) != SRAM_BASE || reset < UPDATE_APP_ADDRESS || reset >= UPDATE_APP_ADDRESS + UPDATE_MAX_LENGTH)
+        return false;
+    return *(const uint32_t *)(UPDATE_APP_ADDRESS + UPDATE_APP_BOOT_ID_OFFSET) == update_boot_id();
+}
+
+static void start_application()
+{
+    if (! application_ok())
+        for (;;);
+
+    // The M0 can't relocate its vector table, so the application's is copied
+    // to the start of RAM, which is then mapped at address 0.
+    const uint32_t *vectors = (const uint32_t *)UPDATE_APP_ADDRESS;
+    uint32_t *ram = (uint32_t *)SRAM_BASE;
+    unsigned i;
+    for (i = 0; i < BOOT_VECTORS; ++i)
+        ram[i] = vectors[i];
+    RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+    SYSCFG->CFGR1 |= SYSCFG_CFGR1_MEM_MODE;
+
+    __set_MSP(vectors[0]);
+    ((void (*)(void))vectors[1])();
+}
+
+int main()
+{
+    const update_control_t *c = (const update_control_t *)UPDATE_CONTROL_ADDRESS;
+    bool app_ok = application_ok();
+    if (update_wanted(c) || ! app_ok) {
+        piezo_mic_init();
+        while (! update_receive()) {
+            // Once the update has started, the application has been at least
+            // partly overwritten, so there's nothing to do but keep
+            // listening, and the same goes if there's no application that
+            // will run with this bootloader. Otherwise, if the phone isn't
+            // sending (or is sending an image for another bootloader), clear
+            // the request (so that it isn't still there next time the meter
+            // is turned on) and start the old one.
+            if (c->magic != UPDATE_CONTROL_MAGIC && app_ok) {
+                flash_erase_page(UPDATE_CONTROL_ADDRESS);
+                break;
+            }
+        }
+        piezo_mic_deinit();
+    }
+
+    start_application();
+    return 0;
+}
@@ -0,0 +1,128 @@
+// Exposure bracketing.
+//
+// The shutter speed for the middle of the bracket is computed once, and
+// each frame is then a fixed number of 1/120 EV away from it, so the whole
+// sequence is computed in a single pass with no further exposure
+// calculations.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <bracket.h>
+#include <exposure.h>
+#include <state.h>
+#include <myassert.h>
+#ifdef TEST
+#include <stdio.h>
+#endif
+
+void bracket_plan(bracket_t *b, ev_with_fracs_t aperture, ev_with_fracs_t iso, ev_with_fracs_t ev,
+                  bracket_step_t step, uint_fast8_t count, precision_mode_t precision_mode)
+{
+    assert(count > 0);
+
+    if (count > BRACKET_MAX_FRAMES)
+        count = BRACKET_MAX_FRAMES;
+
+    int32_t st = step;
+
+    // Unclamped, so that frames stay evenly spaced until they hit a limit.
+    int32_t middle = z_given_x_y_ev_unclamped(aperture, iso, ev, 1);
+
+    // The first frame gets the most exposure, i.e. the slowest speed. With
+    // an even number of frames the middle falls between two frames, which
+    // is fine because every step divides exactly by 2 in 1/120 EV.
+    int32_t s = middle - ((st * (count - 1)) / 2);
+
+    b->count = count;
+    b->clamped = 0;
+    uint_fast8_t i;
+    for (i = 0; i < count; ++i, s += st) {
+        int32_t c = s;
+        if (c < SHUTTER_SPEED_MIN_WHOLE_STOPS*EV_WITH_FRACS_TH)
+            c = SHUTTER_SPEED_MIN_WHOLE_STOPS*EV_WITH_FRACS_TH;
+        else if (c > SHUTTER_SPEED_MAX_WHOLE_STOPS*EV_WITH_FRACS_TH)
+            c = SHUTTER_SPEED_MAX_WHOLE_STOPS*EV_WITH_FRACS_TH;
+        if (c != s)
+            b->clamped |= (1 << i);
+
+        ev_with_fracs_init_from_120ths(b->shutter_speeds[i], c);
+        shutter_speed_to_string(b->shutter_speeds[i], &(b->strings[i]), precision_mode);
+    }
+}
+
+// Plans a bracket centred between the darkest and brightest spot readings,
+// with enough frames that the end frames place each extreme in zone V.
+void bracket_plan_for_multispot(bracket_t *b, ev_with_fracs_t aperture, ev_with_fracs_t iso, const multispot_t *ms,
+                                bracket_step_t step, uint_fast8_t min_count, precision_mode_t precision_mode)
+{
+    assert(multispot_count(ms) > 0);
+
+    int32_t range = multispot_contrast_range(ms), st = step;
+    uint_fast8_t count = ((range + st - 1) / st) + 1;
+    if (count < min_count)
+        count = min_count;
+
+    bracket_plan(b, aperture, iso, (multispot_min(ms) + multispot_max(ms)) / 2, step, count, precision_mode);
+}
+
+#ifdef TEST
+
+int main()
+{
+    bracket_t b;
+    ev_with_fracs_t ap, iso, ev;
+    ev_with_fracs_init_from_wholes(ap, 4);   // f4
+    ev_with_fracs_init_from_thirds(iso, 21); // ISO 100
+    ev_with_fracs_init_from_wholes(ev, 12);
+
+    unsigned failures = 0;
+
+    static const bracket_step_t steps[] = { BRACKET_STEP_THIRD, BRACKET_STEP_HALF, BRACKET_STEP_WHOLE };
+    static const precision_mode_t precs[] = { PRECISION_MODE_THIRD, PRECISION_MODE_HALF, PRECISION_MODE_EIGHTH };
+    unsigned i, j;
+    for (i = 0; i < sizeof(steps)/sizeof(steps[0]); ++i) {
+        bracket_plan(&b, ap, iso, ev, steps[i], 5, precs[i]);
+        ev_with_fracs_t middle = shutter_speed_given_aperture_iso_ev(ap, iso, ev);
+        printf("Step %i/120:", steps[i]);
+        for (j = 0; j < b.count; ++j) {
+            printf(" %s%s", SHUTTER_STRING_OUTPUT_STRING(b.strings[j]), bracket_frame_is_clamped(&b, j) ? "*" : "");
+            if (b.shutter_speeds[j] != middle + (((int)j - 2) * (int)steps[i]))
+                ++failures;
+        }
+        printf("\n");
+    }
+
+    // Very bright: fastest frames should be clamped.
+    ev_with_fracs_init_from_wholes(ev, 17);
+    bracket_plan(&b, ap, iso, ev, BRACKET_STEP_WHOLE, 5, PRECISION_MODE_EIGHTH);
+    printf("Clamped:");
+    for (j = 0; j < b.count; ++j)
+        printf(" %s%s", SHUTTER_STRING_OUTPUT_STRING(b.strings[j]), bracket_frame_is_clamped(&b, j) ? "*" : "");
+    printf("\n");
+    if (b.clamped == 0 || bracket_frame_is_clamped(&b, 0) || b.shutter_speeds[b.count-1] != SHUTTER_SPEED_MAX_WHOLE_STOPS*EV_WITH_FRACS_TH)
+        ++failures;
+
+    // Even number of frames straddles the middle.
+    ev_with_fracs_init_from_wholes(ev, 12);
+    bracket_plan(&b, ap, iso, ev, BRACKET_STEP_WHOLE, 4, PRECISION_MODE_EIGHTH);
+    if (b.shutter_speeds[1] + b.shutter_speeds[2] != 2*shutter_speed_given_aperture_iso_ev(ap, iso, ev))
+        ++failures;
+
+    // Seven stop scene bracketed in whole stops needs eight frames.
+    multispot_t ms;
+    multispot_init(&ms);
+    multispot_add(&ms, 5*EV_WITH_FRACS_TH);
+    multispot_add(&ms, 12*EV_WITH_FRACS_TH);
+    bracket_plan_for_multispot(&b, ap, iso, &ms, BRACKET_STEP_WHOLE, 3, PRECISION_MODE_EIGHTH);
+    printf("Multispot:");
+    for (j = 0; j < b.count; ++j)
+        printf(" %s", SHUTTER_STRING_OUTPUT_STRING(b.strings[j]));
+    printf("\n");
+    if (b.count != 8)
+        ++failures;
+
+    printf("%s\n", failures == 0 ? "OK" : "FAIL");
+    return failures != 0;
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef BRACKET_H
+#define BRACKET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <exposure.h>
+#include <multispot.h>
+
+#define BRACKET_MAX_FRAMES 9
+
+// Steps between frames, in 1/120 EV.
+typedef enum bracket_step {
+    BRACKET_STEP_THIRD = EV_WITH_FRACS_TH/3,
+    BRACKET_STEP_HALF  = EV_WITH_FRACS_TH/2,
+    BRACKET_STEP_WHOLE = EV_WITH_FRACS_TH
+} bracket_step_t;
+
+// A sequence of shutter speeds at a fixed aperture, from the most exposure
+// to the least. Frames whose shutter speed had to be clamped to the range
+// of available speeds have their bit set in 'clamped'.
+typedef struct bracket {
+    ev_with_fracs_t shutter_speeds[BRACKET_MAX_FRAMES];
+    shutter_string_output_t strings[BRACKET_MAX_FRAMES];
+    uint16_t clamped;
+    uint8_t count;
+} bracket_t;
+
+enum precision_mode;
+void bracket_plan(bracket_t *b, ev_with_fracs_t aperture, ev_with_fracs_t iso, ev_with_fracs_t ev,
+                  bracket_step_t step, uint_fast8_t count, enum precision_mode precision_mode);
+void bracket_plan_for_multispot(bracket_t *b, ev_with_fracs_t aperture, ev_with_fracs_t iso, const multispot_t *ms,
+                                bracket_step_t step, uint_fast8_t min_count, enum precision_mode precision_mode);
+
+#define bracket_frame_is_clamped(b, i) (((b)->clamped >> (i)) & 1)
+
+#endif
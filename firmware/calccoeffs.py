@@ -9,11 +9,72 @@ def calc(baseband, carrier, sample):
     return dict(coscoeff=math.cos(2*math.pi*(carrier/sample)),
                 sincoeff=math.sin(2*math.pi*(carrier/sample)))
 
+# Biquad band-pass with 0dB gain at the centre frequency (see the Audio EQ
+# Cookbook). b1 is always 0 and b2 = -b0.
+def calc_bandpass(center, bandwidth, sample):
+    w0 = 2*math.pi*(center/sample)
+    alpha = math.sin(w0)/(2*(center/bandwidth))
+    return dict(b0=alpha/(1+alpha),
+                a1=(-2*math.cos(w0))/(1+alpha),
+                a2=(1-alpha)/(1+alpha))
+
+# Tone plan for MFSK. Tones are centred on consecutive Goetzel bins for a
+# window of 'window' samples, so that they're orthogonal over a window.
+def calc_mfsk(tones, first_bin, window, sample):
+    r = [ ]
+    for t in range(int(tones)):
+        freq = (first_bin + t) * (sample / window)
+        c = calc(0, freq, sample)
+        r.append(dict(freq=freq, coscoeff=c['coscoeff'], sincoeff=c['sincoeff']))
+    return r
+
+# Goetzel coefficients for frequencies of first/steps ... last/steps bins of
+# a window of 'window' samples. These don't depend on the sample rate, so
+# they can be used to retune at runtime.
+def calc_table(first, last, steps, window):
+    r = [ ]
+    for m in range(int(first), int(last)+1):
+        w = 2*math.pi*(m/(steps*window))
+        r.append(dict(step=m, coscoeff=math.cos(w), sincoeff=math.sin(w)))
+    return r
+
+def print_table(entries, steps):
+    for e in entries:
+        print("    T(%.10f, %.10f), // %i (bin %.3f)" % (e['coscoeff'], e['sincoeff'], e['step'], e['step']/steps))
+
+def print_mfsk(tones):
+    print("#define HFSDP_MFSK_MAX_TONES %i" % len(tones))
+    for t in range(len(tones)):
+        print("#define HFSDP_MFSK_COSCOEFF%i_ %.10f // %.1fHz" % (t, tones[t]['coscoeff'], tones[t]['freq']))
+        print("#define HFSDP_MFSK_SINCOEFF%i_ %.10f" % (t, tones[t]['sincoeff']))
+
 if __name__ == '__main__':
+    if len(sys.argv) > 1 and sys.argv[1] == 'mfsk':
+        args = { }
+        for arg in sys.argv[2:]:
+            name, val = arg.split('=')
+            args[name] = float(val)
+        print_mfsk(calc_mfsk(**args))
+        sys.exit(0)
+    if len(sys.argv) > 1 and sys.argv[1] == 'table':
+        args = { }
+        for arg in sys.argv[2:]:
+            name, val = arg.split('=')
+            args[name] = float(val)
+        print_table(calc_table(**args), args['steps'])
+        sys.exit(0)
+
+    bandpass = len(sys.argv) > 1 and sys.argv[1] == 'bandpass'
+    if bandpass:
+        del sys.argv[1]
     assert len(sys.argv) == 4
     args = { }
     for arg in sys.argv[1:]:
         name, val = arg.split('=')
         args[name] = float(val)
-    r = calc(**args)
-    print("cos = %.10f, sin = %.10f" % (r['coscoeff'], r['sincoeff']))
+    if bandpass:
+        r = calc_bandpass(**args)
+        print("b0 = %.10f, a1 = %.10f, a2 = %.10f" % (r['b0'], r['a1'], r['a2']))
+    else:
+        r = calc(**args)
+        print("cos = %.10f, sin = %.10f" % (r['coscoeff'], r['sincoeff']))
@@ -122,8 +122,8 @@ def get_xth_bit(ev, x):
             xth_below = f
         f += 1/x
 
-    above = float(int(ev10)) + xth_above
-    below = float(int(ev10)) + xth_below
+    above = math.floor(ev10) + xth_above
+    below = math.floor(ev10) + xth_below
 
     #print("ev=%f, ev8=%f, ev8_1=%f, above=%f, below=%f" % (ev, ev8, ev8_1, above, below))
 
@@ -258,18 +258,21 @@ def output_sanity_graph():
         lux += lux
     f.close()
 
-# Straight up array that we use to test that the bitshifting logic is
-# working correctly. (Test will currently only be performed for normal light table.)
+# Straight up array of the EV (at ISO 100, in 1/120 EV) predicted by the model
+# for each stage and voltage. The host test in exposure.c checks the output of
+# get_ev100_at_voltage() against this. EVs below -5 are clamped as in the
+# compressed tables.
 def output_test_table(of):
-    of.write('    { ')
-    for v in range(b_voltage_offset, 256):
-        voltage = (v * bv_to_voltage)
-#            sys.stderr.write('TAVY ' + str(temperature) + ',' + str(voltage) + '\n')
-        ev = voltage_and_timing_to_ev(voltage, amp_normal_timing)
-        eight = int(round((ev+5.0) * 8.0))
-        of.write("%i," % eight)
-    of.write('\n')
-    of.write('    }');
+    of.write('{\n')
+    for timing in amp_timings:
+        of.write('    ')
+        for v in range(b_voltage_offset, 256):
+            voltage = (v * bv_to_voltage)
+            ev = voltage_and_timing_to_ev(voltage, timing)
+            ev120 = max(int(round(ev * 120.0)), -5*120)
+            of.write("%i," % ev120)
+        of.write('\n')
+    of.write('}')
 
 #
 # Shutter speed and aperture tables.
@@ -432,6 +435,36 @@ apertures_tenth = [
     '320'
 ]
 
+#
+# ISOs are represented on the microcontroller as BCD digits giving the ISO
+# in tenths (so that ISO 0.8, 1.2, 1.6 and 2.5 can be represented). We store
+# a single merged table of third-stop ISOs, starting at ISO 0.8. Above ISO 80
+# the conventional scale repeats every ten thirds with an additional factor
+# of 10, so we only need to store the table up to the end of the first
+# repeating decade. Higher ISOs are obtained by appending zeroes.
+#
+# Each entry is stored as four bytes: the total number of digits followed by
+# the (at most three) leading digits. All subsequent digits are zero.
+#
+isos_third_tenths = [
+    8, 10, 12, 16, 20, 25, 30, 40, 50, 60,
+    80, 100, 120, 160, 200, 250, 320, 400, 500, 640,
+    800, 1000, 1250, 1600, 2000, 2500, 3200, 4000, 5000, 6400,
+    8000
+]
+iso_decade_start = 21
+assert len(isos_third_tenths) == iso_decade_start + 10
+assert isos_third_tenths[iso_decade_start] == 1000 # ISO 100
+
+def output_isos(of):
+    of.write('const uint8_t ISO_THIRD_STOPS_BCD[] = {\n')
+    for iso in isos_third_tenths:
+        s = str(iso)
+        assert s.rstrip('0') == s[:3].rstrip('0')
+        ds = [int(c) for c in (s + '00')[:3]]
+        of.write('    %i, %i, %i, %i,\n' % (len(s), ds[0], ds[1], ds[2]))
+    of.write('};\n')
+
 def output_shutter_speeds(of):
     for x in [('THIRD', shutter_speeds_thirds), ('EIGHTH', shutter_speeds_eighths), ('TENTH', shutter_speeds_tenths)]:
         name = x[0]
@@ -540,13 +573,20 @@ def output():
     ofh.write("#define VOLTAGE_OFFSET_12BIT " + str(int(round((voltage_offset/reference_voltage)*4096.0))) + '\n')
 
     ofc.write('\n#ifdef TEST\n')
-    ofc.write('const uint8_t TEST_VOLTAGE_TO_EV[] =\n')
-    ofh.write('extern const uint8_t TEST_VOLTGE_TO_EV[];\n')
+    ofc.write('const int16_t TEST_VOLTAGE_TO_EV120[] = ')
+    ofh.write('#ifdef TEST\n')
+    ofh.write('#define TEST_VOLTAGE_TO_EV120_STAGE_LENGTH (256-VOLTAGE_TO_EV_ABS_OFFSET)\n')
+    ofh.write('extern const int16_t TEST_VOLTAGE_TO_EV120[];\n')
+    ofh.write('#endif\n')
     output_test_table(ofc)
     ofc.write(';\n#endif\n')
     output_shutter_speeds(ofc)
     output_apertures(ofc)
+    output_isos(ofc)
 
+    ofh.write("#define ISO_THIRD_STOPS_BCD_ENTRIES %i\n" % len(isos_third_tenths))
+    ofh.write("#define ISO_THIRD_STOPS_BCD_DECADE_START %i\n" % iso_decade_start)
+    ofh.write("extern const uint8_t ISO_THIRD_STOPS_BCD[];\n")
     ofh.write("extern uint8_t SHUTTER_SPEEDS_EIGHTH[];\n")
     ofh.write("extern uint8_t SHUTTER_SPEEDS_TENTH[];\n")
     ofh.write("extern uint8_t SHUTTER_SPEEDS_THIRD[];\n")
@@ -0,0 +1,213 @@
+// Configuration pushed from a phone over audio (see config.h for the format).
+//
+// A message is parsed into a copy of the meter state, and the copy only
+// replaces global_meter_state if every field in the message is good, so a
+// bad message never leaves the meter half configured. The frame's CRC has
+// already been checked by the time the message gets here.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <config.h>
+#include <state.h>
+#include <exposure.h>
+#include <mymemset.h>
+#ifndef TEST
+#include <piezo.h>
+#endif
+#ifdef TEST
+#include <stdio.h>
+#endif
+
+static bool valid_bracket_step(unsigned s)
+{
+    return s == BRACKET_STEP_THIRD || s == BRACKET_STEP_HALF || s == BRACKET_STEP_WHOLE;
+}
+
+static bool valid_precision_mode(unsigned m)
+{
+    return m == PRECISION_MODE_FULL || m == PRECISION_MODE_HALF || m == PRECISION_MODE_THIRD ||
+           m == PRECISION_MODE_QUARTER || m == PRECISION_MODE_EIGHTH || m == PRECISION_MODE_TENTH;
+}
+
+// Returns false if the value of a known field has the wrong length or is
+// out of range.
+static bool set_field(meter_state_t *ms, unsigned tag, const uint8_t *v, unsigned length)
+{
+    int32_t i;
+
+    switch (tag) {
+    case CONFIG_TAG_ISO: {
+        if (length != 1 || v[0] > ISO_MAX_WHOLE_STOPS*3)
+            return false;
+        ms->iso = v[0];
+        ms->bcd_iso_length = iso_in_third_stops_to_bcd(ms->iso, ms->bcd_iso_digits);
+    } break;
+    case CONFIG_TAG_PRECISION_MODE: {
+        if (length != 1 || ! valid_precision_mode(v[0]))
+            return false;
+        ms->precision_mode = v[0];
+    } break;
+    case CONFIG_TAG_CALIBRATION_OFFSET: {
+        if (length != 2)
+            return false;
+        i = (int16_t)(v[0] | (v[1] << 8));
+        if (i < -CONFIG_MAX_CALIBRATION_OFFSET || i > CONFIG_MAX_CALIBRATION_OFFSET)
+            return false;
+        ev_with_fracs_init_from_120ths(ms->calibration_offset, i);
+    } break;
+    case CONFIG_TAG_ND: {
+        if (length != 2)
+            return false;
+        i = v[0] | (v[1] << 8);
+        if (i > CONFIG_MAX_ND)
+            return false;
+        ev_with_fracs_init_from_120ths(ms->nd, i);
+    } break;
+    case CONFIG_TAG_BRACKET_STEP: {
+        if (length != 1 || ! valid_bracket_step(v[0]))
+            return false;
+        ms->bracket_step = v[0];
+    } break;
+    case CONFIG_TAG_BRACKET_COUNT: {
+        if (length != 1 || v[0] == 0 || v[0] > BRACKET_MAX_FRAMES)
+            return false;
+        ms->bracket_count = v[0];
+    } break;
+    }
+
+    return true;
+}
+
+// Sets the fields in the message 'msg' in 'ms'. Returns false if the
+// message is bad, in which case 'ms' may have been partly updated.
+bool config_parse(const uint8_t *msg, unsigned length, meter_state_t *ms)
+{
+    if (length < 2 || msg[0] != CONFIG_MAGIC || msg[1] != CONFIG_VERSION)
+        return false;
+
+    unsigned i = 2;
+    while (i < length) {
+        if (i + 2 > length || i + 2 + msg[i+1] > length)
+            return false;
+        if (! set_field(ms, msg[i], msg + i + 2, msg[i+1]))
+            return false;
+        i += 2 + msg[i+1];
+    }
+
+    return true;
+}
+
+#ifndef TEST
+
+// Applies the message to global_meter_state and saves it, or leaves the
+// meter state alone and returns false if the message is bad. Nothing
+// touches global_meter_state from an interrupt, so it's updated all at once
+// as far as the rest of the meter is concerned.
+bool config_apply_message(const uint8_t *msg, unsigned length)
+{
+    meter_state_t ms;
+    memcpy8(&ms, &global_meter_state, sizeof(ms));
+    if (! config_parse(msg, length, &ms))
+        return false;
+
+    memcpy8(&global_meter_state, &ms, sizeof(ms));
+    write_meter_state(&global_meter_state);
+    return true;
+}
+
+// Listens for a configuration frame and applies it. Returns false if none
+// arrives (piezo_read_frame() gives up if nothing starts within about four
+// seconds) or if it can't be applied.
+bool config_receive()
+{
+    uint8_t msg[CONFIG_MAX_LENGTH];
+    unsigned length;
+    if (piezo_read_frame(msg, sizeof(msg), &length) != PIEZO_FRAME_DONE)
+        return false;
+    return config_apply_message(msg, length);
+}
+
+#endif
+
+#ifdef TEST
+
+static void default_state(meter_state_t *ms)
+{
+    memset8_zero(ms, sizeof(meter_state_t));
+    ms->iso = 21;
+    ms->bcd_iso_length = iso_in_third_stops_to_bcd(ms->iso, ms->bcd_iso_digits);
+    ms->precision_mode = PRECISION_MODE_TENTH;
+    ms->bracket_step = BRACKET_STEP_WHOLE;
+    ms->bracket_count = 3;
+}
+
+static unsigned failures;
+
+static void check(const char *name, bool ok)
+{
+    printf("%s: %s\n", name, ok ? "OK" : "FAIL");
+    if (! ok)
+        ++failures;
+}
+
+int main()
+{
+    meter_state_t ms;
+
+    // ISO 400, thirds, +0.5EV calibration, ND8 (3 stops), a bracket of 5
+    // frames 1/3 stop apart, and a field from a later version that has to
+    // be skipped.
+    static const uint8_t all[] = {
+        CONFIG_MAGIC, CONFIG_VERSION,
+        CONFIG_TAG_ISO, 1, 27,
+        CONFIG_TAG_PRECISION_MODE, 1, PRECISION_MODE_THIRD,
+        99, 3, 1, 2, 3,
+        CONFIG_TAG_CALIBRATION_OFFSET, 2, 60, 0,
+        CONFIG_TAG_ND, 2, 360 & 0xFF, 360 >> 8,
+        CONFIG_TAG_BRACKET_STEP, 1, BRACKET_STEP_THIRD,
+        CONFIG_TAG_BRACKET_COUNT, 1, 5
+    };
+    default_state(&ms);
+    bool ok = config_parse(all, sizeof(all), &ms);
+    check("All fields", ok && ms.iso == 27 && ms.bcd_iso_length == 4 && ms.bcd_iso_digits[0] == 4 &&
+                        ms.precision_mode == PRECISION_MODE_THIRD && ms.calibration_offset == 60 && ms.nd == 360 &&
+                        ms.bracket_step == BRACKET_STEP_THIRD && ms.bracket_count == 5);
+
+    static const uint8_t negative[] = { CONFIG_MAGIC, CONFIG_VERSION, CONFIG_TAG_CALIBRATION_OFFSET, 2, (uint8_t)-90, 0xFF };
+    default_state(&ms);
+    ok = config_parse(negative, sizeof(negative), &ms);
+    check("Negative calibration offset", ok && ms.calibration_offset == -90);
+
+    static const uint8_t empty[] = { CONFIG_MAGIC, CONFIG_VERSION };
+    default_state(&ms);
+    check("No fields", config_parse(empty, sizeof(empty), &ms) && ms.iso == 21);
+
+    static const uint8_t bad_magic[] = { 'X', CONFIG_VERSION, CONFIG_TAG_ISO, 1, 27 };
+    static const uint8_t bad_version[] = { CONFIG_MAGIC, CONFIG_VERSION + 1, CONFIG_TAG_ISO, 1, 27 };
+    static const uint8_t bad_iso[] = { CONFIG_MAGIC, CONFIG_VERSION, CONFIG_TAG_ISO, 1, ISO_MAX_WHOLE_STOPS*3 + 1 };
+    static const uint8_t bad_precision[] = { CONFIG_MAGIC, CONFIG_VERSION, CONFIG_TAG_PRECISION_MODE, 1, 5 };
+    static const uint8_t bad_length[] = { CONFIG_MAGIC, CONFIG_VERSION, CONFIG_TAG_ISO, 2, 27, 0 };
+    static const uint8_t bad_calibration[] = { CONFIG_MAGIC, CONFIG_VERSION, CONFIG_TAG_CALIBRATION_OFFSET, 2, 0x59, 0x02 };
+    static const uint8_t bad_nd[] = { CONFIG_MAGIC, CONFIG_VERSION, CONFIG_TAG_ND, 2, 0x61, 0x09 };
+    static const uint8_t bad_bracket_step[] = { CONFIG_MAGIC, CONFIG_VERSION, CONFIG_TAG_BRACKET_STEP, 1, 30 };
+    static const uint8_t bad_bracket_count[] = { CONFIG_MAGIC, CONFIG_VERSION, CONFIG_TAG_BRACKET_COUNT, 1, BRACKET_MAX_FRAMES + 1 };
+    static const uint8_t zero_bracket_count[] = { CONFIG_MAGIC, CONFIG_VERSION, CONFIG_TAG_BRACKET_COUNT, 1, 0 };
+    static const uint8_t truncated[] = { CONFIG_MAGIC, CONFIG_VERSION, CONFIG_TAG_ISO, 1, 27, CONFIG_TAG_ND, 2, 0 };
+    static const uint8_t truncated_tag[] = { CONFIG_MAGIC, CONFIG_VERSION, CONFIG_TAG_ISO };
+    check("Bad magic", ! config_parse(bad_magic, sizeof(bad_magic), &ms));
+    check("Bad version", ! config_parse(bad_version, sizeof(bad_version), &ms));
+    check("ISO out of range", ! config_parse(bad_iso, sizeof(bad_iso), &ms));
+    check("Bad precision mode", ! config_parse(bad_precision, sizeof(bad_precision), &ms));
+    check("Wrong field length", ! config_parse(bad_length, sizeof(bad_length), &ms));
+    check("Calibration offset out of range", ! config_parse(bad_calibration, sizeof(bad_calibration), &ms));
+    check("ND out of range", ! config_parse(bad_nd, sizeof(bad_nd), &ms));
+    check("Bad bracket step", ! config_parse(bad_bracket_step, sizeof(bad_bracket_step), &ms));
+    check("Too many bracket frames", ! config_parse(bad_bracket_count, sizeof(bad_bracket_count), &ms));
+    check("No bracket frames", ! config_parse(zero_bracket_count, sizeof(zero_bracket_count), &ms));
+    check("Truncated field", ! config_parse(truncated, sizeof(truncated), &ms));
+    check("Truncated tag", ! config_parse(truncated_tag, sizeof(truncated_tag), &ms));
+
+    return failures != 0;
+}
+
+#endif
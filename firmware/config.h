@@ -0,0 +1,36 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <state.h>
+
+//
+// Configuration pushed from a phone over audio, as the payload of a frame
+// (see hamming_encode_frame). The payload is CONFIG_MAGIC, CONFIG_VERSION,
+// and then any number of fields, each a tag byte, a length byte and that
+// many bytes of value (little endian). Fields with unknown tags are
+// skipped, so that older meters can take newer messages.
+//
+
+#define CONFIG_MAGIC   'C'
+#define CONFIG_VERSION 1
+
+typedef enum config_tag {
+    CONFIG_TAG_ISO=1,                // uint8_t, in 1/3 stops.
+    CONFIG_TAG_PRECISION_MODE=2,     // uint8_t, a precision_mode_t.
+    CONFIG_TAG_CALIBRATION_OFFSET=3, // int16_t, in 1/120 EV.
+    CONFIG_TAG_ND=4,                 // uint16_t, in 1/120 EV.
+    CONFIG_TAG_BRACKET_STEP=5,       // uint8_t, a bracket_step_t (in 1/120 EV).
+    CONFIG_TAG_BRACKET_COUNT=6       // uint8_t, 1 to BRACKET_MAX_FRAMES.
+} config_tag_t;
+
+#define CONFIG_MAX_CALIBRATION_OFFSET (5*EV_WITH_FRACS_TH)
+#define CONFIG_MAX_ND                 (20*EV_WITH_FRACS_TH)
+#define CONFIG_MAX_LENGTH             32
+
+bool config_parse(const uint8_t *msg, unsigned length, meter_state_t *ms);
+bool config_apply_message(const uint8_t *msg, unsigned length);
+bool config_receive(void);
+
+#endif
@@ -0,0 +1,16 @@
+#include <crc32.h>
+
+// The usual CRC-32 (as used by zlib), so that the phone can compute it with
+// whatever library it has to hand. Computed a bit at a time, because it's
+// only used over whole firmware images and a table would cost 1K of flash.
+uint32_t crc32(const uint8_t *data, unsigned length)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    unsigned i, b;
+    for (i = 0; i < length; ++i) {
+        crc ^= data[i];
+        for (b = 0; b < 8; ++b)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
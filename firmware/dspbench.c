@@ -0,0 +1,363 @@
+//
+// Host micro-benchmarks for the receive DSP: goetzel1(), goetzel2() and
+// goetzel_bank() over a window, the sliding Goetzel used for timing
+// recovery, micfilter_process(), and hfsdp_check_start(), hfsdp_read_bit()
+// and hfsdp_receive_bit() as they're run on each window from the mic.
+// Each is run over every window of a buffer of synthetic HFSDP audio (a
+// preamble and random bits at the carriers, with noise), of noise alone,
+// and of recorded samples if a file is given, and the time per sample and
+// per window is reported.
+//
+// Host timings only compare one change against another. On the meter,
+// each window has to be dealt with in HFSDP_SAMPLE_CYCLES cycles (1/504s
+// at 8MHz); 'make dspcycles' estimates the M0 cycles taken by the loops
+// in the same functions from the ARM build.
+//
+// Usage: testdspbench [file=<samples>] [ms=200] [seed=1]
+//
+// The file has one sample per line (as written by the commented out code
+// in test_mic() in main.c); lines that aren't numbers are skipped, and the
+// mean is subtracted, so raw ADC values will do. 'ms' is how long to run
+// each benchmark for on each buffer.
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <goetzel.h>
+#include <hfsdp.h>
+#include <micfilter.h>
+
+// PIEZO_MIC_SAMPLE_FREQ (piezo.h can't be included on the host).
+#define DSPBENCH_ADC_FREQ       (8000000.0/124)
+#define DSPBENCH_AMPLITUDE      400.0
+#define DSPBENCH_NOISE          40.0
+#define DSPBENCH_LEAD_IN        16 // Windows of noise before the signal.
+#define DSPBENCH_PREAMBLE_BITS  24
+#define DSPBENCH_BITS           256
+#define DSPBENCH_MAX_SAMPLES    (1 << 22)
+
+typedef struct {
+    const char *name;
+    int16_t *samples;
+    unsigned nwindows;
+} dspbench_buffer_t;
+
+static volatile int32_t sink;
+static goetzel_coeffs_t mfsk_coeffs[HFSDP_MFSK_MAX_TONES];
+static int16_t scratch[DSPBENCH_MAX_SAMPLES];
+
+static double gaussian()
+{
+    double u1 = (rand() + 1.0) / (RAND_MAX + 2.0), u2 = rand() / (RAND_MAX + 1.0);
+    return sqrt(-2*log(u1)) * cos(2*M_PI*u2);
+}
+
+static double wall_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//
+// Buffers.
+//
+
+// Continuous-phase FSK at the carriers' nominal bins, as the phone sends it,
+// after some noise.
+static void make_signal(dspbench_buffer_t *b)
+{
+    unsigned bit_samples = HFSDP_WINDOW_LENGTH * HFSDP_SAMPLE_MULTPLIER;
+    unsigned nbits = DSPBENCH_PREAMBLE_BITS + DSPBENCH_BITS;
+    b->name = "signal";
+    b->nwindows = DSPBENCH_LEAD_IN + nbits*HFSDP_SAMPLE_MULTPLIER;
+    b->samples = malloc(sizeof(int16_t) * b->nwindows * HFSDP_WINDOW_LENGTH);
+
+    double phase = 0;
+    unsigned i, n = 0, bit = 0;
+    for (i = 0; i < DSPBENCH_LEAD_IN*HFSDP_WINDOW_LENGTH; ++i)
+        b->samples[n++] = (int16_t)(DSPBENCH_NOISE*gaussian());
+    for (i = 0; i < nbits*bit_samples; ++i) {
+        if (i % bit_samples == 0)
+            bit = (i < DSPBENCH_PREAMBLE_BITS*bit_samples ? (i / bit_samples) % 2 : (unsigned)rand() % 2);
+        unsigned step = bit ? HFSDP_CALIB_F2 : HFSDP_CALIB_F1;
+        phase += 2*M_PI*step / (HFSDP_WINDOW_LENGTH * HFSDP_CALIB_STEPS_PER_BIN);
+        if (phase > 2*M_PI)
+            phase -= 2*M_PI;
+        b->samples[n++] = (int16_t)(DSPBENCH_AMPLITUDE*sin(phase) + DSPBENCH_NOISE*gaussian());
+    }
+}
+
+static void make_noise(dspbench_buffer_t *b, unsigned nwindows)
+{
+    b->name = "noise";
+    b->nwindows = nwindows;
+    b->samples = malloc(sizeof(int16_t) * nwindows * HFSDP_WINDOW_LENGTH);
+    unsigned i;
+    for (i = 0; i < nwindows*HFSDP_WINDOW_LENGTH; ++i)
+        b->samples[i] = (int16_t)(DSPBENCH_AMPLITUDE*gaussian());
+}
+
+static bool read_samples(dspbench_buffer_t *b, const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (! f) {
+        fprintf(stderr, "Can't open '%s'\n", filename);
+        return false;
+    }
+
+    static int32_t values[DSPBENCH_MAX_SAMPLES];
+    unsigned n = 0;
+    int64_t total = 0;
+    char line[64];
+    while (n < DSPBENCH_MAX_SAMPLES && fgets(line, sizeof(line), f)) {
+        char *end;
+        long v = strtol(line, &end, 10);
+        if (end == line || (*end != '\n' && *end != '\r' && *end != '\0'))
+            continue;
+        values[n++] = (int32_t)v;
+        total += v;
+    }
+    fclose(f);
+
+    b->name = "recorded";
+    b->nwindows = n / HFSDP_WINDOW_LENGTH;
+    if (b->nwindows == 0) {
+        fprintf(stderr, "Less than a window of samples in '%s'\n", filename);
+        return false;
+    }
+    b->samples = malloc(sizeof(int16_t) * b->nwindows * HFSDP_WINDOW_LENGTH);
+    int32_t mean = (int32_t)(total / n);
+    unsigned i;
+    for (i = 0; i < b->nwindows*HFSDP_WINDOW_LENGTH; ++i)
+        b->samples[i] = (int16_t)(values[i] - mean);
+    return true;
+}
+
+//
+// Benchmarks. Each runs over every window of the buffer.
+//
+
+static void run_goetzel1(const int16_t *samples, unsigned nwindows)
+{
+    unsigned w;
+    for (w = 0; w < nwindows; ++w, samples += HFSDP_WINDOW_LENGTH) {
+        goetzel_result_t r;
+        goetzel1(samples, HFSDP_WINDOW_LENGTH, 0, HFSDP_COSCOEFF1, HFSDP_SINCOEFF1, &r);
+        sink += goetzel_get_freq_power(&r);
+    }
+}
+
+static void run_goetzel2(const int16_t *samples, unsigned nwindows)
+{
+    unsigned w;
+    for (w = 0; w < nwindows; ++w, samples += HFSDP_WINDOW_LENGTH) {
+        goetzel_result_t r1, r2;
+        goetzel2(samples, HFSDP_WINDOW_LENGTH, 0,
+                 HFSDP_COSCOEFF1, HFSDP_SINCOEFF1,
+                 HFSDP_COSCOEFF2, HFSDP_SINCOEFF2,
+                 &r1, &r2);
+        sink += goetzel_get_freq_power(&r1) - goetzel_get_freq_power(&r2);
+    }
+}
+
+static void run_bank(const int16_t *samples, unsigned nwindows, unsigned nbins)
+{
+    unsigned w, i;
+    for (w = 0; w < nwindows; ++w, samples += HFSDP_WINDOW_LENGTH) {
+        goetzel_result_t r[HFSDP_MFSK_MAX_TONES];
+        goetzel_bank(samples, HFSDP_WINDOW_LENGTH, 0, mfsk_coeffs, r, nbins);
+        for (i = 0; i < nbins; ++i)
+            sink += goetzel_get_freq_power(r + i);
+    }
+}
+
+static void run_bank4(const int16_t *samples, unsigned nwindows)
+{
+    run_bank(samples, nwindows, 4);
+}
+
+static void run_bank8(const int16_t *samples, unsigned nwindows)
+{
+    run_bank(samples, nwindows, 8);
+}
+
+// As in hfsdp_read_bit(): both carriers for each sub-block, and the power
+// over the last window at each sub-block boundary.
+static void run_sliding2(const int16_t *samples, unsigned nwindows)
+{
+    goetzel_sliding_t gs1, gs2;
+    goetzel_sliding_init(&gs1, HFSDP_COSCOEFF1, HFSDP_SINCOEFF1, HFSDP_TIMING_SUBBLOCK_LENGTH, HFSDP_TIMING_SUBBLOCKS);
+    goetzel_sliding_init(&gs2, HFSDP_COSCOEFF2, HFSDP_SINCOEFF2, HFSDP_TIMING_SUBBLOCK_LENGTH, HFSDP_TIMING_SUBBLOCKS);
+    unsigned i;
+    for (i = 0; i < nwindows*HFSDP_TIMING_SUBBLOCKS; ++i, samples += HFSDP_TIMING_SUBBLOCK_LENGTH) {
+        goetzel_sliding_add_block2(&gs1, &gs2, samples);
+        goetzel_result_t r1, r2;
+        if (goetzel_sliding_get_result(&gs1, &r1) && goetzel_sliding_get_result(&gs2, &r2))
+            sink += goetzel_get_freq_power(&r1) - goetzel_get_freq_power(&r2);
+    }
+}
+
+// The filter works in place, so it's run on a copy. The copy is made once,
+// so each pass after the first filters the output of the one before, which
+// makes no difference to the time it takes.
+static void run_micfilter(const int16_t *samples, unsigned nwindows)
+{
+    micfilter_t f;
+    micfilter_init(&f, true);
+    unsigned w;
+    int16_t *s = scratch;
+    for (w = 0; w < nwindows; ++w, s += HFSDP_WINDOW_LENGTH)
+        micfilter_process(&f, s, HFSDP_WINDOW_LENGTH);
+    sink += scratch[0];
+}
+
+static void run_check_start(const int16_t *samples, unsigned nwindows)
+{
+    hfsdp_read_bit_state_t s;
+    init_hfsdp_read_bit_state(&s, HFSDP_COSCOEFF1, HFSDP_SINCOEFF1, HFSDP_COSCOEFF2, HFSDP_SINCOEFF2);
+    unsigned w;
+    for (w = 0; w < nwindows; ++w, samples += HFSDP_WINDOW_LENGTH)
+        sink += hfsdp_check_start(&s, samples, HFSDP_WINDOW_LENGTH);
+}
+
+// As if the start had been found at the first window.
+static void run_read_bit(const int16_t *samples, unsigned nwindows)
+{
+    hfsdp_read_bit_state_t s;
+    init_hfsdp_read_bit_state(&s, HFSDP_COSCOEFF1, HFSDP_SINCOEFF1, HFSDP_COSCOEFF2, HFSDP_SINCOEFF2);
+    unsigned w;
+    for (w = 0; w < nwindows; ++w, samples += HFSDP_WINDOW_LENGTH)
+        sink += hfsdp_read_bit(&s, samples, HFSDP_WINDOW_LENGTH);
+}
+
+// Start detection, calibration and bits, as piezo_read_message() does.
+static unsigned receive_bits;
+static void run_receive(const int16_t *samples, unsigned nwindows)
+{
+    hfsdp_receiver_t r;
+    init_hfsdp_receiver(&r, NULL, 0, NULL);
+    unsigned w, bits = 0;
+    for (w = 0; w < nwindows; ++w, samples += HFSDP_WINDOW_LENGTH) {
+        int b = hfsdp_receive_bit(&r, samples);
+        if (b >= 0)
+            ++bits;
+    }
+    receive_bits = bits;
+}
+
+typedef struct {
+    const char *name;
+    void (*fn)(const int16_t *samples, unsigned nwindows);
+} dspbench_t;
+
+static const dspbench_t benchmarks[] = {
+    { "goetzel1",                   run_goetzel1 },
+    { "goetzel2",                   run_goetzel2 },
+    { "goetzel_bank, 4 bins",       run_bank4 },
+    { "goetzel_bank, 8 bins",       run_bank8 },
+    { "sliding goetzel, 2 bins",    run_sliding2 },
+    { "micfilter_process",          run_micfilter },
+    { "hfsdp_check_start",          run_check_start },
+    { "hfsdp_read_bit",             run_read_bit },
+    { "hfsdp_receive_bit",          run_receive },
+};
+
+// Nanoseconds per window.
+static double bench(const dspbench_t *bm, const dspbench_buffer_t *b, double seconds)
+{
+    if (bm->fn == run_micfilter)
+        memcpy(scratch, b->samples, sizeof(int16_t) * b->nwindows * HFSDP_WINDOW_LENGTH);
+
+    // Once to warm up.
+    bm->fn(b->samples, b->nwindows);
+
+    unsigned long windows = 0;
+    double start = wall_time(), elapsed;
+    do {
+        bm->fn(b->samples, b->nwindows);
+        windows += b->nwindows;
+        elapsed = wall_time() - start;
+    } while (elapsed < seconds);
+
+    return elapsed * 1e9 / windows;
+}
+
+int main(int argc, char **argv)
+{
+    const char *filename = NULL;
+    double ms = 200;
+    unsigned seed = 1;
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        char *eq = strchr(argv[i], '=');
+        if (! eq) {
+            fprintf(stderr, "Bad argument '%s'\n", argv[i]);
+            return 1;
+        }
+        *eq = '\0';
+        if (! strcmp(argv[i], "file"))
+            filename = eq + 1;
+        else if (! strcmp(argv[i], "ms"))
+            ms = atof(eq + 1);
+        else if (! strcmp(argv[i], "seed"))
+            seed = (unsigned)atoi(eq + 1);
+        else {
+            fprintf(stderr, "Unknown parameter '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < HFSDP_MFSK_MAX_TONES; ++i) {
+        double w = 2*M_PI*(HFSDP_MFSK_FIRST_BIN + i) / HFSDP_WINDOW_LENGTH;
+        mfsk_coeffs[i].cos_coeff = GOETZEL_FLOAT_TO_FIX(cos(w));
+        mfsk_coeffs[i].sin_coeff = GOETZEL_FLOAT_TO_FIX(sin(w));
+    }
+
+    srand(seed);
+    dspbench_buffer_t buffers[3];
+    unsigned nbuffers = 0;
+    make_signal(&buffers[nbuffers++]);
+    make_noise(&buffers[nbuffers++], buffers[0].nwindows);
+    if (filename) {
+        if (! read_samples(&buffers[nbuffers], filename))
+            return 1;
+        ++nbuffers;
+    }
+
+    printf("Window of %i samples at %.0fHz; the meter has %i cycles per window\n\n",
+           HFSDP_WINDOW_LENGTH, DSPBENCH_ADC_FREQ, HFSDP_SAMPLE_CYCLES);
+    printf("%-26s", "ns/sample (ns/window)");
+    unsigned j;
+    for (j = 0; j < nbuffers; ++j)
+        printf("  %-20s", buffers[j].name);
+    printf("\n");
+
+    unsigned k;
+    for (k = 0; k < sizeof(benchmarks)/sizeof(benchmarks[0]); ++k) {
+        printf("%-26s", benchmarks[k].name);
+        for (j = 0; j < nbuffers; ++j) {
+            double ns = bench(&benchmarks[k], &buffers[j], ms / 1000);
+            char s[32];
+            snprintf(s, sizeof(s), "%.2f (%.0f)", ns / HFSDP_WINDOW_LENGTH, ns);
+            printf("  %-20s", s);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    // So that it's clear the receiver got as far as reading bits.
+    run_receive(buffers[0].samples, buffers[0].nwindows);
+    printf("\nhfsdp_receive_bit read %u bits from the signal (the end of the preamble and %u data bits)\n",
+           receive_bits, DSPBENCH_BITS);
+
+    for (j = 0; j < nbuffers; ++j)
+        free(buffers[j].samples);
+    return 0;
+}
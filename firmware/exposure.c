@@ -9,7 +9,8 @@
 // any precision.)
 //
 // ISO is represented as an unsigned 8-bit quantity giving
-// 1/3-stops from ISO 6.
+// 1/3-stops from ISO 0.8, or as BCD digits giving the ISO
+// in tenths.
 
 #include <stddef.h>
 #include <stdint.h>
@@ -55,7 +56,9 @@ FOR_EACH_AMP_STAGE(CASE)
     uint_fast8_t bits2 = ev_diffs[absi*2+1];
 
     // See http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetKernighan
-    int32_t total_tenths = ((int32_t)(ev_abs[absi])) - (5*10);
+    // The table stores EV+5 so that values are never negative. We keep the
+    // offset until the end, since the fraction macros assume positive values.
+    int32_t total_tenths = (int32_t)(ev_abs[absi]);
     if (bits_to_add <= 8) {
          bits1 &= (0xFF >> (8 - bits_to_add));
          bits2 = 0;
@@ -117,7 +120,7 @@ FOR_EACH_AMP_STAGE(CASE)
 
     assert(lowest != 1000000 && highest != -1000000);
 
-    return (ev_with_fracs_t)((lowest + highest)/2);
+    return (ev_with_fracs_t)(((lowest + highest)/2) - (5*120));
 }
 
 #define pm_8_4_2(pm) (((pm) == PRECISION_MODE_EIGHTH) || ((pm) == PRECISION_MODE_QUARTER) || ((pm) == PRECISION_MODE_HALF))
@@ -302,86 +305,111 @@ void aperture_to_string(ev_with_fracs_t evwf, aperture_string_output_t *aso, pre
     aso->chars[aso->length] = '\0';
 }
 
-// Full stop ISO numbers (n * 10).
-static const uint32_t FULL_STOP_ISOS[] = {
-    8,16,30,60, 120, 250, 500, 1000, 2000, 4000, 8000, 16000, 32000, 64000,
-    125000, 250000, 500000, 1000000, 2000000, 4000000, 8000000, 16000000
-};
-#define FULL_STOP_ISO_AT(i) (FULL_STOP_ISOS[i])
-// Third stop ISO numbers (n * 10).
-static const uint32_t THIRD_STOP_ISOS[] = {
-    10, 12, 20, 25, 40, 50, 80, 100, 160, 200, 320, 400, 640, 800, 1250, 1600,
-    2500, 3200, 5000, 6400, 10000, 12500, 20000, 25000, 40000, 50000, 80000,
-    100000, 160000, 200000, 320000, 400000, 640000, 800000, 1250000, 1600000,
-    2500000, 3200000
-};
-#define THIRD_STOP_ISO_AT(i) (THIRD_STOP_ISOS[i])
+// See comments in calculate_tables.py for the format of ISO_THIRD_STOPS_BCD.
+#define ISO_THIRD_STOPS_BCD_ENTRY_SIZE 4
+#define ISO_MAX_THIRD_STOPS            (ISO_MAX_WHOLE_STOPS*3)
 
+// Writes the BCD digits of the ISO (in tenths) 'iso' third stops above
+// ISO 0.8. Returns the number of digits written (at most ISO_DECIMAL_MAX_DIGITS).
 unsigned iso_in_third_stops_to_bcd(uint_fast8_t iso, uint8_t *digits)
 {
-    uint_fast8_t whole = iso / 3;
-    uint_fast8_t frac = iso % 3;
+    if (iso > ISO_MAX_THIRD_STOPS)
+        iso = ISO_MAX_THIRD_STOPS;
+
+    // Above the end of the table, the scale repeats every ten thirds with
+    // an extra zero on the end.
+    uint_fast8_t zeros = 0;
+    if (iso >= ISO_THIRD_STOPS_BCD_ENTRIES) {
+        uint_fast8_t d = iso - ISO_THIRD_STOPS_BCD_DECADE_START;
+        zeros = d / 10;
+        iso = ISO_THIRD_STOPS_BCD_DECADE_START + (d % 10);
+    }
 
-    uint32_t isonum;
-    if (frac == 0)
-        isonum = FULL_STOP_ISO_AT(whole);
-    else
-        isonum = THIRD_STOP_ISO_AT(2*whole + frac - 1);
+    const uint8_t *entry = ISO_THIRD_STOPS_BCD + (iso*ISO_THIRD_STOPS_BCD_ENTRY_SIZE);
+    unsigned length = entry[0] + zeros;
+    assert(length <= ISO_DECIMAL_MAX_DIGITS);
 
-    return uint32_to_bcd(isonum, digits);
+    unsigned i;
+    for (i = 0; i < length; ++i)
+        digits[i] = (i < ISO_THIRD_STOPS_BCD_ENTRY_SIZE-1 ? entry[i+1] : 0);
+
+    return length;
 }
 
-uint_fast8_t iso_bcd_to_third_stops(uint8_t *digits, unsigned length)
+// Compares the ISO 'iso' third stops above ISO 0.8 with the given BCD ISO
+// (which must not have leading zeroes). Returns <0, 0 or >0 as for strcmp.
+static int iso_third_stops_cmp_bcd(uint_fast8_t iso, const uint8_t *digits, unsigned length)
 {
-    uint32_t isonum = bcd_to_uint32(digits, length);
+    uint8_t isodigits[ISO_DECIMAL_MAX_DIGITS];
+    unsigned isolength = iso_in_third_stops_to_bcd(iso, isodigits);
+
+    if (isolength != length)
+        return (int)isolength - (int)length;
 
     unsigned i;
-    uint_fast8_t fullstop = 0;
-    for (i = 0; i < sizeof(FULL_STOP_ISOS)/sizeof(FULL_STOP_ISOS[0]); ++i) {
-        uint32_t n = FULL_STOP_ISOS[i];
-        if (isonum == n)
-            return i*3;
-        if (isonum > n)
-            fullstop = i;
-    }
-
-    // It's not a full stop ISO, so now we want to find the closest third-stop
-    // ISO. The 'fullstop' variable contains the value (in full stops) of the
-    // full stop ISO immediately above our given ISO. We now need to look at
-    // the third-stops one third and two-thirds above this one, and see which
-    // of the three is the closest match.
-    uint32_t nothirdsabove = FULL_STOP_ISO_AT(fullstop);
-    uint_fast8_t fullstopm = fullstop*2;
-    uint32_t onethirdabove = THIRD_STOP_ISO_AT(fullstopm);
-    uint32_t twothirdsabove = THIRD_STOP_ISO_AT(fullstopm+1);
-
-    int32_t diff1 = nothirdsabove - isonum;
-    int32_t diff2 = onethirdabove - isonum;
-    int32_t diff3 = twothirdsabove - isonum;
-    if (diff1 < 0)
-        diff1 = -diff1;
-    if (diff2 < 0)
-        diff2 = -diff2;
-    if (diff3 < 0)
-        diff3 = -diff3;
-
-    if (diff1 <= diff2 && diff1 <= diff3) {
-        return fullstop*3;
+    for (i = 0; i < length; ++i) {
+        if (isodigits[i] != digits[i])
+            return (int)isodigits[i] - (int)digits[i];
     }
-    else {
-        uint_fast8_t t = fullstop*3 + 1;
-        if (! (diff2 <= diff1 && diff2 <= diff3))
-            ++t;
-        return t;
+
+    return 0;
+}
+
+// Gives the value of a BCD number when all three numbers being compared
+// are scaled down to fit in 9 digits (and hence in a uint32_t).
+static uint32_t bcd_to_uint32_at_length(uint8_t *digits, unsigned length, unsigned max_length)
+{
+    unsigned drop = (max_length > 9 ? max_length - 9 : 0);
+    if (length <= drop)
+        return 0;
+    return bcd_to_uint32(digits, length - drop);
+}
+
+// Accepts any ISO (in tenths) and returns the nearest third-stop ISO.
+uint_fast8_t iso_bcd_to_third_stops(uint8_t *digits, unsigned length)
+{
+    // Skip leading zeroes.
+    for (; length > 0 && digits[0] == 0; ++digits, --length);
+    if (length == 0)
+        return 0;
+
+    if (iso_third_stops_cmp_bcd(0, digits, length) >= 0)
+        return 0;
+    if (iso_third_stops_cmp_bcd(ISO_MAX_THIRD_STOPS, digits, length) <= 0)
+        return ISO_MAX_THIRD_STOPS;
+
+    // Binary search for the third-stop ISOs immediately below and above the
+    // given ISO.
+    uint_fast8_t lo = 0, hi = ISO_MAX_THIRD_STOPS;
+    while (hi - lo > 1) {
+        uint_fast8_t mid = (lo + hi) >> 1;
+        int c = iso_third_stops_cmp_bcd(mid, digits, length);
+        if (c == 0)
+            return mid;
+        else if (c < 0)
+            lo = mid;
+        else
+            hi = mid;
     }
+
+    // Now see which of the two is closer.
+    uint8_t lodigits[ISO_DECIMAL_MAX_DIGITS], hidigits[ISO_DECIMAL_MAX_DIGITS];
+    unsigned lolength = iso_in_third_stops_to_bcd(lo, lodigits);
+    unsigned hilength = iso_in_third_stops_to_bcd(hi, hidigits);
+    uint32_t lon = bcd_to_uint32_at_length(lodigits, lolength, hilength);
+    uint32_t hin = bcd_to_uint32_at_length(hidigits, hilength, hilength);
+    uint32_t isonum = bcd_to_uint32_at_length(digits, length, hilength);
+
+    if (isonum - lon <= hin - isonum)
+        return lo;
+    else
+        return hi;
 }
 
-// This is called by the following macros defined in exposure.h:
-//
-//     aperture_given_shutter_speed_iso_ev(shutter_speed,iso,ev)
-//     shutter_speed_given_aperture_iso_ev(aperture,iso,ev)
-//     iso_given_aperture_shutter_speed(aperture, shutter_speed)
-ev_with_fracs_t z_given_x_y_ev(ev_with_fracs_t given_x_, ev_with_fracs_t given_y_, ev_with_fracs_t evwf, uint_fast8_t x) // x=0: aperture, x=1: shutter_speed
+// As z_given_x_y_ev, but without clamping the result to the valid range. This
+// is useful when stepping the result (e.g. for bracketing), since a clamped
+// base value would shift every step.
+int32_t z_given_x_y_ev_unclamped(ev_with_fracs_t given_x_, ev_with_fracs_t given_y_, ev_with_fracs_t evwf, uint_fast8_t x) // x=0: aperture, x=1: shutter_speed
 {
     // We use an internal represenation of values in 1/120 EV steps. This permits
     // exact division by 8, 10 and 3.
@@ -397,7 +425,6 @@ ev_with_fracs_t z_given_x_y_ev(ev_with_fracs_t given_x_, ev_with_fracs_t given_y
     int32_t given_ev = ev_with_fracs_to_int32_120th(evwf);
 
     int32_t r;
-    int32_t min, max;
     if (x == 0) {
         int32_t shut_adjusted = the_ev + given_x - the_speed;
 
@@ -405,7 +432,6 @@ ev_with_fracs_t z_given_x_y_ev(ev_with_fracs_t given_x_, ev_with_fracs_t given_y
         r = the_aperture + evdiff;
         // Adjust for difference between reference ISO and actual ISO.
         r += given_y - the_iso;
-        min = AP_MIN_WHOLE_STOPS*120, max = AP_MAX_WHOLE_STOPS*120;
     }
     else if (x == 1) {
         int32_t ap_adjusted = the_ev + given_x - the_aperture;
@@ -413,7 +439,6 @@ ev_with_fracs_t z_given_x_y_ev(ev_with_fracs_t given_x_, ev_with_fracs_t given_y
         r = the_speed + evdiff;
         // Adjust for difference between reference ISO and actual ISO.
         r += given_y - the_iso;
-        min = SHUTTER_SPEED_MIN_WHOLE_STOPS*120, max = SHUTTER_SPEED_MAX_WHOLE_STOPS*120;
     }
     else if (x == 2) {
         int32_t iso_adjusted = the_ev + given_x - the_aperture;
@@ -421,12 +446,31 @@ ev_with_fracs_t z_given_x_y_ev(ev_with_fracs_t given_x_, ev_with_fracs_t given_y
         r = the_iso + evdiff;
         // Adjust for difference between reference shutter speed and actual shutter speed.
         r += given_y - the_speed;
-        min = ISO_MIN_WHOLE_STOPS*120, max = ISO_MAX_WHOLE_STOPS*120;
     }
     else {
         assert(0);
     }
 
+    return r;
+}
+
+// This is called by the following macros defined in exposure.h:
+//
+//     aperture_given_shutter_speed_iso_ev(shutter_speed,iso,ev)
+//     shutter_speed_given_aperture_iso_ev(aperture,iso,ev)
+//     iso_given_aperture_shutter_speed(aperture, shutter_speed)
+ev_with_fracs_t z_given_x_y_ev(ev_with_fracs_t given_x, ev_with_fracs_t given_y, ev_with_fracs_t evwf, uint_fast8_t x) // x=0: aperture, x=1: shutter_speed
+{
+    int32_t r = z_given_x_y_ev_unclamped(given_x, given_y, evwf, x);
+
+    int32_t min, max;
+    if (x == 0)
+        min = AP_MIN_WHOLE_STOPS*120, max = AP_MAX_WHOLE_STOPS*120;
+    else if (x == 1)
+        min = SHUTTER_SPEED_MIN_WHOLE_STOPS*120, max = SHUTTER_SPEED_MAX_WHOLE_STOPS*120;
+    else
+        min = ISO_MIN_WHOLE_STOPS*120, max = ISO_MAX_WHOLE_STOPS*120;
+
     if (r < min)
         r = min;
     else if (r > max)
@@ -541,60 +585,157 @@ ev_with_fracs_t fps_and_angle_to_shutter_speed(uint_fast16_t fps, uint_fast16_t
     return ret;
 }
 
-#define EXP2_PRECISION 8
-static int32_t int32_exp2(int32_t x)
+//
+// Illuminance is calculated and formatted using a decimal mantissa/exponent
+// representation, so that the full range of EV values can be handled using
+// only 32-bit integer arithmetic. The mantissa always has exactly nine
+// decimal digits.
+//
+
+#define ILLUMINANCE_MANTISSA_MIN 100000000
+#define ILLUMINANCE_MANTISSA_MAX 999999999
+
+// Python 3: [round(2.5*2**(a/10)*1e8) for a in range(10)]
+static const uint32_t LUX_AT_EV100_TENTHS[] = {
+    250000000, 267943366, 287174589, 307786103, 329876978, 353553391, 378929142, 406126198, 435275282, 466516496
+};
+// Python 3: [round((2**(b/120)-1)*65536) for b in range(12)]
+static const uint16_t EV_120THS_TO_Q16_FACTOR[] = {
+    0, 380, 761, 1146, 1532, 1920, 2311, 2704, 3099, 3497, 3897, 4299
+};
+// 1 lux = 0.09290304 footcandles. Stored as (0.9290304 * 2^16) with the
+// factor of 10 applied to the exponent.
+#define LUX_TO_FOOTCANDLES_Q16 60885
+
+// Returns (x * k) >> 16 without 64-bit multiplication.
+static uint32_t mul_q16(uint32_t x, uint_fast16_t k)
 {
-    const int32_t V_0_5 = 128;
-    const int32_t V_0_11 = 28;
-    const int32_t V_0_02 = 5;
-    const int32_t EXP2_0_5 = 362;
-    const int32_t EXP2_0_11 = 276;
-    const int32_t EXP2_0_02 = 260;
-
-    int32_t ix = x >> EXP2_PRECISION;
-    int32_t ir = 1 << EXP2_PRECISION;
-    unsigned i;
-    for (i = 0; i < ix; ++i)
-        ir *= 2;
-
-    int32_t ifl = x & (0xFFFFFFFF >> (32 - EXP2_PRECISION));
-    int32_t m = 1 << EXP2_PRECISION;
-    while (ifl > V_0_02) {
-        if (ifl >= V_0_5) {
-            ifl -= V_0_5;
-            m *= EXP2_0_5;
-        }
-        else if (ifl >= V_0_11) {
-            ifl -= V_0_11;
-            m *= EXP2_0_11;
+    return ((x >> 16) * k) + (((x & 0xFFFF) * k) >> 16);
+}
+
+static void illuminance_normalize(illuminance_t *ill)
+{
+    while (ill->mantissa > ILLUMINANCE_MANTISSA_MAX) {
+        ill->mantissa = (ill->mantissa + 5) / 10;
+        ++(ill->exponent);
+    }
+    while (ill->mantissa < ILLUMINANCE_MANTISSA_MIN) {
+        ill->mantissa *= 10;
+        --(ill->exponent);
+    }
+}
+
+// Lux = 2.5 * 2^EV (see illuminance_to_ev_at_100 in calculate_tables.py).
+void ev_at_100_to_lux(ev_with_fracs_t evwf, illuminance_t *ill)
+{
+    int32_t ev = ev_with_fracs_to_int32_120th(evwf);
+    int32_t wholes = ev / 120;
+    int32_t fracs = ev % 120;
+    if (fracs < 0) {
+        fracs += 120;
+        --wholes;
+    }
+
+    uint32_t m = LUX_AT_EV100_TENTHS[fracs / 12];
+    m += mul_q16(m, EV_120THS_TO_Q16_FACTOR[fracs % 12]);
+    ill->mantissa = m;
+    ill->exponent = -8;
+
+    // Multiply/divide by 2 for each whole stop, keeping the mantissa in
+    // range as we go.
+    for (; wholes > 0; --wholes) {
+        ill->mantissa <<= 1;
+        if (ill->mantissa > ILLUMINANCE_MANTISSA_MAX) {
+            ill->mantissa = (ill->mantissa + 5) / 10;
+            ++(ill->exponent);
         }
-        else {
-            ifl -= V_0_02;
-            m *= EXP2_0_02;
+    }
+    for (; wholes < 0; ++wholes) {
+        ill->mantissa = (ill->mantissa + 1) >> 1;
+        if (ill->mantissa < ILLUMINANCE_MANTISSA_MIN) {
+            ill->mantissa *= 10;
+            --(ill->exponent);
         }
-        m >>= EXP2_PRECISION;
     }
 
-    return (m * ir) >> EXP2_PRECISION;
+    illuminance_normalize(ill);
 }
 
-static int32_t ev_at_100_to_lux(ev_with_fracs_t evwf)
+void lux_to_footcandles(illuminance_t *ill)
 {
-    int32_t ev = ev_with_fracs_to_int32_256th(evwf);
-    ev = int32_exp2(ev);
-    ev += ev + (ev/2); // Multiply by 2.5
-    return ev;
+    ill->mantissa = mul_q16(ill->mantissa, LUX_TO_FOOTCANDLES_Q16);
+    --(ill->exponent);
+    illuminance_normalize(ill);
 }
 
-unsigned ev_at_100_to_bcd_lux(ev_with_fracs_t evwf, uint8_t *digits)
+// Writes the illuminance as BCD digits rounded to the given number of
+// significant figures, and sets *dps to the number of digits following the
+// decimal point. Values less than 1 get a single leading zero before the
+// decimal point. Returns the number of digits.
+unsigned illuminance_to_bcd(const illuminance_t *ill, uint_fast8_t sigfigs, uint8_t *digits, uint_fast8_t *dps)
 {
-    int32_t lux = ev_at_100_to_lux(evwf);
+    assert(sigfigs > 0 && sigfigs <= ILLUMINANCE_MAX_SIGFIGS);
+
+    uint8_t mdigits[9];
+    uint32_to_bcd(ill->mantissa, mdigits);
 
-    // Convert from 256ths to 100ths.
-    lux *= 100;
-    lux >>= EXP2_PRECISION;
+    // Number of digits before the decimal point.
+    int_fast8_t intdigits = ill->exponent + 9;
 
-    return uint32_to_bcd(lux, digits);
+    // Round to the requested number of significant figures.
+    if (mdigits[sigfigs] >= 5) {
+        int_fast8_t i;
+        for (i = sigfigs-1; i >= 0; --i) {
+            if (++mdigits[i] < 10)
+                break;
+            mdigits[i] = 0;
+        }
+        if (i < 0) { // E.g. 999 -> 1000.
+            mdigits[0] = 1;
+            ++intdigits;
+        }
+    }
+
+    unsigned l = 0;
+    uint_fast8_t i;
+    if (intdigits <= 0) {
+        digits[l++] = 0;
+        for (i = 0; i < -intdigits; ++i)
+            digits[l++] = 0;
+        *dps = sigfigs - intdigits;
+    }
+    else if (intdigits < sigfigs) {
+        *dps = sigfigs - intdigits;
+    }
+    else {
+        *dps = 0;
+    }
+
+    for (i = 0; i < sigfigs; ++i)
+        digits[l++] = mdigits[i];
+    for (i = sigfigs; i < intdigits; ++i)
+        digits[l++] = 0;
+
+    assert(l <= ILLUMINANCE_BCD_MAX_DIGITS);
+
+    return l;
+}
+
+void illuminance_to_string(const illuminance_t *ill, uint_fast8_t sigfigs, illuminance_string_output_t *iso)
+{
+    uint8_t digits[ILLUMINANCE_BCD_MAX_DIGITS];
+    uint_fast8_t dps;
+    unsigned length = illuminance_to_bcd(ill, sigfigs, digits, &dps);
+
+    uint_fast8_t i, last = 0;
+    for (i = 0; i < length; ++i) {
+        if (length - i == dps)
+            iso->chars[last++] = '.';
+        iso->chars[last++] = '0' + digits[i];
+    }
+
+    iso->chars[last] = '\0';
+    iso->length = last;
 }
 
 ev_with_fracs_t compensate_using_poly(ev_with_fracs_t evwf, const exposure_poly_t *poly)
@@ -618,18 +759,87 @@ ev_with_fracs_t compensate_using_poly(ev_with_fracs_t evwf, const exposure_poly_
 
 #include <stdio.h>
 #include <math.h>
-extern const uint_fast8_t TEST_VOLTAGE_TO_EV[];
+#include <time.h>
 
-static void print_bcd(uint8_t *digits, uint_fast8_t length, uint_fast8_t sigfigs, uint_fast8_t dps)
+static float evwf_to_float(ev_with_fracs_t evwf)
 {
-    uint8_t buf[length+2];
-    bcd_to_string_fp(digits, length, buf, sigfigs, dps);
-    printf("%s", buf);
+    return ((float)evwf)/120.0f;
 }
 
-static float evwf_to_float(ev_with_fracs_t evwf)
+// How many 1/x EV steps the value 'c' (in 1/120 EV), once rounded to the
+// nearest 1/x EV, is from the model value 'm'. Where 'm' falls exactly half
+// way between two steps, either is accepted.
+static int32_t xths_error(int32_t c, int32_t m, int32_t x)
 {
-    return ((float)evwf)/120.0f;
+    double cx = floor(c*x/120.0 + 0.5), mx = m*x/120.0;
+    double d = fabs(cx - mx) - 0.5;
+    return d <= 0 ? 0 : (int32_t)ceil(d);
+}
+
+// Checks get_ev100_at_voltage() against the model in calculate_tables.py for
+// every stage and voltage, then times it. Returns the number of mismatches.
+static unsigned test_get_ev100_at_voltage()
+{
+    printf("get_ev100_at_voltage vs model\n");
+
+    uint_fast8_t stage;
+    unsigned voltage;
+    int32_t max_120ths = 0, max_tenths = 0, max_eighths = 0, max_thirds = 0;
+    unsigned bad = 0;
+    for (stage = 1; stage <= NUM_AMP_STAGES; ++stage) {
+        int32_t stage_120ths = 0, stage_tenths = 0, stage_eighths = 0, stage_thirds = 0;
+        for (voltage = VOLTAGE_TO_EV_ABS_OFFSET; voltage <= 255; ++voltage) {
+            int32_t c = get_ev100_at_voltage(voltage, stage);
+            int32_t m = TEST_VOLTAGE_TO_EV120[(stage-1)*TEST_VOLTAGE_TO_EV120_STAGE_LENGTH + voltage - VOLTAGE_TO_EV_ABS_OFFSET];
+
+            int32_t et = xths_error(c, m, 10), ee = xths_error(c, m, 8), e3 = xths_error(c, m, 3);
+            int32_t e120 = c > m ? c - m : m - c;
+            if (et > 0 || ee > 0 || e3 > 0) {
+                printf("    BAD: stage %i voltage %i -> %.3f, model %.3f\n", stage, voltage, evwf_to_float(c), evwf_to_float(m));
+                ++bad;
+            }
+            if (e120 > stage_120ths)
+                stage_120ths = e120;
+            if (et > stage_tenths)
+                stage_tenths = et;
+            if (ee > stage_eighths)
+                stage_eighths = ee;
+            if (e3 > stage_thirds)
+                stage_thirds = e3;
+        }
+        printf("    Stage %i max error: %i/120, %i tenths, %i eighths, %i thirds\n", stage, stage_120ths, stage_tenths, stage_eighths, stage_thirds);
+        if (stage_120ths > max_120ths)
+            max_120ths = stage_120ths;
+        if (stage_tenths > max_tenths)
+            max_tenths = stage_tenths;
+        if (stage_eighths > max_eighths)
+            max_eighths = stage_eighths;
+        if (stage_thirds > max_thirds)
+            max_thirds = stage_thirds;
+    }
+    printf("Max error: %i/120, %i tenths, %i eighths, %i thirds %s\n", max_120ths, max_tenths, max_eighths, max_thirds, bad == 0 ? "OK" : "FAIL");
+
+    // The lookup is called through a volatile pointer so that it isn't
+    // inlined and hoisted out of the loop over 'reps' (exposuretest is built
+    // with -O2 so that the time means something).
+    ev_with_fracs_t (*volatile lookup)(uint_fast8_t, uint_fast8_t) = get_ev100_at_voltage;
+    const unsigned reps = 2000;
+    volatile int32_t sink = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned r;
+    for (r = 0; r < reps; ++r) {
+        for (stage = 1; stage <= NUM_AMP_STAGES; ++stage) {
+            for (voltage = VOLTAGE_TO_EV_ABS_OFFSET; voltage <= 255; ++voltage)
+                sink += lookup(voltage, stage);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ns = (end.tv_sec - start.tv_sec)*1e9 + (end.tv_nsec - start.tv_nsec);
+    unsigned lookups = reps * NUM_AMP_STAGES * (256 - VOLTAGE_TO_EV_ABS_OFFSET);
+    printf("get_ev100_at_voltage: %.1f ns per lookup (%u lookups)\n", ns/lookups, lookups);
+
+    return bad;
 }
 
 int main()
@@ -639,37 +849,35 @@ int main()
     ev_with_fracs_t iso100;
     ev_with_fracs_init_from_wholes(iso100, 7);
 
-    printf("ev for voltages 0-255 at stage...\n");
-    uint8_t stage, voltage;
-    for (stage = 1; stage < NUM_AMP_STAGES; ++stage) {
-        printf("Stage %i\n", stage);
-        for (voltage = VOLTAGE_TO_EV_ABS_OFFSET; voltage < 255; ++voltage) {
-            ev_with_fracs_t evwf = get_ev100_at_voltage(voltage, stage);
-            printf("    EV@100: %i -> %.1f (%.3f)\n", voltage, evwf_to_float(evwf), evwf_to_float(evwf));
-        }
-    }
+    unsigned failures = test_get_ev100_at_voltage();
 
     printf("\n");
 
-    // TODO: Bugs in print_bcd; some kind of overflow issue for larger ev values.
     ev_with_fracs_t evat100;
     int32_t ev10;
-    printf("ev_at_100_to_bcd_lux\n");
-    for (ev10 = 0; ev10 < 10*10; ++ev10) {
-        float fev = ((float)ev10)/10.0;
-        float flux = pow(2.0, fev) * 2.5;
+    float max_lux_error = 0;
+    printf("ev_at_100_to_lux\n");
+    for (ev10 = -5*10; ev10 <= 26*10; ++ev10) {
+        float flux = pow(2.0, ((float)ev10)/10.0) * 2.5;
         ev_with_fracs_init_from_tenths(evat100, ev10);
-        uint8_t lux_digits[EV_AT_100_TO_BCD_LUX_BCD_LENGTH];
-        unsigned dl = ev_at_100_to_bcd_lux(evat100, lux_digits);
-        print_bcd(lux_digits, dl, 3, 2);
-        printf(" [%i] ", dl);
-        printf(" EV@100 %f = ", (((float)ev_with_fracs_to_int32_120th(evat100))/120.0));
-        unsigned x;
-        for (x = 0; x < dl; ++x)
-            printf("%c", lux_digits[x] + '0');
-        printf("\n");
+        illuminance_t lux, fc;
+        ev_at_100_to_lux(evat100, &lux);
+        fc = lux;
+        lux_to_footcandles(&fc);
+
+        float clux = ((float)lux.mantissa) * pow(10.0, lux.exponent);
+        float err = fabs(clux - flux) / flux;
+        if (err > max_lux_error)
+            max_lux_error = err;
+
+        illuminance_string_output_t luxstr, fcstr;
+        illuminance_to_string(&lux, 3, &luxstr);
+        illuminance_to_string(&fc, 3, &fcstr);
+        printf("    EV@100 %.1f = %s lux (%f) = %s fc\n", ((float)ev10)/10.0, ILLUMINANCE_STRING_OUTPUT_STRING(luxstr), flux, ILLUMINANCE_STRING_OUTPUT_STRING(fcstr));
     }
-
+    printf("Max relative lux error: %g %s\n\n", max_lux_error, max_lux_error < 1e-4 ? "OK" : "FAIL");
+    if (max_lux_error >= 1e-4)
+        ++failures;
 
     printf("fps_and_angle_to_shutter_speed\n");
     uint_fast16_t fps;
@@ -869,6 +1077,20 @@ int main()
 
         printf("ISO %s/10 = %.2f stops from ISO 0.8\n", isodigits, ((float)stops)/3.0);
     }
+
+    printf("\nTesting iso_in_third_stops_to_bcd round trip\n");
+    for (is = ISO_MIN_WHOLE_STOPS*3; is <= ISO_MAX_WHOLE_STOPS*3; ++is) {
+        uint8_t isodigits[ISO_DECIMAL_MAX_DIGITS+1];
+        unsigned length = iso_in_third_stops_to_bcd(is, isodigits);
+        uint_fast8_t back = iso_bcd_to_third_stops(isodigits, length);
+        bcd_to_string(isodigits, length);
+        printf("%s %i -> ISO %s/10 -> %i\n", back == is ? "OK  " : "FAIL", is, isodigits, back);
+        if (back != is)
+            ++failures;
+    }
+
+    printf("\n%u FAIL\n", failures);
+    return failures != 0;
 }
 
 #endif
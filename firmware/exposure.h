@@ -3,7 +3,8 @@
 
 #include <stdint.h>
 
-#define ISO_DECIMAL_MAX_DIGITS         7
+// ISOs are stored as BCD in tenths; ISO 0.8 * 2^ISO_MAX_WHOLE_STOPS has 16 digits.
+#define ISO_DECIMAL_MAX_DIGITS         16
 #define AP_MIN_WHOLE_STOPS             0
 #define AP_MAX_WHOLE_STOPS             10
 #define SHUTTER_SPEED_MIN_WHOLE_STOPS  0
@@ -74,6 +75,7 @@ typedef int_fast16_t ev_with_fracs_t;
 enum precision_mode;
 void shutter_speed_to_string(ev_with_fracs_t shutter_speed, shutter_string_output_t *eso, enum precision_mode precision_mode);
 void aperture_to_string(ev_with_fracs_t aperture, aperture_string_output_t *aso, enum precision_mode precision_mode);
+int32_t z_given_x_y_ev_unclamped(ev_with_fracs_t given_x, ev_with_fracs_t given_y, ev_with_fracs_t evwf, uint_fast8_t x);
 ev_with_fracs_t z_given_x_y_ev(ev_with_fracs_t given_x, ev_with_fracs_t given_y, ev_with_fracs_t evwf, uint_fast8_t x);
 #define aperture_given_shutter_speed_iso_ev(a,b,c) z_given_x_y_ev((a),(b),(c),0)
 #define shutter_speed_given_aperture_iso_ev(a,b,c) z_given_x_y_ev((a),(b),(c),1)
@@ -87,9 +89,26 @@ uint_fast8_t iso_bcd_to_third_stops(uint8_t *digits, unsigned length);
 ev_with_fracs_t get_ev100_at_voltage(uint_fast8_t voltage, uint_fast8_t op_amp_resistor_stage);
 uint_fast8_t convert_from_reference_voltage(uint_fast16_t adc_out);
 
-unsigned ev_at_100_to_bcd_lux(ev_with_fracs_t evwf, uint8_t *digits);
-#define EV_AT_100_TO_BCD_LUX_RESULT_PRECISION 2
-#define EV_AT_100_TO_BCD_LUX_BCD_LENGTH       (7+EV_AT_100_TO_BCD_LUX_RESULT_PRECISION)
+// Illuminance is mantissa*10^exponent, where the mantissa always has nine digits.
+typedef struct illuminance {
+    uint32_t mantissa;
+    int8_t exponent;
+} illuminance_t;
+
+#define ILLUMINANCE_MAX_SIGFIGS    6
+// Enough for lux and footcandles over the full -5..26 EV range.
+#define ILLUMINANCE_BCD_MAX_DIGITS 10
+
+typedef struct illuminance_string_output {
+    uint8_t chars[ILLUMINANCE_BCD_MAX_DIGITS+2];
+    uint8_t length; // Does not include null terminator.
+} illuminance_string_output_t;
+#define ILLUMINANCE_STRING_OUTPUT_STRING(iso) ((iso).chars)
+
+void ev_at_100_to_lux(ev_with_fracs_t evwf, illuminance_t *ill);
+void lux_to_footcandles(illuminance_t *ill);
+unsigned illuminance_to_bcd(const illuminance_t *ill, uint_fast8_t sigfigs, uint8_t *digits, uint_fast8_t *dps);
+void illuminance_to_string(const illuminance_t *ill, uint_fast8_t sigfigs, illuminance_string_output_t *iso);
 
 // Note that these give the eighth/third immediately <= the nearest tenth
 // (i.e. they don't round up).
@@ -0,0 +1,70 @@
+#include <stm32f0xx.h>
+#include <myassert.h>
+#include <flash.h>
+
+//
+// Flash programming, following section 3 of the STM32F030 reference
+// manual (RM0360). Flash is written a half word at a time, and can only
+// change bits from 1 to 0, so a page has to be erased (to all 1s) before
+// it's rewritten.
+//
+
+static void unlock()
+{
+    if (FLASH->CR & FLASH_CR_LOCK) {
+        FLASH->KEYR = FLASH_FKEY1;
+        FLASH->KEYR = FLASH_FKEY2;
+    }
+}
+
+static void lock()
+{
+    FLASH->CR |= FLASH_CR_LOCK;
+}
+
+// Waits for the current operation and returns true if it succeeded.
+static bool wait()
+{
+    while (FLASH->SR & FLASH_SR_BSY)
+        ;
+    uint32_t sr = FLASH->SR;
+    FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+    return (sr & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)) == 0;
+}
+
+// 'address' is the start of the page.
+bool flash_erase_page(uint32_t address)
+{
+    assert(address % FLASH_PAGE_SIZE == 0);
+
+    unlock();
+    FLASH->CR |= FLASH_CR_PER;
+    FLASH->AR = address;
+    FLASH->CR |= FLASH_CR_STRT;
+    bool ok = wait();
+    FLASH->CR &= ~FLASH_CR_PER;
+    lock();
+
+    return ok;
+}
+
+// 'address' and 'length' must be even, and the flash must have been erased.
+// Returns false if anything doesn't read back as written.
+bool flash_write(uint32_t address, const uint8_t *data, unsigned length)
+{
+    assert(address % 2 == 0 && length % 2 == 0);
+
+    unlock();
+    FLASH->CR |= FLASH_CR_PG;
+    bool ok = true;
+    unsigned i;
+    for (i = 0; i < length && ok; i += 2) {
+        uint16_t v = data[i] | (data[i+1] << 8);
+        *(__IO uint16_t *)(address + i) = v;
+        ok = wait() && *(__IO uint16_t *)(address + i) == v;
+    }
+    FLASH->CR &= ~FLASH_CR_PG;
+    lock();
+
+    return ok;
+}
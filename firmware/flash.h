@@ -0,0 +1,28 @@
+#ifndef FLASH_H
+#define FLASH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FLASH_PAGE_SIZE  1024
+#define FLASH_START      0x08000000
+#define FLASH_PAGE(n)    (FLASH_START + (n)*FLASH_PAGE_SIZE)
+
+// Flash layout, in pages. The linker scripts (stm/STM32F030K6_BOOT.ld for
+// the bootloader, stm/STM32F030K6_FLASH.ld for the application) have to
+// agree with this.
+//
+//     0-     Bootloader (boot.c), with the audio receiver and update.c,
+//            which the application shares (see SHARED_OBJS in the Makefile)
+//     -29    Application, from the first page after the bootloader
+//            (_app_start, see update.h). An update is written straight
+//            over it.
+//     30     Update control page (update.h)
+//     31     Saved meter state (state.c)
+#define FLASH_UPDATE_CONTROL_PAGE 30
+#define FLASH_STATE_PAGE          FLASH_PAGE(31)
+
+bool flash_erase_page(uint32_t address);
+bool flash_write(uint32_t address, const uint8_t *data, unsigned length);
+
+#endif
@@ -7,6 +7,8 @@
 #ifdef TEST
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include <assert.h>
 #endif
 
@@ -15,15 +17,16 @@ static inline int32_t MUL(int32_t x, int32_t y)
     return (x * y) >> (GOETZEL_ADC_VAL_BITS-1);
 }
 
-static inline int64_t MUL64(int64_t x, int64_t y)
-{
-    return (x * y) >> (GOETZEL_ADC_VAL_BITS-1);
-}
-
 //
 // The following macros generate a goetzelN function which calculates the power
 // of N specified frequencies in the given sample buffer.
 //
+// Headroom: samples have GOETZEL_ADC_VAL_BITS bits, so |x| <= 2^11. Each bin's
+// state is bounded by length*2^11/sin(w), and MUL multiplies it by a
+// coefficient of at most 2^12, so the product stays within 32 bits as long as
+// length/sin(w) < 2^8 (e.g. 80 samples at w >= 0.32 rad, which covers bins
+// above ~4.5kHz at our sample rate).
+//
 
 #define INLINE_COUNT 8
 #define INLINE(N, M) M(N) M(N) M(N) M(N) M(N) M(N) M(N) M(N)
@@ -52,28 +55,36 @@ static inline int64_t MUL64(int64_t x, int64_t y)
                          dest ## n ->length = length;
 
 #define LOOP_BODY(N)                            \
-    i = i_ % length;                            \
-    samplesi = samples[i];                      \
+    samplesi = *p++;                            \
     total_power += MUL(samplesi, samplesi);     \
     N(GET_S)                                    \
-    N(SET_PREVS)                                \
-    ++i_;
+    N(SET_PREVS)
 
+// The buffer is read circularly starting from 'offset'. This is done as two
+// linear runs rather than taking the index modulo 'length' for each sample,
+// since the M0 has no divide instruction.
 #define MAKE_GOETZEL_N(n, N)                                                                       \
     void goetzel ## n (const int16_t *samples, unsigned length, unsigned offset N(PARAMS) N(DESTS))\
     {                                                                                              \
+        assert(offset < length || (offset == 0 && length == 0));                                   \
+                                                                                                   \
         int32_t total_power = 0;                                                                   \
                                                                                                    \
         N(PREVS)                                                                                   \
         N(COS2)                                                                                    \
                                                                                                    \
-        int i_, i;                                                                                 \
+        const int16_t *p = samples + offset, *end = samples + length;                              \
         int32_t samplesi;                                                                          \
-        for (i_ = offset; i_ < offset + length;) {                                                 \
-            INLINE(N, LOOP_BODY)                                                                   \
-        }                                                                                          \
-        for (; i_ < offset + length;) {                                                            \
-            LOOP_BODY(N);                                                                          \
+        unsigned run;                                                                              \
+        for (run = 0; run < 2; ++run) {                                                            \
+            while (p + INLINE_COUNT <= end) {                                                      \
+                INLINE(N, LOOP_BODY)                                                               \
+            }                                                                                      \
+            while (p < end) {                                                                      \
+                LOOP_BODY(N)                                                                       \
+            }                                                                                      \
+            p = samples;                                                                           \
+            end = samples + offset;                                                                \
         }                                                                                          \
         N(GET_R)                                                                                   \
         N(SETDEST)                                                                                 \
@@ -87,15 +98,209 @@ static inline int64_t MUL64(int64_t x, int64_t y)
 MAKE_GOETZEL_N(1, ONE)
 MAKE_GOETZEL_N(2, TWO)
 
+// Runs Goetzel for any number of bins. Bins are processed two at a time: on
+// the M0 the state and coefficients for two bins fit in the low registers
+// along with the sample pointer, whereas a wider pass spills bin state to the
+// stack on every sample. Re-reading the samples for each pair of bins costs
+// much less than that.
+void goetzel_bank(const int16_t *samples, unsigned length, unsigned offset,
+                  const goetzel_coeffs_t *coeffs, goetzel_result_t *dests, unsigned nbins)
+{
+    unsigned b;
+    for (b = 0; b + 2 <= nbins; b += 2) {
+        goetzel2(samples, length, offset,
+                 coeffs[b].cos_coeff, coeffs[b].sin_coeff,
+                 coeffs[b+1].cos_coeff, coeffs[b+1].sin_coeff,
+                 dests + b, dests + b + 1);
+    }
+    if (b < nbins)
+        goetzel1(samples, length, offset, coeffs[b].cos_coeff, coeffs[b].sin_coeff, dests + b);
+}
+
+// Power of the frequency, i.e. (r^2 + i^2) / (2^11 * length), using only
+// 32-bit arithmetic.
+//
+// r and i are at most length*2^11 in magnitude. They're shifted down by k
+// bits until both are below 2^15, so that r^2 + i^2 < 2^31. This loses at
+// most 2^-14 relative precision. The sum is then scaled by 2^(2k-11). For
+// length <= GOETZEL_MAX_POWER_LENGTH, k <= 6, so the scaling is at worst a
+// left shift by one, which still fits in 32 unsigned bits.
 int32_t goetzel_get_freq_power(const goetzel_result_t *gr)
 {
-    int64_t r = gr->r;
-    int64_t i = gr->i;
-    int64_t r2 = MUL64((int64_t)r, (int64_t)r);
-    int64_t i2 = MUL64((int64_t)i, (int64_t)i);
-    int64_t pow64 = (r2 + i2)/gr->length;
+    assert(gr->length <= GOETZEL_MAX_POWER_LENGTH);
+
+    uint32_t r = gr->r < 0 ? -gr->r : gr->r;
+    uint32_t i = gr->i < 0 ? -gr->i : gr->i;
+
+    unsigned k = 0;
+    while ((r | i) >= (1 << 15)) {
+        r >>= 1;
+        i >>= 1;
+        ++k;
+    }
+
+    uint32_t p = (r*r) + (i*i);
+    int shift = (GOETZEL_ADC_VAL_BITS-1) - 2*k;
+    if (shift >= 0)
+        p >>= shift;
+    else
+        p <<= -shift;
+
+    return (int32_t)(p / gr->length);
+}
+
+//
+// Sliding Goetzel.
+//
+// Goetzel over a block of B samples starting at sample n gives
+// e^(jwB) * sum_k x[n+k]e^(-jwk). The common e^(jwB) factor doesn't affect
+// the power, so the DFT of a window of blocks (relative to the start of the
+// window) is the sum of the block results, each rotated by e^(-jwBj) where j
+// is the block's position in the window. The sum is recomputed from the
+// stored blocks each time, so rounding errors don't accumulate as the window
+// slides.
+//
+
+static uint32_t isqrt32(uint32_t x)
+{
+    uint32_t r = 0, bit = 1UL << 30;
+    while (bit > x)
+        bit >>= 2;
+    while (bit) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        }
+        else {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return r;
+}
+
+// Multiplication of two Q15 values. Products of values in [-1, 1] fit in
+// 31 bits.
+#define MULQ15(x, y) (((x) * (y)) >> 15)
+
+void goetzel_sliding_init(goetzel_sliding_t *gs, int32_t coscoeff, int32_t sincoeff, unsigned block_length, unsigned nblocks)
+{
+    assert(nblocks > 0 && nblocks <= GOETZEL_SLIDING_MAX_BLOCKS);
+
+    gs->cos_coeff = coscoeff;
+    gs->sin_coeff = sincoeff;
+    gs->block_length = block_length;
+    gs->nblocks = nblocks;
+    gs->head = 0;
+    gs->count = 0;
+
+    // Calculate e^(-jwB) by repeated squaring at Q15, which keeps the
+    // rounding error well below the precision of the Q11 coefficients.
+    // The sine is derived from the cosine (which is all that the Goetzel
+    // recurrence uses) so that e^(-jw) has unit magnitude; otherwise the
+    // error in its magnitude would be raised to the power B.
+    const int shift = 15 - (GOETZEL_ADC_VAL_BITS-1);
+    int32_t bc = 1 << 15, bs = 0;                                // Result.
+    int32_t pc = coscoeff << shift;                              // e^(-jw)^(2^k)
+    int32_t ps = (int32_t)isqrt32((1 << 30) - (pc * pc));
+    if (sincoeff > 0)
+        ps = -ps;
+    unsigned e;
+    for (e = block_length; e; e >>= 1) {
+        if (e & 1) {
+            int32_t c = MULQ15(bc, pc) - MULQ15(bs, ps);
+            bs = MULQ15(bc, ps) + MULQ15(bs, pc);
+            bc = c;
+        }
+        int32_t c = MULQ15(pc, pc) - MULQ15(ps, ps);
+        ps = 2 * MULQ15(pc, ps);
+        pc = c;
+    }
+
+    // Powers of e^(-jwB).
+    int32_t rc = 1 << 15, rs = 0;
+    unsigned j;
+    for (j = 0; j < nblocks; ++j) {
+        gs->rot_cos[j] = (rc + (1 << (shift-1))) >> shift;
+        gs->rot_sin[j] = (rs + (1 << (shift-1))) >> shift;
+        int32_t c = MULQ15(rc, bc) - MULQ15(rs, bs);
+        rs = MULQ15(rc, bs) + MULQ15(rs, bc);
+        rc = c;
+    }
+}
+
+#undef MULQ15
+
+static void goetzel_sliding_push(goetzel_sliding_t *gs, const goetzel_result_t *gr)
+{
+    unsigned i;
+    if (gs->count == gs->nblocks) {
+        i = gs->head;
+        if (++(gs->head) == gs->nblocks)
+            gs->head = 0;
+    }
+    else {
+        i = gs->head + gs->count;
+        if (i >= gs->nblocks)
+            i -= gs->nblocks;
+        ++(gs->count);
+    }
+
+    gs->blocks[i].r = gr->r;
+    gs->blocks[i].i = gr->i;
+    gs->blocks[i].total_power = gr->total_power;
+}
+
+// Adds 'block_length' samples to the window, dropping the oldest block if
+// the window is full.
+void goetzel_sliding_add_block(goetzel_sliding_t *gs, const int16_t *samples)
+{
+    goetzel_result_t gr;
+    goetzel1(samples, gs->block_length, 0, gs->cos_coeff, gs->sin_coeff, &gr);
+    goetzel_sliding_push(gs, &gr);
+}
+
+// As goetzel_sliding_add_block, but for two bins in one pass over the
+// samples. Both must have the same block length.
+void goetzel_sliding_add_block2(goetzel_sliding_t *gs1, goetzel_sliding_t *gs2, const int16_t *samples)
+{
+    assert(gs1->block_length == gs2->block_length);
+
+    goetzel_result_t gr1, gr2;
+    goetzel2(samples, gs1->block_length, 0,
+             gs1->cos_coeff, gs1->sin_coeff,
+             gs2->cos_coeff, gs2->sin_coeff,
+             &gr1, &gr2);
+    goetzel_sliding_push(gs1, &gr1);
+    goetzel_sliding_push(gs2, &gr2);
+}
+
+// Fills in 'dest' for the current window, which can then be passed to
+// goetzel_get_freq_power(). Returns false if the window is not yet full.
+bool goetzel_sliding_get_result(const goetzel_sliding_t *gs, goetzel_result_t *dest)
+{
+    if (gs->count < gs->nblocks)
+        return false;
+
+    int32_t r = 0, i = 0, total_power = 0;
+    unsigned j, k;
+    for (j = 0, k = gs->head; j < gs->nblocks; ++j) {
+        const goetzel_block_t *b = gs->blocks + k;
+        r += MUL(b->r, gs->rot_cos[j]) - MUL(b->i, gs->rot_sin[j]);
+        i += MUL(b->r, gs->rot_sin[j]) + MUL(b->i, gs->rot_cos[j]);
+        total_power += b->total_power;
+        if (++k == gs->nblocks)
+            k = 0;
+    }
+
+    dest->r = r;
+    dest->i = i;
+    dest->cos_coeff = gs->cos_coeff;
+    dest->sin_coeff = gs->sin_coeff;
+    dest->total_power = total_power;
+    dest->length = gs->block_length * gs->nblocks;
 
-    return (int32_t)(pow64);
+    return true;
 }
 
 #ifdef TEST
@@ -139,10 +344,9 @@ static void test1()
         int32_t COSCOEFF = GOETZEL_FLOAT_TO_FIX(cos(2*M_PI*NFREQ*1));
         int32_t SINCOEFF = GOETZEL_FLOAT_TO_FIX(sin(2*M_PI*NFREQ*1));
 
-        int32_t total_power;
-        goetzel_result_t gr1, gr2;
-        goetzel2(samples, N_SAMPLES, COSCOEFF, SINCOEFF, 100, 100, &gr1, &gr2, &total_power);
-        int32_t fp = goetzel_get_freq_power(&gr1, total_power);
+        goetzel_result_t gr1;
+        goetzel1(samples, N_SAMPLES, 0, COSCOEFF, SINCOEFF, &gr1);
+        int32_t fp = goetzel_get_freq_power(&gr1);
 
         unsigned nstars = (unsigned)(round(((float)fp/(4096.0/2))*0.2));
 
@@ -154,9 +358,145 @@ static void test1()
     }
 }
 
+// Checks that the sliding window gives the same power as running Goetzel
+// over the whole window, for windows at every block boundary.
+static void test_sliding()
+{
+    const unsigned BLOCK = 20, NBLOCKS = 4, NSAMPLES = 400;
+    const float SAMPLE_FREQ = 88888.89;
+    const float SIG_FREQ = 20000;
+
+    int16_t samples[NSAMPLES];
+    unsigned i;
+    for (i = 0; i < NSAMPLES; ++i) {
+        float t = (float)i/SAMPLE_FREQ;
+        samples[i] = (int16_t)(0.4*sin(2.0*M_PI*SIG_FREQ*t)*(4096/2.0) + ((i*7919) % 97) - 48);
+    }
+
+    float freqs[] = { 18000, 20000, 5000 };
+    float max_err = 0;
+    unsigned f;
+    for (f = 0; f < sizeof(freqs)/sizeof(freqs[0]); ++f) {
+        int32_t c = GOETZEL_FLOAT_TO_FIX(cos(2*M_PI*freqs[f]/SAMPLE_FREQ));
+        int32_t s = GOETZEL_FLOAT_TO_FIX(sin(2*M_PI*freqs[f]/SAMPLE_FREQ));
+
+        goetzel_sliding_t gs;
+        goetzel_sliding_init(&gs, c, s, BLOCK, NBLOCKS);
+        for (i = 0; i + BLOCK <= NSAMPLES; i += BLOCK) {
+            goetzel_sliding_add_block(&gs, samples + i);
+
+            goetzel_result_t sgr, gr;
+            if (! goetzel_sliding_get_result(&gs, &sgr))
+                continue;
+            goetzel1(samples + i + BLOCK - BLOCK*NBLOCKS, BLOCK*NBLOCKS, 0, c, s, &gr);
+
+            int32_t sp = goetzel_get_freq_power(&sgr), p = goetzel_get_freq_power(&gr);
+            // Relative to the power of the 20kHz signal.
+            float err = fabs((float)(sp - p)) / 6500.0;
+            if (err > max_err)
+                max_err = err;
+        }
+    }
+
+    printf("Sliding Goetzel max error: %f %s\n", max_err, max_err < 0.005 ? "OK" : "FAIL");
+}
+
+static int32_t power_64(const goetzel_result_t *gr)
+{
+    int64_t r = gr->r, i = gr->i;
+    return (int32_t)((((r*r) >> (GOETZEL_ADC_VAL_BITS-1)) + ((i*i) >> (GOETZEL_ADC_VAL_BITS-1))) / gr->length);
+}
+
+// Compares goetzel_get_freq_power() with the 64-bit calculation it replaced,
+// over the whole range of r and i.
+static void test_power()
+{
+    float max_err = 0;
+    unsigned n;
+    srand(1);
+    for (n = 0; n < 1000000; ++n) {
+        goetzel_result_t gr;
+        gr.length = 1 + (rand() % GOETZEL_MAX_POWER_LENGTH);
+        int32_t lim = gr.length * (1 << (GOETZEL_ADC_VAL_BITS-1));
+        gr.r = (rand() % (2*lim+1)) - lim;
+        gr.i = (rand() % (2*lim+1)) - lim;
+
+        int32_t p32 = goetzel_get_freq_power(&gr), p64 = power_64(&gr);
+        float err = fabs((float)(p32 - p64)) / (p64 > 0 ? p64 : 1);
+        if (p64 > 10000 && err > max_err)
+            max_err = err;
+    }
+    printf("32-bit power max relative error: %g %s\n", max_err, max_err < 0.001 ? "OK" : "FAIL");
+}
+
+static double ns_since(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec)*1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+// Rough M0 cycle counts from the instructions generated for LOOP_BODY (all
+// single cycle on the F030, which has the fast multiplier, except LDRSH).
+// 'make dspcycles' gives estimates from the actual ARM build.
+#define M0_CYCLES_PER_SAMPLE      6    // LDRSH, MULS, ASRS, ADDS, loop compare.
+#define M0_CYCLES_PER_BIN_SAMPLE  6    // MULS, ASRS, ADDS, SUBS, 2 x MOV.
+
+static void bench()
+{
+    const unsigned NSAMPLES = 80, REPS = 20000;
+    int16_t samples[NSAMPLES];
+    unsigned i;
+    for (i = 0; i < NSAMPLES; ++i)
+        samples[i] = (int16_t)(800*sin(i*0.7));
+
+    goetzel_coeffs_t coeffs[8];
+    goetzel_result_t results[8];
+    for (i = 0; i < 8; ++i) {
+        coeffs[i].cos_coeff = GOETZEL_FLOAT_TO_FIX(cos(0.5 + i*0.1));
+        coeffs[i].sin_coeff = GOETZEL_FLOAT_TO_FIX(sin(0.5 + i*0.1));
+    }
+
+    volatile int32_t sink = 0;
+    unsigned nbins;
+    for (nbins = 1; nbins <= 8; nbins *= 2) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        unsigned r;
+        for (r = 0; r < REPS; ++r) {
+            goetzel_bank(samples, NSAMPLES, 0, coeffs, results, nbins);
+            sink += results[0].r;
+        }
+        double ns = ns_since(&start) / ((double)REPS * NSAMPLES);
+        unsigned passes = (nbins + 1)/2;
+        unsigned m0 = passes*M0_CYCLES_PER_SAMPLE + nbins*M0_CYCLES_PER_BIN_SAMPLE;
+        printf("goetzel_bank %i bins: %.2f ns/sample on host, ~%i M0 cycles/sample (%.1f us per %i samples at 8MHz)\n",
+               nbins, ns, m0, (m0*NSAMPLES)/8.0, NSAMPLES);
+    }
+
+    const unsigned PREPS = 1000000;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < PREPS; ++i) {
+        results[0].r += 1;
+        sink += goetzel_get_freq_power(results);
+    }
+    double ns32 = ns_since(&start)/PREPS;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < PREPS; ++i) {
+        results[0].r += 1;
+        sink += power_64(results);
+    }
+    double ns64 = ns_since(&start)/PREPS;
+    printf("Power: %.2f ns (32-bit), %.2f ns (64-bit) on host\n", ns32, ns64);
+}
+
 int main()
 {
     test1();
+    test_sliding();
+    test_power();
+    bench();
 }
 
 #endif
@@ -2,6 +2,7 @@
 #define GOETZEL_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #define GOETZEL_ADC_VAL_BITS 12
 #define GOETZEL_FLOAT_TO_FIX(x) ((int32_t)((x)*(float)(1<<(GOETZEL_ADC_VAL_BITS-1))))
@@ -16,8 +17,19 @@ typedef struct {
     unsigned length;
 } goetzel_result_t;
 
+typedef struct {
+    int32_t cos_coeff;
+    int32_t sin_coeff;
+} goetzel_coeffs_t;
+
+// Longest buffer for which goetzel_get_freq_power() can't overflow.
+#define GOETZEL_MAX_POWER_LENGTH 512
+
 int32_t goetzel_get_freq_power(const goetzel_result_t *gr);
 
+void goetzel_bank(const int16_t *samples, unsigned length, unsigned offset,
+                  const goetzel_coeffs_t *coeffs, goetzel_result_t *dests, unsigned nbins);
+
 void goetzel1(const int16_t *samples, unsigned length, unsigned offset, int32_t coscoeff, int32_t sincoeff, goetzel_result_t *dest);
 void goetzel2(const int16_t *samples, unsigned length, unsigned offset,
               int32_t coscoeff1, int32_t sincoeff1,
@@ -34,4 +46,36 @@ void goetzel2(const int16_t *samples, unsigned length, unsigned offset,
               goetzel_result_t *dest3,
               goetzel_result_t *dest4);*/
 
+//
+// Sliding Goetzel: the power of a window made up of the last 'nblocks'
+// blocks of samples. Each block is analysed once when it is added, so
+// overlapping windows cost only the new samples plus a rotation per block.
+//
+
+#define GOETZEL_SLIDING_MAX_BLOCKS 4
+
+typedef struct {
+    int32_t r;
+    int32_t i;
+    int32_t total_power;
+} goetzel_block_t;
+
+typedef struct {
+    goetzel_block_t blocks[GOETZEL_SLIDING_MAX_BLOCKS];
+    // Rotations by -j*block_length*w, for j = 0..nblocks-1.
+    int32_t rot_cos[GOETZEL_SLIDING_MAX_BLOCKS];
+    int32_t rot_sin[GOETZEL_SLIDING_MAX_BLOCKS];
+    int32_t cos_coeff;
+    int32_t sin_coeff;
+    unsigned block_length;
+    uint8_t nblocks;
+    uint8_t head;  // Index of oldest block.
+    uint8_t count;
+} goetzel_sliding_t;
+
+void goetzel_sliding_init(goetzel_sliding_t *gs, int32_t coscoeff, int32_t sincoeff, unsigned block_length, unsigned nblocks);
+void goetzel_sliding_add_block(goetzel_sliding_t *gs, const int16_t *samples);
+void goetzel_sliding_add_block2(goetzel_sliding_t *gs1, goetzel_sliding_t *gs2, const int16_t *samples);
+bool goetzel_sliding_get_result(const goetzel_sliding_t *gs, goetzel_result_t *dest);
+
 #endif
@@ -9,8 +9,10 @@
 //
 // It is best to use 'gcc -E' or 'clang -E' rather than 'cpp', since 'cpp' on
 // OS X runs in "traditional" mode, and hence does not recognize the '#'
-// stringification operator. E.g.:
+// stringification operator. The lookup tables in hamming_tables.h need to be
+// generated first. E.g.:
 //
+//     python3 hamming_tables.py output
 //     clang -E hamming.c | grep -v '^#' > hamming.js
 //
 
@@ -36,27 +38,31 @@
 #define FUNC(rettype) function
 #define ARG(type)
 #define INT(x) parseInt(x)
+#define TABLE(type, name, size) var name = [
+#define END_TABLE ];
 #else
 #define BIN(x) x
 #define ARG(type) type
 #define FUNC(rettype) rettype
 #define INT(x) x
+#define TABLE(type, name, size) static const type name[size] = {
+#define END_TABLE };
 #endif
 
-static FUNC(unsigned) bits_set_in_uint32(ARG(uint32_t) n)
+// Parity bits and error correction come from the tables in
+// hamming_tables.h (generated by hamming_tables.py), which are looked up by
+// syndrome. See hamming_tables.py for how syndromes work.
+#include "hamming_tables.h"
+
+static FUNC(unsigned) syndrome(ARG(uint32_t) n)
 {
-    // See http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetKernighan
-    unsigned count;
-    for (count = 0; n; ++count, n &= n-1);
-    return count;
+    unsigned s = 0;
+    unsigned k;
+    for (k = 0; k < 8; ++k, n >>= 4)
+        s ^= HAMMING_NIBBLE_SYNDROMES[k*16 + (n & 0xF)];
+    return s;
 }
 
-static const uint32_t PMASK1  = BIN(0b01010101010101010101010101010101);
-static const uint32_t PMASK2  = BIN(0b01100110011001100110011001100110);
-static const uint32_t PMASK4  = BIN(0b01111000011110000111100001111000);
-static const uint32_t PMASK8  = BIN(0b01111111100000000111111110000000);
-static const uint32_t PMASK16 = BIN(0b01111111111111111000000000000000);
-
 static const uint32_t M1 = BIN(0b1);
 static const uint32_t M2 = BIN(0b1110);
 static const uint32_t M3 = BIN(0b11111110000);
@@ -71,34 +77,8 @@ FUNC(uint32_t) hammingify_uint32(ARG(uint32_t) n)
         ((n & M3) << 4)    |
         ((n & M4) << 5);
 
-    uint32_t pb1  = n & PMASK1;
-    uint32_t pb2  = n & PMASK2;
-    uint32_t pb4  = n & PMASK4;
-    uint32_t pb8  = n & PMASK8;
-    uint32_t pb16 = n & PMASK16;
-
-    unsigned pc1  = bits_set_in_uint32(pb1);
-    unsigned pc2  = bits_set_in_uint32(pb2);
-    unsigned pc4  = bits_set_in_uint32(pb4);
-    unsigned pc8  = bits_set_in_uint32(pb8);
-    unsigned pc16 = bits_set_in_uint32(pb16);
-
-    if (pc1 % 2 == 0)
-        n ^= (1 << (1-1));
-    if (pc2 % 2 == 0)
-        n ^= (1 << (2-1));
-    if (pc4 % 2 == 0)
-        n ^= (1 << (4-1));
-    if (pc8 % 2 == 0)
-        n ^= (1 << (8-1));
-    if (pc16 % 2 == 0)
-        n ^= (1 << (16-1));
-
-    // Set additional parity bit at bit 32.
-    if (bits_set_in_uint32(n) % 2 == 0)
-        n ^= (1 << (32-1));
-
-    return n;
+    // Set the parity bits, including the additional parity bit at bit 32.
+    return n | HAMMING_ENCODE_PARITY[syndrome(n)];
 }
 
 static const uint32_t IM1 = BIN(0b100);
@@ -108,48 +88,14 @@ static const uint32_t IM4 = BIN(0b1111111111111110000000000000000);
 // Returns -1 if could not be decoded.
 FUNC(int32_t) dehammingify_uint32(ARG(uint32_t) n)
 {
-    unsigned pb1 = n & PMASK1;
-    unsigned pb2 = n & PMASK2;
-    unsigned pb4 = n & PMASK4;
-    unsigned pb8 = n & PMASK8;
-    unsigned pb16 = n & PMASK16;
-
-    unsigned pc1  = bits_set_in_uint32(pb1);
-    unsigned pc2  = bits_set_in_uint32(pb2);
-    unsigned pc4  = bits_set_in_uint32(pb4);
-    unsigned pc8  = bits_set_in_uint32(pb8);
-    unsigned pc16 = bits_set_in_uint32(pb16);
-
-    unsigned error_bit_index = 0;
-    if (pc1 % 2 == 0)
-        error_bit_index += 1;
-    if (pc2 % 2 == 0)
-        error_bit_index += 2;
-    if (pc4 % 2 == 0)
-        error_bit_index += 4;
-    if (pc8 % 2 == 0)
-        error_bit_index += 8;
-    if (pc16 % 2 == 0)
-        error_bit_index += 16;
-
-    if (error_bit_index == 1 || error_bit_index == 2 || error_bit_index == 4 ||
-        error_bit_index == 8 || error_bit_index == 16) {
-        // Error in one of the parity bits. We flip an abritrarily chosen
-        // parity bit because we need to correct the parity of the entire 32-bit word.
-        n ^= 1;
-    }
-    else if (error_bit_index) {
-        // The bit at error_bit_index is flipped, so correct it.
-        n ^= (1 << (error_bit_index-1));
-    }
-
-    // Is the corrected number consistent with the final parity bit? If not, we
-    // have an uncorrectable error.
-    if (bits_set_in_uint32(n) % 2 == 0)
+    unsigned c = HAMMING_CORRECTIONS[syndrome(n)];
+    if (c == HAMMING_UNCORRECTABLE)
         return -1;
+    if (c != 0)
+        n ^= (1 << (c-1));
 
-    // If we get here, we have the correct data in n together with the parity
-    // bits. Now we just need to remove the parity bits.
+    // We have the correct data in n together with the parity bits. Now we
+    // just need to remove the parity bits.
     return ((n & IM1) >> 2)   |
            ((n & IM2) >> 3)   |
            ((n & IM3) >> 4)   |
@@ -181,6 +127,54 @@ FUNC(uint32_t) hamming_get_max_output_length_given_input_length(ARG(uint32_t) le
 #define MAGIC_NUMBER 24826601
 static uint32_t MAGIC_NUMBER_HAMMING = 0;
 
+static FUNC(uint32_t) get_magic_number_hamming()
+{
+    if (MAGIC_NUMBER_HAMMING == 0)
+        MAGIC_NUMBER_HAMMING = hammingify_uint32(MAGIC_NUMBER);
+    return MAGIC_NUMBER_HAMMING;
+}
+
+// True if 'word' decodes to the magic number, i.e. it differs from the
+// encoded magic number in at most one bit.
+static FUNC(bool) is_init_sequence(ARG(uint32_t) word)
+{
+    uint32_t d = word ^ get_magic_number_hamming();
+    return (d & (d - 1)) == 0;
+}
+
+//
+// Codewords are stored little endian. In C, words at 4-byte aligned
+// addresses are loaded and stored whole (the Cortex-M0 can't do unaligned
+// accesses, and is little endian, as are the hosts we test on). Otherwise
+// they're assembled a byte at a time.
+//
+
+static FUNC(uint32_t) read_uint32(ARG(const uint8_t *) buf, ARG(unsigned) i)
+{
+#ifdef JAVASCRIPT
+    return buf[i] | (buf[i+1] << 8) | (buf[i+2] << 16) | (buf[i+3] << 24);
+#else
+    if (((uintptr_t)(buf + i) & 3) == 0)
+        return *(const uint32_t *)(buf + i);
+    return buf[i] | (buf[i+1] << 8) | (buf[i+2] << 16) | ((uint32_t)buf[i+3] << 24);
+#endif
+}
+
+static FUNC(void) write_uint32(ARG(uint8_t *) out, ARG(unsigned) i, ARG(uint32_t) v)
+{
+#ifndef JAVASCRIPT
+    if (((uintptr_t)(out + i) & 3) == 0) {
+        *(uint32_t *)(out + i) = v;
+        return;
+    }
+#endif
+    // Shift then mask, since Javascript's >> sign-extends.
+    out[i++] = v & 0xFF;
+    out[i++] = (v >> 8) & 0xFF;
+    out[i++] = (v >> 16) & 0xFF;
+    out[i++] = (v >> 24) & 0xFF;
+}
+
 FUNC(void) hamming_encode_message(ARG(const uint8_t *) input,
 #ifndef JAVASCRIPT
 unsigned length_,
@@ -194,34 +188,32 @@ ARG(unsigned) num_init_sequences)
 #define length length_
 #endif
 
-    if (MAGIC_NUMBER_HAMMING == 0)
-        MAGIC_NUMBER_HAMMING = hammingify_uint32(MAGIC_NUMBER);
+    uint32_t magic = get_magic_number_hamming();
 
     uint32_t i = 0;
     uint32_t ilen = hamming_get_init_sequence_byte_length()*num_init_sequences;
-    for (; i < ilen;) {
-        out[i++] = (MAGIC_NUMBER_HAMMING & 0xFF);
-        out[i++] = (MAGIC_NUMBER_HAMMING & 0xFF00) >> 8;
-        out[i++] = (MAGIC_NUMBER_HAMMING & 0xFF0000) >> 16;
-        out[i++] = (MAGIC_NUMBER_HAMMING & 0xFF000000) >> 24;
-    }
+    for (; i < ilen; i += 4)
+        write_uint32(out, i, magic);
 
+    // Whole groups of three bytes, then whatever's left over.
     uint32_t j;
-    for (j = 0; j < length; j += 3) {
-        uint32_t v = input[j]                                    |
-                     (j + 1 >= length ? 0 : (input[j+1] << 8))   |
-                     (j + 2 >= length ? 0 : (input[j+2] << 16));
-        uint32_t h = hammingify_uint32(v);
-        out[i++] = (h & 0xFF);
-        out[i++] = (h & 0xFF00) >> 8;
-        out[i++] = (h & 0xFF0000) >> 16;
-        out[i++] = (h & 0xFF000000) >> 24;
+    for (j = 0; j + 3 <= length; j += 3, i += 4)
+        write_uint32(out, i, hammingify_uint32(input[j] | (input[j+1] << 8) | (input[j+2] << 16)));
+    if (j < length) {
+        uint32_t v = input[j];
+        if (j + 1 < length)
+            v |= input[j+1] << 8;
+        write_uint32(out, i, hammingify_uint32(v));
     }
 
 #undef length
 }
 
 // nbits < 8. If nbits > 0, assumes that there is an available byte at buffer[length].
+//
+// In C, aligned words are shifted whole. Since they're little endian, that
+// moves the top bits of each byte into the next one, just as shifting the
+// bytes one at a time does.
 FUNC(void) hamming_bitshift_buffer_forward(ARG(uint8_t *) buffer, ARG(unsigned) length, ARG(unsigned) nbits)
 {
     assert(nbits < 8);
@@ -232,6 +224,15 @@ FUNC(void) hamming_bitshift_buffer_forward(ARG(uint8_t *) buffer, ARG(unsigned)
     uint8_t backup = 0;
     unsigned i;
     for (i = 0; i < length; ++i) {
+#ifndef JAVASCRIPT
+        if (((uintptr_t)(buffer + i) & 3) == 0 && i + 4 <= length) {
+            uint32_t w = *(uint32_t *)(buffer + i);
+            *(uint32_t *)(buffer + i) = (w << nbits) | (backup >> (8 - nbits));
+            backup = w >> 24;
+            i += 3;
+            continue;
+        }
+#endif
         uint8_t r = (buffer[i] << nbits);
         r |= (backup >> (8 - nbits));
 #ifdef JAVASCRIPT
@@ -248,6 +249,10 @@ FUNC(void) hamming_bitshift_buffer_forward(ARG(uint8_t *) buffer, ARG(unsigned)
 
 // Scans a buffer from all bit offsets for a sequence of magic numbers. Returns
 // the bit index of the first sequence and the count.
+//
+// Rather than decoding the word at every offset, the bits are shifted into a
+// 32-bit register one at a time and compared with the encoded magic number
+// and its 32 single bit errors (see is_init_sequence).
 FUNC(hamming_scan_for_init_sequence_result_t) hamming_scan_for_init_sequence(ARG(const uint8_t *) input
 #ifndef JAVASCRIPT
 , unsigned length_
@@ -264,35 +269,28 @@ FUNC(hamming_scan_for_init_sequence_result_t) hamming_scan_for_init_sequence(ARG
 
     int magic_start_bit_index = -1;
     unsigned magic_count = 0;
-    unsigned bit_index;
-    for (bit_index = 0; bit_index < (length*8) - 32;) {
-        unsigned byte = INT(bit_index / 8);
-        unsigned bit = bit_index % 8;
-        uint8_t b1 = ((input[byte+0] >> bit) | (input[byte+1] << (8-bit)));
-        uint8_t b2 = ((input[byte+1] >> bit) | (input[byte+2] << (8-bit)));
-        uint8_t b3 = ((input[byte+2] >> bit) | (input[byte+3] << (8-bit)));
-        uint8_t b4 = ((input[byte+3] >> bit) | (input[byte+4] << (8-bit)));
-#ifdef JAVASCRIPT
-        b1 &= 0xFF;
-        b2 &= 0xFF;
-        b3 &= 0xFF;
-        b4 &= 0xFF;
-#endif
 
-        uint32_t v = dehammingify_uint32(b1 | (b2 << 8) | (b3 << 16) | (b4 << 24));
-        if (v == MAGIC_NUMBER) {
+    // Bits i-31 to i, lowest first. No comparisons are made until 'skip'
+    // more bits have been shifted in.
+    uint32_t word = 0;
+    unsigned skip = 32;
+    unsigned i;
+    for (i = 0; i < length*8; ++i) {
+        word = (word >> 1) & BIN(0b01111111111111111111111111111111);
+        if ((input[INT(i / 8)] >> (i % 8)) & 1)
+            word |= BIN(0b10000000000000000000000000000000);
+        if (--skip > 0)
+            continue;
+        skip = 1;
+
+        if (is_init_sequence(word)) {
             if (magic_start_bit_index == -1)
-                magic_start_bit_index = bit_index;
+                magic_start_bit_index = i - 31;
             ++magic_count;
-            bit_index += 32;
+            skip = 32;
         }
-        else {
-            if (magic_start_bit_index != -1) {
-                result.bit_index = magic_start_bit_index;
-                result.count = magic_count;
-                return result;
-            }
-            ++bit_index;
+        else if (magic_start_bit_index != -1) {
+            break;
         }
     }
 
@@ -303,12 +301,34 @@ FUNC(hamming_scan_for_init_sequence_result_t) hamming_scan_for_init_sequence(ARG
 #undef length
 }
 
-// Returns byte length of decoded message if no error or negated index of first
-// error in input buffer.
-FUNC(unsigned) hamming_decode_message(ARG(uint8_t *) msg,
+// The codeword starting at bit 'bit' of 'buf' (lowest bits first), decoded,
+// or 'errval' in each of the three bytes.
+static FUNC(uint32_t) decode_word_at_bit(ARG(const uint8_t *) buf, ARG(unsigned) bit, ARG(uint8_t) errval)
+{
+    unsigned b = INT(bit / 8), s = bit % 8;
+    uint32_t w = read_uint32(buf, b);
+    if (s != 0) {
+        // Mask, since Javascript's >> sign-extends.
+        uint32_t next = buf[b+4];
+        w = ((w >> s) & (BIN(0b01111111111111111111111111111111) >> (s - 1))) | (next << (32 - s));
+    }
+
+    uint32_t v = dehammingify_uint32(w);
+    if (v == -1)
+        return errval | (errval << 8) | (errval << 16);
+    return v;
+}
+
+// Decodes the codewords starting at bit 'bit_index' of 'msg' (e.g. as found
+// by hamming_scan_for_init_sequence) into the start of 'msg', three bytes
+// for each, without shifting the buffer into alignment first. Bytes from
+// codewords that can't be decoded are set to 'errval'. Returns the number
+// of bytes decoded.
+FUNC(unsigned) hamming_decode_message_at_bit(ARG(uint8_t *) msg,
 #ifndef JAVASCRIPT
 unsigned length_,
 #endif
+ARG(unsigned) bit_index,
 ARG(uint8_t) errval)
 {
 #ifdef JAVASCRIPT
@@ -317,9 +337,259 @@ ARG(uint8_t) errval)
 #define length length_
 #endif
 
+    if (bit_index > length*8)
+        return 0;
+    unsigned nwords = INT((length*8 - bit_index) / 32);
+
+    // Four codewords at a time give three whole words of output. These are
+    // only written once their input has been read, so decoding in place is
+    // safe.
+    uint32_t k, oi = 0;
+    for (k = 0; k + 4 <= nwords; k += 4, bit_index += 4*32) {
+        uint32_t v0 = decode_word_at_bit(msg, bit_index, errval);
+        uint32_t v1 = decode_word_at_bit(msg, bit_index + 32, errval);
+        uint32_t v2 = decode_word_at_bit(msg, bit_index + 64, errval);
+        uint32_t v3 = decode_word_at_bit(msg, bit_index + 96, errval);
+        write_uint32(msg, oi, v0 | (v1 << 24));
+        write_uint32(msg, oi + 4, (v1 >> 8) | (v2 << 16));
+        write_uint32(msg, oi + 8, (v2 >> 16) | (v3 << 8));
+        oi += 12;
+    }
+    for (; k < nwords; ++k, bit_index += 32) {
+        uint32_t v = decode_word_at_bit(msg, bit_index, errval);
+        msg[oi++] = v & 0xFF;
+        msg[oi++] = (v >> 8) & 0xFF;
+        msg[oi++] = (v >> 16) & 0xFF;
+    }
+
+    return oi;
+
+#undef length
+}
+
+// Returns the byte length of the decoded message. Bytes from codewords that
+// can't be decoded are set to 'errval'.
+FUNC(unsigned) hamming_decode_message(ARG(uint8_t *) msg,
+#ifndef JAVASCRIPT
+unsigned length_,
+#endif
+ARG(uint8_t) errval)
+{
+#ifdef JAVASCRIPT
+    return hamming_decode_message_at_bit(msg, 0, errval);
+#else
+    return hamming_decode_message_at_bit(msg, length_, 0, errval);
+#endif
+}
+
+//
+// Framing. Audio dropouts wipe out runs of consecutive bits, which would
+// take out several neighbouring codewords, so frames are interleaved. After
+// the init sequences comes a header codeword, giving the payload length, and
+// then the codewords for the payload followed by a CRC-16 of the header and
+// payload. These are sent in blocks of up to HAMMING_FRAME_DEPTH codewords,
+// the first bit of each codeword in the block, then the second, and so on.
+// A burst no longer than the block is deep then damages no more than one
+// bit of each codeword, which the Hamming code corrects. Frames of at least
+// HAMMING_FRAME_DEPTH/2 codewords survive bursts of HAMMING_FRAME_DEPTH/2
+// bits.
+//
+
+#ifdef JAVASCRIPT
+#define HAMMING_FRAME_DEPTH 16 // As in hamming.h.
+#endif
+#define FRAME_MAX_LENGTH   0xFFFF
+#define FRAME_HEADER_CHECK 0xA5
+
+static FUNC(unsigned) frame_codewords(ARG(unsigned) length)
+{
+    // Payload and CRC, three bytes to a codeword.
+    return INT((length + 2 + 2) / 3);
+}
+
+FUNC(uint32_t) hamming_get_encoded_frame_byte_length(ARG(uint32_t) len, ARG(unsigned) num_init_sequences)
+{
+    return (num_init_sequences + 1 + frame_codewords(len)) * 4;
+}
+
+// Depth of the next block, given the codewords and blocks left. Blocks are
+// made as near the same depth as possible, so that a short last block
+// doesn't weaken the interleaving.
+static FUNC(unsigned) frame_block_depth(ARG(unsigned) codewords, ARG(unsigned) blocks)
+{
+    return INT((codewords + blocks - 1) / blocks);
+}
+
+static FUNC(uint32_t) crc16_update(ARG(uint32_t) crc, ARG(uint8_t) b)
+{
+    // CRC-16-CCITT.
+    crc ^= b << 8;
+    unsigned i;
+    for (i = 0; i < 8; ++i) {
+        if (crc & 0x8000)
+            crc = ((crc << 1) ^ 0x1021) & 0xFFFF;
+        else
+            crc = (crc << 1) & 0xFFFF;
+    }
+    return crc;
+}
+
+static FUNC(uint32_t) frame_header(ARG(unsigned) length)
+{
+    uint32_t lo = length & 0xFF, hi = (length >> 8) & 0xFF;
+    return lo | (hi << 8) | ((lo ^ hi ^ FRAME_HEADER_CHECK) << 16);
+}
+
+// Byte i of the payload followed by the CRC and padding.
+static FUNC(uint32_t) frame_byte(ARG(const uint8_t *) input, ARG(unsigned) length, ARG(uint32_t) crc, ARG(unsigned) i)
+{
+    if (i < length)
+        return input[i];
+    if (i == length)
+        return crc & 0xFF;
+    if (i == length + 1)
+        return (crc >> 8) & 0xFF;
+    return 0;
+}
+
+// 'out' must have room for hamming_get_encoded_frame_byte_length() bytes.
+FUNC(void) hamming_encode_frame(ARG(const uint8_t *) input,
+#ifndef JAVASCRIPT
+unsigned length_,
+#endif
+ARG(uint8_t *) out,
+ARG(unsigned) num_init_sequences)
+{
+#ifdef JAVASCRIPT
+#define length input.length
+#else
+#define length length_
+#endif
+
+    assert(length <= FRAME_MAX_LENGTH);
+
+    uint32_t i = 0;
+    unsigned k;
+    for (k = 0; k < num_init_sequences; ++k, i += 4)
+        write_uint32(out, i, get_magic_number_hamming());
+
+    uint32_t header = frame_header(length);
+    write_uint32(out, i, hammingify_uint32(header));
+    i += 4;
+
+    uint32_t crc = 0xFFFF;
+    for (k = 0; k < 3; ++k)
+        crc = crc16_update(crc, (header >> (k*8)) & 0xFF);
+    for (k = 0; k < length; ++k)
+        crc = crc16_update(crc, input[k]);
+
+    unsigned n = frame_codewords(length);
+    unsigned blocks = INT((n + HAMMING_FRAME_DEPTH - 1) / HAMMING_FRAME_DEPTH);
+    unsigned first, depth, c, b;
+    for (first = 0; first < n; first += depth, --blocks) {
+        depth = frame_block_depth(n - first, blocks);
+
+        for (k = 0; k < depth*4; ++k)
+            out[i + k] = 0;
+        for (c = 0; c < depth; ++c) {
+            unsigned j = (first + c) * 3;
+            uint32_t h = hammingify_uint32(frame_byte(input, length, crc, j)            |
+                                           (frame_byte(input, length, crc, j+1) << 8)   |
+                                           (frame_byte(input, length, crc, j+2) << 16));
+            // Bit b of codeword c is bit b*depth + c of the block.
+            for (b = 0; b < 32; ++b) {
+                if ((h >> b) & 1) {
+                    unsigned t = b*depth + c;
+                    out[i + INT(t / 8)] |= 1 << (t % 8);
+                }
+            }
+        }
+        i += depth*4;
+    }
+
+#undef length
+}
+
+#ifndef JAVASCRIPT
+
+//
+// Soft decision decoding (Chase's second algorithm). Each received bit comes
+// with a confidence (0-255). We try flipping each combination of the
+// HAMMING_CHASE_BITS least confident bits before the usual single error
+// correction, and pick the codeword that differs from the received word in
+// the least confident bits. This corrects most double and triple errors so
+// long as all but one of them are in bits received with low confidence.
+// The Javascript side only encodes, so this isn't written to be translated.
+//
+
+static uint32_t soft_distance(uint32_t diff, const uint8_t *confidences)
+{
+    // One more than the confidence, so that flipping a bit we know nothing
+    // about still counts for something.
+    uint32_t d = 0;
+    unsigned i;
+    for (i = 0; diff; ++i, diff >>= 1) {
+        if (diff & 1)
+            d += confidences[i] + 1;
+    }
+    return d;
+}
+
+// 'confidences' has one entry per bit of 'n', starting with the lowest.
+// Returns -1 if could not be decoded.
+int32_t dehammingify_uint32_soft(uint32_t n, const uint8_t *confidences)
+{
+    int32_t v = dehammingify_uint32(n);
+    if (v != -1 && hammingify_uint32(v) == n)
+        return v; // Nothing closer than a codeword.
+
+    // Least confident bits, in order of increasing confidence.
+    unsigned lrb[HAMMING_CHASE_BITS];
+    unsigned nlrb = 0;
+    unsigned i, j;
+    for (i = 0; i < 32; ++i) {
+        for (j = nlrb; j > 0 && confidences[i] < confidences[lrb[j-1]]; --j) {
+            if (j < HAMMING_CHASE_BITS)
+                lrb[j] = lrb[j-1];
+        }
+        if (j < HAMMING_CHASE_BITS) {
+            lrb[j] = i;
+            if (nlrb < HAMMING_CHASE_BITS)
+                ++nlrb;
+        }
+    }
+
+    int32_t best = -1;
+    uint32_t best_distance = 0xFFFFFFFF;
+    unsigned pattern;
+    for (pattern = 0; pattern < (1 << HAMMING_CHASE_BITS); ++pattern) {
+        uint32_t m = n;
+        for (j = 0; j < HAMMING_CHASE_BITS; ++j) {
+            if (pattern & (1 << j))
+                m ^= (1 << lrb[j]);
+        }
+
+        v = dehammingify_uint32(m);
+        if (v == -1)
+            continue;
+        uint32_t d = soft_distance(hammingify_uint32(v) ^ n, confidences);
+        if (d < best_distance) {
+            best_distance = d;
+            best = v;
+        }
+    }
+
+    return best;
+}
+
+// As hamming_decode_message, with 'confidences' giving the confidence of
+// each of the length*8 bits of 'msg'.
+unsigned hamming_decode_message_soft(uint8_t *msg, unsigned length, const uint8_t *confidences, uint8_t errval)
+{
     uint32_t i, oi = 0;
-    for (i = 0; i < length; i += 4) {
-        uint32_t v = dehammingify_uint32(msg[i] | (msg[i+1] << 8) | (msg[i+2] << 16) | (msg[i+3] << 24));
+    for (i = 0; i + 4 <= length; i += 4) {
+        uint32_t n = msg[i] | (msg[i+1] << 8) | (msg[i+2] << 16) | ((uint32_t)msg[i+3] << 24);
+        int32_t v = dehammingify_uint32_soft(n, confidences + i*8);
 
         if (v == -1) {
             msg[oi++] = errval;
@@ -334,12 +604,533 @@ ARG(uint8_t) errval)
     }
 
     return oi;
+}
 
-#undef length
+//
+// Streaming decoder. Bits are pushed in one at a time as they're received.
+// Until the init sequences have been seen, each bit is treated as possibly
+// the last of one, and then every 32nd bit completes a codeword, which is
+// decoded straight away. Only the last 32 bits (and their confidences, for
+// soft decoding) are kept.
+//
+
+void hamming_stream_init(hamming_stream_t *s, bool soft, uint8_t errval)
+{
+    s->word = 0;
+    s->head = 0;
+    s->nbits = 0;
+    s->state = HAMMING_STREAM_SEARCHING;
+    s->count = 0;
+    s->soft = soft;
+    s->errval = errval;
+    s->errors = 0;
+}
+
+// 'confidence' is ignored unless soft decoding. Returns the number of
+// decoded bytes written to 'out' (0 or 3). A codeword that can't be decoded
+// gives three bytes of 'errval'.
+unsigned hamming_stream_push_bit(hamming_stream_t *s, unsigned bit, uint8_t confidence, uint8_t *out)
+{
+    s->word = (s->word >> 1) | ((uint32_t)bit << 31);
+    s->confidences[s->head] = confidence;
+    s->head = (s->head + 1) % 32;
+    if (s->nbits < 32)
+        ++(s->nbits);
+
+    if (s->nbits < 32)
+        return 0;
+
+    if (s->state == HAMMING_STREAM_SEARCHING) {
+        if (is_init_sequence(s->word)) {
+            s->state = HAMMING_STREAM_INIT;
+            s->count = 1;
+            s->nbits = 0;
+        }
+        return 0;
+    }
+
+    s->nbits = 0;
+    if (s->state == HAMMING_STREAM_INIT) {
+        if (is_init_sequence(s->word)) {
+            ++(s->count);
+            return 0;
+        }
+        s->state = HAMMING_STREAM_DATA;
+    }
+
+    int32_t v;
+    if (s->soft) {
+        // Oldest first, to match the bits of the word.
+        uint8_t confidences[32];
+        unsigned i;
+        for (i = 0; i < 32; ++i)
+            confidences[i] = s->confidences[(s->head + i) % 32];
+        v = dehammingify_uint32_soft(s->word, confidences);
+    }
+    else {
+        v = dehammingify_uint32(s->word);
+    }
+
+    if (v == -1) {
+        out[0] = out[1] = out[2] = s->errval;
+        ++(s->errors);
+    }
+    else {
+        out[0] = v & 0xFF;
+        out[1] = (v & 0xFF00) >> 8;
+        out[2] = (v & 0xFF0000) >> 16;
+    }
+    return 3;
+}
+
+//
+// Frame decoder. The init sequences and header are found by a
+// hamming_stream_t, and then each block is decoded when its last bit
+// arrives. Confidences are kept to 4 bits to save RAM.
+//
+
+static void frame_start_block(hamming_frame_t *f)
+{
+    f->depth = frame_block_depth(f->remaining, f->blocks);
+    f->nbits = 0;
+    unsigned c;
+    for (c = 0; c < f->depth; ++c)
+        f->words[c] = 0;
+}
+
+static void frame_take_byte(hamming_frame_t *f, uint8_t b)
+{
+    if (f->nbytes < f->length) {
+        f->msg[f->nbytes] = b;
+        f->crc = crc16_update(f->crc, b);
+    }
+    else if (f->nbytes == f->length) {
+        f->received_crc = b;
+    }
+    else if (f->nbytes == f->length + 1) {
+        f->received_crc |= b << 8;
+    }
+    ++(f->nbytes);
+}
+
+// Payload bytes go to 'msg', which has room for 'capacity' bytes. Longer
+// frames are rejected.
+void hamming_frame_init(hamming_frame_t *f, bool soft, uint8_t *msg, unsigned capacity)
+{
+    hamming_stream_init(&f->stream, soft, 0);
+    f->msg = msg;
+    f->capacity = capacity;
+    f->state = HAMMING_FRAME_MORE;
+    f->length = 0;
+    f->remaining = 0;
+}
+
+static int frame_take_header(hamming_frame_t *f, const uint8_t *h)
+{
+    if (f->stream.errors != 0 || h[2] != (h[0] ^ h[1] ^ FRAME_HEADER_CHECK))
+        return HAMMING_FRAME_ERROR;
+    f->length = h[0] | (h[1] << 8);
+    if (f->length > f->capacity)
+        return HAMMING_FRAME_ERROR;
+
+    f->crc = 0xFFFF;
+    unsigned i;
+    for (i = 0; i < 3; ++i)
+        f->crc = crc16_update(f->crc, h[i]);
+    f->nbytes = 0;
+    f->remaining = frame_codewords(f->length);
+    f->blocks = (f->remaining + HAMMING_FRAME_DEPTH - 1) / HAMMING_FRAME_DEPTH;
+    frame_start_block(f);
+    return HAMMING_FRAME_MORE;
 }
 
+// Returns HAMMING_FRAME_DONE once the whole frame has been received and its
+// CRC checked, HAMMING_FRAME_ERROR if it's bad, otherwise
+// HAMMING_FRAME_MORE. 'f->length' gives the payload length once the header
+// has been received, and the payload is written to 'msg' a block at a time.
+int hamming_frame_push_bit(hamming_frame_t *f, unsigned bit, uint8_t confidence)
+{
+    if (f->state != HAMMING_FRAME_MORE)
+        return f->state;
+
+    if (f->remaining == 0) {
+        uint8_t h[3];
+        if (hamming_stream_push_bit(&f->stream, bit, confidence, h) != 0)
+            f->state = frame_take_header(f, h);
+        return f->state;
+    }
+
+    unsigned c = f->nbits % f->depth, b = f->nbits / f->depth;
+    unsigned ci = c*32 + b;
+    f->words[c] |= (uint32_t)bit << b;
+    if (ci % 2 == 0)
+        f->confidences[ci/2] = (f->confidences[ci/2] & 0xF0) | (confidence >> 4);
+    else
+        f->confidences[ci/2] = (f->confidences[ci/2] & 0x0F) | (confidence & 0xF0);
+    if (++(f->nbits) < f->depth*32)
+        return HAMMING_FRAME_MORE;
+
+    for (c = 0; c < f->depth; ++c) {
+        int32_t v;
+        if (f->stream.soft) {
+            uint8_t confidences[32];
+            for (b = 0; b < 32; ++b) {
+                ci = c*32 + b;
+                confidences[b] = (ci % 2 == 0 ? f->confidences[ci/2] << 4 : f->confidences[ci/2] & 0xF0);
+            }
+            v = dehammingify_uint32_soft(f->words[c], confidences);
+        }
+        else {
+            v = dehammingify_uint32(f->words[c]);
+        }
+        if (v == -1) {
+            f->state = HAMMING_FRAME_ERROR;
+            return f->state;
+        }
+        frame_take_byte(f, v & 0xFF);
+        frame_take_byte(f, (v >> 8) & 0xFF);
+        frame_take_byte(f, (v >> 16) & 0xFF);
+    }
+
+    f->remaining -= f->depth;
+    --(f->blocks);
+    if (f->remaining == 0)
+        f->state = (f->crc == f->received_crc ? HAMMING_FRAME_DONE : HAMMING_FRAME_ERROR);
+    else
+        frame_start_block(f);
+    return f->state;
+}
+
+#endif
+
 #if defined TEST || defined JAVASCRIPT
 
+#ifdef TEST
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define SOFT_TEST_WORDS 200000
+
+static unsigned bits_set_in_uint32(uint32_t n)
+{
+    // See http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetKernighan
+    unsigned count;
+    for (count = 0; n; ++count, n &= n-1);
+    return count;
+}
+
+static double gaussian()
+{
+    double u1 = (rand() + 1.0) / (RAND_MAX + 2.0), u2 = rand() / (RAND_MAX + 1.0);
+    return sqrt(-2*log(u1)) * cos(2*M_PI*u2);
+}
+
+// Sends random words over a channel with Gaussian noise on +/-1 bit values,
+// taking the confidence of each bit from its distance from 0, and compares
+// the word error rates of hard and soft decoding.
+static int test_soft()
+{
+    static const double sigmas[] = { 0.3, 0.4, 0.5, 0.6 };
+    int ret = 0;
+    unsigned si;
+    srand(1);
+    for (si = 0; si < sizeof(sigmas)/sizeof(sigmas[0]); ++si) {
+        unsigned w, hard_errors = 0, soft_errors = 0, bit_errors = 0;
+        for (w = 0; w < SOFT_TEST_WORDS; ++w) {
+            uint32_t data = rand() % (1 << (31-5));
+            uint32_t h = hammingify_uint32(data);
+            uint32_t received = 0;
+            uint8_t confidences[32];
+            unsigned i;
+            for (i = 0; i < 32; ++i) {
+                double y = ((h >> i) & 1 ? 1.0 : -1.0) + sigmas[si]*gaussian();
+                if (y > 0)
+                    received |= (1 << i);
+                double c = fabs(y) * 128;
+                confidences[i] = (uint8_t)(c > 255 ? 255 : c);
+            }
+            bit_errors += bits_set_in_uint32(received ^ h);
+
+            if (dehammingify_uint32(received) != (int32_t)data)
+                ++hard_errors;
+            if (dehammingify_uint32_soft(received, confidences) != (int32_t)data)
+                ++soft_errors;
+        }
+
+        bool ok = soft_errors <= hard_errors;
+        printf("Noise %.1f: BER %f, word errors hard %f, soft %f %s\n", sigmas[si],
+               (double)bit_errors / (SOFT_TEST_WORDS*32.0),
+               (double)hard_errors / SOFT_TEST_WORDS, (double)soft_errors / SOFT_TEST_WORDS,
+               ok ? "OK" : "FAIL");
+        if (! ok)
+            ret = 1;
+    }
+    return ret;
+}
+
+#define SCAN_TEST_BUFFERS 20000
+#define SCAN_TEST_LENGTH  40
+
+static unsigned get_bit(const uint8_t *buf, unsigned i)
+{
+    return (buf[i/8] >> (i % 8)) & 1;
+}
+
+// Scans by decoding the word at every bit offset.
+static hamming_scan_for_init_sequence_result_t reference_scan(const uint8_t *input, unsigned length)
+{
+    hamming_scan_for_init_sequence_result_t result = { -1, 0 };
+    unsigned bit_index = 0;
+    while (bit_index + 32 <= length*8) {
+        uint32_t w = 0;
+        unsigned i;
+        for (i = 0; i < 32; ++i)
+            w |= get_bit(input, bit_index + i) << i;
+        if (dehammingify_uint32(w) == MAGIC_NUMBER) {
+            if (result.bit_index == -1)
+                result.bit_index = bit_index;
+            ++result.count;
+            bit_index += 32;
+        }
+        else if (result.bit_index != -1) {
+            break;
+        }
+        else {
+            ++bit_index;
+        }
+    }
+    return result;
+}
+
+// Puts up to three init sequences, with up to two bit errors each, at random
+// bit offsets in random buffers, and checks that the scan agrees with
+// decoding at every offset.
+static int test_scan()
+{
+    unsigned n, mismatches = 0, found = 0;
+    srand(2);
+    for (n = 0; n < SCAN_TEST_BUFFERS; ++n) {
+        uint8_t buf[SCAN_TEST_LENGTH];
+        unsigned i, j;
+        for (i = 0; i < SCAN_TEST_LENGTH; ++i)
+            buf[i] = rand() & 0xFF;
+
+        uint8_t seq[3*4];
+        unsigned nseq = rand() % 4;
+        hamming_encode_message(NULL, 0, seq, nseq);
+        unsigned offset = rand() % ((SCAN_TEST_LENGTH - sizeof(seq))*8);
+        for (i = 0; i < nseq*32; ++i) {
+            unsigned b = offset + i;
+            buf[b/8] = (buf[b/8] & ~(1 << (b % 8))) | (get_bit(seq, i) << (b % 8));
+        }
+        for (j = 0; j < nseq; ++j) {
+            unsigned nerrors = rand() % 3;
+            for (i = 0; i < nerrors; ++i) {
+                unsigned b = offset + j*32 + rand() % 32;
+                buf[b/8] ^= 1 << (b % 8);
+            }
+        }
+
+        hamming_scan_for_init_sequence_result_t r = hamming_scan_for_init_sequence(buf, sizeof(buf));
+        hamming_scan_for_init_sequence_result_t e = reference_scan(buf, sizeof(buf));
+        if (r.bit_index != e.bit_index || r.count != e.count)
+            ++mismatches;
+        if (r.bit_index != -1)
+            ++found;
+    }
+
+    printf("Init sequence scan: %i buffers, %i with sequences found, %i mismatches %s\n",
+           SCAN_TEST_BUFFERS, found, mismatches, mismatches == 0 ? "OK" : "FAIL");
+    return mismatches == 0 ? 0 : 1;
+}
+
+#define BUFFER_TEST_BUFFERS 20000
+#define BUFFER_TEST_LENGTH  60
+
+// Checks the word-at-a-time buffer functions against doing it a bit at a
+// time, at every alignment: shifting, encoding, and decoding from an
+// unaligned bit offset (with an error in each codeword).
+static int test_buffers()
+{
+    unsigned n, failures = 0;
+    srand(5);
+    for (n = 0; n < BUFFER_TEST_BUFFERS; ++n) {
+        // Room to start anywhere within a word.
+        uint32_t space[(BUFFER_TEST_LENGTH*2)/4 + 2];
+        uint8_t *buf = (uint8_t *)space + rand() % 4;
+        uint8_t orig[BUFFER_TEST_LENGTH + 1];
+        unsigned length = rand() % BUFFER_TEST_LENGTH, nbits = rand() % 8, i;
+        for (i = 0; i < length + 1; ++i)
+            orig[i] = buf[i] = rand() & 0xFF;
+
+        // The byte after the buffer gets the top bits of its last byte.
+        hamming_bitshift_buffer_forward(buf, length, nbits);
+        unsigned nout = (length == 0 ? 0 : length + (nbits != 0));
+        for (i = 0; i < nout*8; ++i) {
+            unsigned e = (i < nbits || i >= length*8 + nbits ? 0 : get_bit(orig, i - nbits));
+            if (get_bit(buf, i) != e) {
+                ++failures;
+                break;
+            }
+        }
+
+        uint8_t encoded[BUFFER_TEST_LENGTH*2];
+        unsigned elength = (1 + (length + 2)/3) * 4;
+        buf = (uint8_t *)space + rand() % 4;
+        hamming_encode_message(orig, length, buf, 1);
+        for (i = 0; i < elength; i += 4) {
+            uint32_t w = buf[i] | (buf[i+1] << 8) | (buf[i+2] << 16) | ((uint32_t)buf[i+3] << 24);
+            uint32_t e = get_magic_number_hamming();
+            if (i > 0) {
+                unsigned j = (i/4 - 1)*3, k;
+                uint32_t v = 0;
+                for (k = 0; k < 3 && j + k < length; ++k)
+                    v |= orig[j + k] << (k*8);
+                e = hammingify_uint32(v);
+            }
+            if (w != e) {
+                ++failures;
+                break;
+            }
+        }
+        memcpy(encoded, buf, elength);
+
+        unsigned offset = rand() % 64;
+        buf = (uint8_t *)space + rand() % 4;
+        unsigned blength = (offset + elength*8 + 7)/8;
+        for (i = 0; i < blength; ++i)
+            buf[i] = rand() & 0xFF;
+        for (i = 0; i < elength; i += 4) {
+            unsigned b = rand() % 32;
+            encoded[i + b/8] ^= 1 << (b % 8);
+        }
+        for (i = 0; i < elength*8; ++i) {
+            unsigned b = offset + i;
+            buf[b/8] = (buf[b/8] & ~(1 << (b % 8))) | (get_bit(encoded, i) << (b % 8));
+        }
+        nout = hamming_decode_message_at_bit(buf, blength, offset + 32, 'X');
+        if (nout != (elength/4 - 1)*3 || memcmp(buf, orig, length) != 0)
+            ++failures;
+    }
+
+    printf("Buffers: %i buffers, %i failures %s\n",
+           BUFFER_TEST_BUFFERS, failures, failures == 0 ? "OK" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}
+
+#define STREAM_TEST_MESSAGES 2000
+#define STREAM_TEST_LENGTH   24
+
+// Sends messages after a random number of alternating bits, with an error
+// in a random bit of the first init sequence and each codeword, and checks
+// that the streaming decoder gets the message back.
+static int test_stream()
+{
+    unsigned n, failures = 0;
+    srand(3);
+    for (n = 0; n < STREAM_TEST_MESSAGES; ++n) {
+        uint8_t msg[STREAM_TEST_LENGTH], encoded[2*4 + STREAM_TEST_LENGTH/3*4];
+        uint8_t decoded[STREAM_TEST_LENGTH];
+        unsigned i, ndecoded = 0;
+        for (i = 0; i < sizeof(msg); ++i)
+            msg[i] = rand() & 0xFF;
+        hamming_encode_message(msg, sizeof(msg), encoded, 2);
+        for (i = 0; i < sizeof(encoded); i += 4) {
+            unsigned b = rand() % 32;
+            encoded[i + b/8] ^= 1 << (b % 8);
+        }
+
+        hamming_stream_t s;
+        hamming_stream_init(&s, n % 2, 'X');
+        unsigned preamble = rand() % 64;
+        for (i = 0; i < preamble; ++i)
+            hamming_stream_push_bit(&s, i % 2, 0, decoded);
+        for (i = 0; i < sizeof(encoded)*8 && ndecoded < sizeof(decoded); ++i) {
+            uint8_t out[3];
+            unsigned b = (encoded[i/8] >> (i % 8)) & 1;
+            unsigned nout = hamming_stream_push_bit(&s, b, 128, out);
+            memcpy(decoded + ndecoded, out, nout);
+            ndecoded += nout;
+        }
+
+        if (ndecoded != sizeof(msg) || memcmp(decoded, msg, sizeof(msg)) != 0 || s.count != 2)
+            ++failures;
+    }
+
+    printf("Streaming decoder: %i messages, %i failures %s\n",
+           STREAM_TEST_MESSAGES, failures, failures == 0 ? "OK" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}
+
+#define FRAME_TEST_FRAMES     2000
+#define FRAME_TEST_MAX_LENGTH 100
+
+// Each frame gets a burst of noise as long as its shallowest block is deep
+// somewhere after the header, which should always be corrected. Every
+// tenth frame also has a miscorrected codeword, which the CRC should catch.
+static int test_frame()
+{
+    unsigned n, failures = 0;
+    srand(4);
+    for (n = 0; n < FRAME_TEST_FRAMES; ++n) {
+        uint8_t msg[FRAME_TEST_MAX_LENGTH], decoded[FRAME_TEST_MAX_LENGTH];
+        uint8_t encoded[(2 + 1 + (FRAME_TEST_MAX_LENGTH+4)/3) * 4];
+        unsigned length = rand() % (FRAME_TEST_MAX_LENGTH + 1), i;
+        for (i = 0; i < length; ++i)
+            msg[i] = rand() & 0xFF;
+        unsigned elength = hamming_get_encoded_frame_byte_length(length, 2);
+        hamming_encode_frame(msg, length, encoded, 2);
+
+        // Blocks are all at least this deep.
+        unsigned ncodewords = (length+4)/3;
+        unsigned nblocks = (ncodewords + HAMMING_FRAME_DEPTH - 1) / HAMMING_FRAME_DEPTH;
+        unsigned min_depth = ncodewords / nblocks;
+
+        bool corrupt = (n % 10 == 9);
+        if (corrupt) {
+            // Three errors in the first codeword after the header make it
+            // decode to the wrong data, which the CRC should catch. Bits
+            // 2, 4 and 5 are data bits in its first byte.
+            unsigned depth = frame_block_depth(ncodewords, nblocks);
+            unsigned bits[] = { 2, 4, 5 };
+            for (i = 0; i < 3; ++i) {
+                unsigned t = 3*32 + bits[i]*depth;
+                encoded[t/8] ^= 1 << (t % 8);
+            }
+        }
+
+        unsigned burst_start = 3*32 + rand() % (elength*8 - 3*32);
+        unsigned burst_length = 1 + rand() % min_depth;
+        for (i = burst_start; i < burst_start + burst_length && i < elength*8; ++i) {
+            if (rand() % 2)
+                encoded[i/8] ^= 1 << (i % 8);
+        }
+
+        hamming_frame_t f;
+        hamming_frame_init(&f, n % 2, decoded, sizeof(decoded));
+        int r = HAMMING_FRAME_MORE;
+        unsigned preamble = rand() % 64;
+        for (i = 0; i < preamble; ++i)
+            hamming_frame_push_bit(&f, i % 2, 0);
+        for (i = 0; i < elength*8 && r == HAMMING_FRAME_MORE; ++i)
+            r = hamming_frame_push_bit(&f, (encoded[i/8] >> (i % 8)) & 1, 128);
+
+        if (corrupt) {
+            if (r != HAMMING_FRAME_ERROR)
+                ++failures;
+        }
+        else if (r != HAMMING_FRAME_DONE || f.length != length || memcmp(decoded, msg, length) != 0) {
+            ++failures;
+        }
+    }
+
+    printf("Frames: %i frames, %i failures %s\n",
+           FRAME_TEST_FRAMES, failures, failures == 0 ? "OK" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}
+#endif
+
 FUNC(int)
 #ifdef TEST
 main(int argc, char **argv)
@@ -348,7 +1139,22 @@ main(int argc, char **argv)
 hmming_test()
 #endif
 {
+#ifdef TEST
+    if (test_scan() != 0)
+        return 1;
+    if (test_buffers() != 0)
+        return 1;
+    if (test_stream() != 0)
+        return 1;
+    if (test_frame() != 0)
+        return 1;
+    if (test_soft() != 0)
+        return 1;
+#endif
+
     // Test hammingify_uint32 and dehammingify_uint32 for all possible values.
+    // (make hammingverifytest does this faster, across threads, and checks
+    // double bit errors too.)
 
     uint32_t n;
     for (n = 0; n < (1 << (31-5)); ++n) {
@@ -19,5 +19,60 @@ typedef struct {
 } hamming_scan_for_init_sequence_result_t;
 hamming_scan_for_init_sequence_result_t hamming_scan_for_init_sequence(const uint8_t *input, unsigned length);
 unsigned hamming_decode_message(uint8_t *msg, unsigned length, uint8_t errval);
+unsigned hamming_decode_message_at_bit(uint8_t *msg, unsigned length, unsigned bit_index, uint8_t errval);
+
+#define HAMMING_CHASE_BITS 3
+
+int32_t dehammingify_uint32_soft(uint32_t n, const uint8_t *confidences);
+unsigned hamming_decode_message_soft(uint8_t *msg, unsigned length, const uint8_t *confidences, uint8_t errval);
+
+typedef struct {
+    uint32_t word;            // The last 32 bits, oldest lowest.
+    uint8_t confidences[32];  // Their confidences, starting with the oldest at 'head'.
+    uint8_t head;
+    uint8_t nbits;            // Bits since the end of the last codeword (up to 32).
+    uint8_t state;
+    uint8_t count;            // Init sequences seen.
+    bool soft;
+    uint8_t errval;
+    uint16_t errors;          // Codewords that couldn't be decoded.
+} hamming_stream_t;
+
+#define HAMMING_STREAM_SEARCHING 0
+#define HAMMING_STREAM_INIT      1
+#define HAMMING_STREAM_DATA      2
+
+void hamming_stream_init(hamming_stream_t *s, bool soft, uint8_t errval);
+unsigned hamming_stream_push_bit(hamming_stream_t *s, unsigned bit, uint8_t confidence, uint8_t *out);
+
+// Framing (see hamming.c).
+#define HAMMING_FRAME_DEPTH 16 // Codewords per block (at most).
+
+uint32_t hamming_get_encoded_frame_byte_length(uint32_t len, unsigned num_init_sequences);
+void hamming_encode_frame(const uint8_t *in, unsigned length, uint8_t *out, unsigned num_init_sequences);
+
+typedef struct {
+    hamming_stream_t stream;  // Finds the init sequences and reads the header.
+    uint32_t words[HAMMING_FRAME_DEPTH];
+    uint8_t confidences[HAMMING_FRAME_DEPTH*32/2]; // Top 4 bits of each.
+    uint8_t *msg;
+    unsigned capacity;
+    unsigned length;          // Of the payload, from the header.
+    unsigned nbytes;          // Payload and CRC bytes decoded so far.
+    unsigned remaining;       // Codewords still to come, including the current block.
+    unsigned blocks;          // Likewise blocks.
+    uint16_t crc;
+    uint16_t received_crc;
+    uint16_t nbits;           // Bits of the current block received.
+    uint8_t depth;            // Codewords in the current block.
+    uint8_t state;
+} hamming_frame_t;
+
+#define HAMMING_FRAME_MORE  0
+#define HAMMING_FRAME_DONE  1
+#define HAMMING_FRAME_ERROR 2
+
+void hamming_frame_init(hamming_frame_t *f, bool soft, uint8_t *msg, unsigned capacity);
+int hamming_frame_push_bit(hamming_frame_t *f, unsigned bit, uint8_t confidence);
 
 #endif
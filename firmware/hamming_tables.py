@@ -0,0 +1,94 @@
+import sys
+
+if sys.version < '3':
+    sys.stderr.write("Run this script using Python 3\n")
+    sys.exit(1)
+
+#
+# Generates hamming_tables.h, the lookup tables used by hamming.c.
+#
+# Bit i (counting from 0) of a 32-bit word is at position i+1 of the
+# Hamming(31,26) code, apart from bit 31, which is the additional parity
+# bit. The syndrome of a word is the XOR of the positions of its set bits
+# (bit 31 excepted), so it can be computed a nibble at a time. With odd
+# parity, a codeword has syndrome 31 and an odd number of bits set.
+#
+# The tables are written using the TABLE and END_TABLE macros defined in
+# hamming.c, so that they work for the Javascript version too.
+#
+
+NIBBLES = 8
+
+# Bit 5 of a syndrome is the parity of the whole word (1 if odd).
+PARITY_BIT = 5
+GOOD_SYNDROME = 31
+
+UNCORRECTABLE = 0xFF
+
+def nibble_syndrome(k, v):
+    s = 0
+    for j in range(4):
+        if v & (1 << j):
+            i = 4*k + j
+            if i < 31:
+                s ^= i + 1
+            s ^= 1 << PARITY_BIT
+    return s
+
+# Bits to set in a word with its parity bits clear, given its syndrome, to
+# make it a codeword.
+def encode_parity(syndrome):
+    s = (syndrome & GOOD_SYNDROME) ^ GOOD_SYNDROME
+    mask = 0
+    for b in range(5):
+        if s & (1 << b):
+            mask |= 1 << ((1 << b) - 1)
+    odd = (syndrome >> PARITY_BIT) ^ bin(s).count('1')
+    if odd % 2 == 0:
+        mask |= 1 << 31
+    return mask
+
+# 1 + the index of the bit to flip to correct a word with the given
+# syndrome, 0 if its data is correct as it is, or UNCORRECTABLE. A single
+# error in a parity bit is corrected by flipping bit 0 (any parity bit would
+# do, since only the data is used). A single error in the additional parity
+# bit (bit 31) leaves the syndrome alone and the data intact, so needs no
+# correction.
+def correction(syndrome):
+    e = (syndrome & GOOD_SYNDROME) ^ GOOD_SYNDROME
+    odd = (syndrome >> PARITY_BIT) ^ (1 if e else 0)
+    if e == 0:
+        return 0
+    if odd % 2 == 0:
+        return UNCORRECTABLE
+    if e in (1, 2, 4, 8, 16):
+        return 1
+    return e
+
+def write_table(of, type, name, values, fmt, per_line):
+    of.write("TABLE(%s, %s, %i)\n" % (type, name, len(values)))
+    for i in range(0, len(values), per_line):
+        of.write("    " + ", ".join(fmt % v for v in values[i:i+per_line]) + ",\n")
+    of.write("END_TABLE\n\n")
+
+def output():
+    of = open("hamming_tables.h", "w")
+    of.write("// Generated by hamming_tables.py. Included by hamming.c only.\n\n")
+    of.write("#define HAMMING_UNCORRECTABLE %i\n\n" % UNCORRECTABLE)
+
+    of.write("// Syndrome of nibble k with value v is at [k*16 + v].\n")
+    write_table(of, "uint8_t", "HAMMING_NIBBLE_SYNDROMES",
+                [nibble_syndrome(k, v) for k in range(NIBBLES) for v in range(16)], "%i", 16)
+    write_table(of, "uint32_t", "HAMMING_ENCODE_PARITY",
+                [encode_parity(s) for s in range(64)], "0x%08X", 4)
+    write_table(of, "uint8_t", "HAMMING_CORRECTIONS",
+                [correction(s) for s in range(64)], "%i", 16)
+    of.close()
+
+if __name__ == '__main__':
+    assert len(sys.argv) >= 2
+
+    if sys.argv[1] == 'output':
+        output()
+    else:
+        assert False
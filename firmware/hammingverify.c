@@ -0,0 +1,238 @@
+//
+// Exhaustive host verification of the Hamming codec in hamming.c, split
+// across threads. For every one of the 2^26 data words, checks that its
+// codeword decodes to it unchanged and with each of the 32 single bit
+// errors, and that double bit errors are detected (for every 'double'th
+// data word; there are 496 of them per word, so checking every word takes
+// a while). Then checks that hamming_scan_for_init_sequence() finds the
+// init sequence at every bit offset with each single bit error, and never
+// with a double bit error. Reports encode and decode throughput.
+//
+// Usage: testhammingverify [threads=<cores>] [double=64]
+//
+// Returns non-zero if anything fails, so it can be run after every change
+// to the codec.
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <hamming.h>
+
+#define VERIFY_DATA_WORDS   (1 << 26)
+#define VERIFY_MAX_THREADS  64
+#define VERIFY_SCAN_OFFSETS 64
+
+typedef struct {
+    uint32_t first, last;     // Data words [first, last).
+    unsigned double_stride;
+    uint32_t checksum;        // So that encoding isn't optimized away.
+    unsigned long decodes;
+    unsigned long failures;
+    uint32_t first_failure;   // Data word, if there are any failures.
+} verify_job_t;
+
+static double wall_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(verify_job_t *j, uint32_t n)
+{
+    if (j->failures++ == 0)
+        j->first_failure = n;
+}
+
+static void *encode_job(void *arg)
+{
+    verify_job_t *j = arg;
+    uint32_t n, checksum = 0;
+    for (n = j->first; n < j->last; ++n)
+        checksum ^= hammingify_uint32(n);
+    j->checksum = checksum;
+    return NULL;
+}
+
+static void *decode_job(void *arg)
+{
+    verify_job_t *j = arg;
+    uint32_t n;
+    unsigned b;
+    for (n = j->first; n < j->last; ++n) {
+        uint32_t h = hammingify_uint32(n);
+        if (dehammingify_uint32(h) != (int32_t)n)
+            fail(j, n);
+        for (b = 0; b < 32; ++b) {
+            if (dehammingify_uint32(h ^ (1u << b)) != (int32_t)n)
+                fail(j, n);
+        }
+    }
+    j->decodes = (unsigned long)(j->last - j->first) * 33;
+    return NULL;
+}
+
+static void *double_job(void *arg)
+{
+    verify_job_t *j = arg;
+    uint32_t n;
+    unsigned b1, b2;
+    unsigned long decodes = 0;
+    for (n = j->first; n < j->last; n += j->double_stride) {
+        uint32_t h = hammingify_uint32(n);
+        for (b1 = 0; b1 < 32; ++b1) {
+            for (b2 = b1 + 1; b2 < 32; ++b2) {
+                if (dehammingify_uint32(h ^ (1u << b1) ^ (1u << b2)) != -1)
+                    fail(j, n);
+            }
+        }
+        decodes += 32*31/2;
+    }
+    j->decodes = decodes;
+    return NULL;
+}
+
+// Runs 'fn' over the data words, split evenly across 'nthreads' threads,
+// and returns the wall time it took. The results are summed into '*total'.
+static double run_jobs(void *(*fn)(void *), unsigned nthreads, unsigned double_stride, verify_job_t *total)
+{
+    pthread_t threads[VERIFY_MAX_THREADS];
+    verify_job_t jobs[VERIFY_MAX_THREADS];
+    unsigned i;
+
+    double start = wall_time();
+    for (i = 0; i < nthreads; ++i) {
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].first = (uint32_t)((uint64_t)VERIFY_DATA_WORDS * i / nthreads);
+        jobs[i].last = (uint32_t)((uint64_t)VERIFY_DATA_WORDS * (i + 1) / nthreads);
+        jobs[i].double_stride = double_stride;
+        if (pthread_create(&threads[i], NULL, fn, &jobs[i]) != 0) {
+            fprintf(stderr, "Couldn't create thread\n");
+            exit(1);
+        }
+    }
+
+    memset(total, 0, sizeof(*total));
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+        total->checksum ^= jobs[i].checksum;
+        total->decodes += jobs[i].decodes;
+        if (jobs[i].failures != 0 && total->failures == 0)
+            total->first_failure = jobs[i].first_failure;
+        total->failures += jobs[i].failures;
+    }
+    return wall_time() - start;
+}
+
+static void set_bit(uint8_t *buf, unsigned i, unsigned v)
+{
+    buf[i/8] = (buf[i/8] & ~(1 << (i % 8))) | (v << (i % 8));
+}
+
+// The init sequence, with 'errors' flipped, at each bit offset after an
+// alternating preamble and followed by an ordinary codeword.
+static unsigned long verify_scan_with(uint32_t errors, bool expect_found)
+{
+    uint8_t magic[4], word[4];
+    hamming_encode_message(NULL, 0, magic, 1);
+    uint8_t zeros[3] = { 0, 0, 0 };
+    hamming_encode_message(zeros, 3, word, 0);
+
+    unsigned long failures = 0;
+    unsigned offset, i;
+    for (offset = 0; offset < VERIFY_SCAN_OFFSETS; ++offset) {
+        uint8_t buf[(VERIFY_SCAN_OFFSETS + 64)/8 + 1];
+        for (i = 0; i < offset; ++i)
+            set_bit(buf, i, i % 2);
+        for (i = 0; i < 32; ++i)
+            set_bit(buf, offset + i, ((magic[i/8] >> (i % 8)) & 1) ^ ((errors >> i) & 1));
+        for (i = 0; i < 32; ++i)
+            set_bit(buf, offset + 32 + i, (word[i/8] >> (i % 8)) & 1);
+        for (i = offset + 64; i < sizeof(buf)*8; ++i)
+            set_bit(buf, i, i % 2);
+
+        hamming_scan_for_init_sequence_result_t r = hamming_scan_for_init_sequence(buf, sizeof(buf));
+        if (expect_found ? (r.bit_index != (int)offset || r.count != 1) : r.bit_index != -1)
+            ++failures;
+    }
+    return failures;
+}
+
+static unsigned long verify_scan()
+{
+    unsigned long failures = verify_scan_with(0, true);
+    unsigned b1, b2;
+    for (b1 = 0; b1 < 32; ++b1) {
+        failures += verify_scan_with(1u << b1, true);
+        for (b2 = b1 + 1; b2 < 32; ++b2)
+            failures += verify_scan_with((1u << b1) | (1u << b2), false);
+    }
+    return failures;
+}
+
+int main(int argc, char **argv)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned nthreads = (ncpus < 1 ? 1 : (ncpus > VERIFY_MAX_THREADS ? VERIFY_MAX_THREADS : ncpus));
+    unsigned double_stride = 64;
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        char *eq = strchr(argv[i], '=');
+        if (! eq) {
+            fprintf(stderr, "Bad argument '%s'\n", argv[i]);
+            return 1;
+        }
+        *eq = '\0';
+        int v = atoi(eq + 1);
+        if (! strcmp(argv[i], "threads") && v >= 1 && v <= VERIFY_MAX_THREADS)
+            nthreads = v;
+        else if (! strcmp(argv[i], "double") && v >= 1)
+            double_stride = v;
+        else {
+            fprintf(stderr, "Bad parameter '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+
+    printf("%u threads\n", nthreads);
+    int ret = 0;
+    verify_job_t t;
+
+    double encode_time = run_jobs(encode_job, nthreads, double_stride, &t);
+    printf("Encode: %u codewords in %.2fs, %.1fM codewords/s\n",
+           VERIFY_DATA_WORDS, encode_time, VERIFY_DATA_WORDS / encode_time / 1e6);
+
+    // Each data word is encoded again before its 33 decodes, so take off
+    // the time that takes.
+    double decode_time = run_jobs(decode_job, nthreads, double_stride, &t) - encode_time;
+    printf("Decode, no or single bit errors: %lu codewords, %.1fM codewords/s, %lu failures %s\n",
+           t.decodes, t.decodes / decode_time / 1e6, t.failures, t.failures == 0 ? "OK" : "FAIL");
+    if (t.failures != 0) {
+        printf("    first failing data word %08x\n", t.first_failure);
+        ret = 1;
+    }
+
+    double double_time = run_jobs(double_job, nthreads, double_stride, &t);
+    printf("Decode, double bit errors (every %u words): %lu codewords in %.2fs, %lu not detected %s\n",
+           double_stride, t.decodes, double_time, t.failures, t.failures == 0 ? "OK" : "FAIL");
+    if (t.failures != 0) {
+        printf("    first failing data word %08x\n", t.first_failure);
+        ret = 1;
+    }
+
+    unsigned long scan_failures = verify_scan();
+    printf("Init sequence scan: %u offsets, %lu failures %s\n",
+           VERIFY_SCAN_OFFSETS * (1 + 32 + 32*31/2), scan_failures, scan_failures == 0 ? "OK" : "FAIL");
+    if (scan_failures != 0)
+        ret = 1;
+
+    printf(ret ? "FAIL\n" : "OK\n");
+    return ret;
+}
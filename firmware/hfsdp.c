@@ -1,127 +1,554 @@
+#include <stddef.h>
 #include <hfsdp.h>
 #include <goetzel.h>
 #include <debugging.h>
+#include <myassert.h>
 
 void init_hfsdp_read_bit_state(hfsdp_read_bit_state_t *s, int32_t f1_coscoeff, int32_t f1_sincoeff, int32_t f2_coscoeff, int32_t f2_sincoeff)
 {
+    s->sync_head = 0;
+    s->sync_count = 0;
+    s->sync_hold = 0;
+    s->noise_confidence = 0;
+    s->noise_deviation = 0;
+    s->sync_confidence = 0;
+    s->sync_threshold = HFSDP_SYNC_MIN_THRESHOLD;
     s->calib_count = 0;
-    s->min_f1 = 2147483647;
-    s->max_f1 = -1;
-    s->min_f2 = 2147483647;
-    s->max_f2 = -1;
-    s->avg = 0;
+    s->calib_offset = 0;
     s->f1_coscoeff = f1_coscoeff;
     s->f1_sincoeff = f1_sincoeff;
     s->f2_coscoeff = f2_coscoeff;
     s->f2_sincoeff = f2_sincoeff;
-    s->count = 0;
-    s->f1_less_than_f2 = -1;
+
+    goetzel_sliding_init(&s->f1_sliding, f1_coscoeff, f1_sincoeff, HFSDP_TIMING_SUBBLOCK_LENGTH, HFSDP_TIMING_SUBBLOCKS);
+    goetzel_sliding_init(&s->f2_sliding, f2_coscoeff, f2_sincoeff, HFSDP_TIMING_SUBBLOCK_LENGTH, HFSDP_TIMING_SUBBLOCKS);
+    s->phase = 0;
+    s->timing_error = 0;
+    s->gates_seen = 0;
+    s->timing_recovery = true;
+    s->timing_adjustments = 0;
+    s->bit_confidence = 0;
 }
 
-bool hfsdp_check_start(hfsdp_read_bit_state_t *s, const int16_t *buf, unsigned buflen)
+// Correlation of the last HFSDP_SYNC_WINDOWS power differences with the
+// preamble, with the pattern starting a bit at windows where
+// (n + offset) % HFSDP_SAMPLE_MULTPLIER == 0 (which must be a power of two).
+static int32_t sync_correlation(const hfsdp_read_bit_state_t *s, unsigned offset)
 {
-    if (s->calib_count == 8*HFSDP_SAMPLE_MULTPLIER) { // Long enough to see both high and low values.
-        s->avg /= sizeof(s->vs)/sizeof(int32_t);
-
-        // We want to see a high standard deviation -- that indicates that
-        // this is an actual square wave signal and not just noise.
-        int32_t stddev = 0;
-        unsigned i;
-        for (i = 0; i < sizeof(s->vs)/sizeof(int32_t); ++i) {
-            int32_t x = (s->vs[i] - s->avg);
-            stddev += x*x;
-        }
-
-        if (stddev > 8000) { // Magic empirically-determined number.
-            s->highest_f1_low = s->max_f1/8;
-            s->highest_f2_low = s->max_f2/8;
-            return true;
-        }
-        else {
-            s->calib_count = 0;
-            s->min_f1 = 2147483647;
-            s->max_f1 = -1;
-            s->avg = 0;
-            return false;
-        }
+    int32_t c = 0;
+    unsigned n, i;
+    for (n = 0, i = s->sync_head; n < HFSDP_SYNC_WINDOWS; ++n) {
+        if ((n + offset) & HFSDP_SAMPLE_MULTPLIER)
+            c -= s->u.sync.diff[i];
+        else
+            c += s->u.sync.diff[i];
+        if (++i == HFSDP_SYNC_WINDOWS)
+            i = 0;
     }
+    return c;
+}
 
+// Returns true once the preamble has been seen. 's->phase' then gives the
+// position within a bit of the next sub-block (and so of the next window),
+// and 's->sync_confidence' how well the preamble matched.
+bool hfsdp_check_start(hfsdp_read_bit_state_t *s, const int16_t *buf, unsigned buflen)
+{
     goetzel_result_t r1, r2;
     int32_t p1, p2;
     goetzel2(buf, buflen, 0,
-             s->f1_coscoeff, s->f2_sincoeff,
-             s->f1_coscoeff, s->f2_sincoeff,
+             s->f1_coscoeff, s->f1_sincoeff,
+             s->f2_coscoeff, s->f2_sincoeff,
              &r1, &r2);
     p1 = goetzel_get_freq_power(&r1);
     p2 = goetzel_get_freq_power(&r2);
 
-    if (s->calib_count < sizeof(s->vs)/sizeof(s->vs[0])) {
-        s->vs[s->calib_count] = p1;
-        s->avg += p1;
+    unsigned i = s->sync_head + s->sync_count;
+    if (i >= HFSDP_SYNC_WINDOWS)
+        i -= HFSDP_SYNC_WINDOWS;
+    s->u.sync.diff[i] = p1 - p2;
+    s->u.sync.total[i] = p1 + p2;
+    if (s->sync_count < HFSDP_SYNC_WINDOWS) {
+        ++(s->sync_count);
+        return false;
+    }
+    if (++(s->sync_head) == HFSDP_SYNC_WINDOWS)
+        s->sync_head = 0;
+
+    int32_t c[HFSDP_SYNC_PERIOD];
+    unsigned k, best = 0;
+    for (k = 0; k < HFSDP_SYNC_PERIOD; ++k) {
+        c[k] = sync_correlation(s, k);
+        if (c[k] < 0)
+            c[k] = -c[k];
+        if (c[k] > c[best])
+            best = k;
     }
 
-    ++(s->calib_count);
-
-    if (p1 > s->max_f1)
-        s->max_f1 = p1;
-    else if (p2 < s->min_f1)
-        s->min_f1 = p1;
+    // Normalizing by the loudest window as well as the total means that a
+    // few loud windows after silence, or a partly received preamble, don't
+    // give high confidences. The minimum power stops quantization noise in
+    // the powers of a quiet input from doing so.
+    int32_t loudest = 0, total = 0;
+    for (k = 0; k < HFSDP_SYNC_WINDOWS; ++k) {
+        total += s->u.sync.total[k];
+        if (s->u.sync.total[k] > loudest)
+            loudest = s->u.sync.total[k];
+    }
+    total = (total + (loudest + 2*HFSDP_SYNC_MIN_POWER) * HFSDP_SYNC_WINDOWS) / 2;
+    uint32_t confidence = ((uint32_t)c[best] * HFSDP_SYNC_CONFIDENCE_ONE) / (uint32_t)total;
+    if (confidence > HFSDP_SYNC_CONFIDENCE_ONE)
+        confidence = HFSDP_SYNC_CONFIDENCE_ONE;
+    s->sync_confidence = confidence;
+
+    int32_t mean = s->noise_confidence >> HFSDP_SYNC_NOISE_SHIFT;
+    int32_t dev = (int32_t)confidence - mean;
+    int32_t noise_limit = (s->noise_confidence + 2*s->noise_deviation) >> HFSDP_SYNC_NOISE_SHIFT;
+    if (noise_limit < HFSDP_SYNC_MIN_THRESHOLD/2)
+        noise_limit = HFSDP_SYNC_MIN_THRESHOLD/2;
+    if ((int32_t)confidence < noise_limit) {
+        // Noise: adapt the threshold to the confidences it gives, keeping
+        // it well above their average. Higher confidences are left out, so
+        // that a preamble doesn't raise the threshold as it arrives.
+        s->noise_confidence += dev;
+        s->noise_deviation += (dev < 0 ? -dev : dev) - (s->noise_deviation >> HFSDP_SYNC_NOISE_SHIFT);
+        uint32_t t = (s->noise_confidence + 4*s->noise_deviation) >> HFSDP_SYNC_NOISE_SHIFT;
+        if (t < HFSDP_SYNC_MIN_THRESHOLD)
+            t = HFSDP_SYNC_MIN_THRESHOLD;
+        else if (t > HFSDP_SYNC_MAX_THRESHOLD)
+            t = HFSDP_SYNC_MAX_THRESHOLD;
+        s->sync_threshold = t;
+    }
 
-    if (p2 > s->max_f2)
-        s->max_f2 = p2;
-    else if (p2 < s->min_f2)
-        s->min_f2 = p2;
+    if (confidence < s->sync_threshold) {
+        s->sync_hold = 0;
+        return false;
+    }
 
-    // We want to try and sample somewhere around the middle of each bit.
-    if (s->f1_less_than_f2 == -2) {
-        ;
+    if (++(s->sync_hold) < HFSDP_SYNC_HOLD)
+        return false;
+
+    // The correlation falls off linearly either side of the true offset,
+    // so the difference between the neighbouring offsets gives the
+    // fraction of a window by which the bit boundaries are later than
+    // those of the best offset.
+    int32_t before = c[(best + HFSDP_SYNC_PERIOD - 1) % HFSDP_SYNC_PERIOD];
+    int32_t after = c[(best + 1) % HFSDP_SYNC_PERIOD];
+    int32_t frac = 0;
+    if (c[best] > 0) {
+        frac = ((before - after) * (2*HFSDP_TIMING_SUBBLOCKS)) / c[best];
+        frac = (frac + (frac < 0 ? -1 : 1)) / 2;
+        if (frac > HFSDP_TIMING_SUBBLOCKS/2)
+            frac = HFSDP_TIMING_SUBBLOCKS/2;
+        else if (frac < -HFSDP_TIMING_SUBBLOCKS/2)
+            frac = -HFSDP_TIMING_SUBBLOCKS/2;
     }
-    else if (s->f1_less_than_f2 == -1) {
-        s->f1_less_than_f2 = (p1 < p2);
+
+    // The next window starts at n = HFSDP_SYNC_WINDOWS, and a bit starts at
+    // -best + frac.
+    int32_t phase = (int32_t)(best * HFSDP_TIMING_SUBBLOCKS) - frac;
+    phase %= HFSDP_TIMING_BIT_SUBBLOCKS;
+    if (phase < 0)
+        phase += HFSDP_TIMING_BIT_SUBBLOCKS;
+    s->phase = phase;
+
+    return true;
+}
+
+static const goetzel_coeffs_t CALIB_TABLE[HFSDP_CALIB_TABLE_LAST - HFSDP_CALIB_TABLE_FIRST + 1] = {
+#define T(c, s) { GOETZEL_FLOAT_TO_FIX(c), GOETZEL_FLOAT_TO_FIX(s) }
+    T(-0.0796824380, 0.9968202993), // 269 (bin 33.625)
+    T(-0.0857973123, 0.9963126122), // 270 (bin 33.750)
+    T(-0.0919089565, 0.9957674145), // 271 (bin 33.875)
+    T(-0.0980171403, 0.9951847267), // 272 (bin 34.000)
+    T(-0.1041216339, 0.9945645707), // 273 (bin 34.125)
+    T(-0.1102222073, 0.9939069700), // 274 (bin 34.250)
+    T(-0.1163186309, 0.9932119492), // 275 (bin 34.375)
+    T(-0.1224106752, 0.9924795346), // 276 (bin 34.500)
+    T(-0.1284981108, 0.9917097537), // 277 (bin 34.625)
+    T(-0.1345807085, 0.9909026354), // 278 (bin 34.750)
+    T(-0.1406582393, 0.9900582103), // 279 (bin 34.875)
+    T(-0.1467304745, 0.9891765100), // 280 (bin 35.000)
+    T(-0.1527971853, 0.9882575677), // 281 (bin 35.125)
+    T(-0.1588581433, 0.9873014182), // 282 (bin 35.250)
+    T(-0.1649131205, 0.9863080972), // 283 (bin 35.375)
+    T(-0.1709618888, 0.9852776424), // 284 (bin 35.500)
+    T(-0.1770042204, 0.9842100924), // 285 (bin 35.625)
+    T(-0.1830398880, 0.9831054874), // 286 (bin 35.750)
+    T(-0.1890686641, 0.9819638691), // 287 (bin 35.875)
+    T(-0.1950903220, 0.9807852804), // 288 (bin 36.000)
+    T(-0.2011046348, 0.9795697657), // 289 (bin 36.125)
+    T(-0.2071113762, 0.9783173707), // 290 (bin 36.250)
+    T(-0.2131103199, 0.9770281427), // 291 (bin 36.375)
+    T(-0.2191012402, 0.9757021300), // 292 (bin 36.500)
+    T(-0.2250839114, 0.9743393828), // 293 (bin 36.625)
+    T(-0.2310581083, 0.9729399522), // 294 (bin 36.750)
+    T(-0.2370236060, 0.9715038910), // 295 (bin 36.875)
+    T(-0.2429801799, 0.9700312532), // 296 (bin 37.000)
+    T(-0.2489276057, 0.9685220943), // 297 (bin 37.125)
+    T(-0.2548656596, 0.9669764710), // 298 (bin 37.250)
+    T(-0.2607941179, 0.9653944417), // 299 (bin 37.375)
+    T(-0.2667127575, 0.9637760658), // 300 (bin 37.500)
+    T(-0.2726213554, 0.9621214043), // 301 (bin 37.625)
+    T(-0.2785196894, 0.9604305194), // 302 (bin 37.750)
+    T(-0.2844075372, 0.9587034749), // 303 (bin 37.875)
+    T(-0.2902846773, 0.9569403357), // 304 (bin 38.000)
+    T(-0.2961508882, 0.9551411683), // 305 (bin 38.125)
+    T(-0.3020059493, 0.9533060404), // 306 (bin 38.250)
+    T(-0.3078496400, 0.9514350210), // 307 (bin 38.375)
+    T(-0.3136817404, 0.9495281806), // 308 (bin 38.500)
+    T(-0.3195020308, 0.9475855910), // 309 (bin 38.625)
+    T(-0.3253102922, 0.9456073254), // 310 (bin 38.750)
+    T(-0.3311063058, 0.9435934582), // 311 (bin 38.875)
+    T(-0.3368898534, 0.9415440652), // 312 (bin 39.000)
+    T(-0.3426607173, 0.9394592236), // 313 (bin 39.125)
+    T(-0.3484186802, 0.9373390119), // 314 (bin 39.250)
+    T(-0.3541635254, 0.9351835099), // 315 (bin 39.375)
+    T(-0.3598950365, 0.9329927988), // 316 (bin 39.500)
+    T(-0.3656129978, 0.9307669611), // 317 (bin 39.625)
+    T(-0.3713171940, 0.9285060805), // 318 (bin 39.750)
+    T(-0.3770074102, 0.9262102421), // 319 (bin 39.875)
+    T(-0.3826834324, 0.9238795325), // 320 (bin 40.000)
+    T(-0.3883450467, 0.9215140393), // 321 (bin 40.125)
+    T(-0.3939920401, 0.9191138517), // 322 (bin 40.250)
+    T(-0.3996241998, 0.9166790599), // 323 (bin 40.375)
+    T(-0.4052413140, 0.9142097557), // 324 (bin 40.500)
+    T(-0.4108431711, 0.9117060320), // 325 (bin 40.625)
+    T(-0.4164295601, 0.9091679831), // 326 (bin 40.750)
+    T(-0.4220002708, 0.9065957045), // 327 (bin 40.875)
+    T(-0.4275550934, 0.9039892931), // 328 (bin 41.000)
+    T(-0.4330938189, 0.9013488470), // 329 (bin 41.125)
+    T(-0.4386162385, 0.8986744657), // 330 (bin 41.250)
+    T(-0.4441221446, 0.8959662498), // 331 (bin 41.375)
+#undef T
+};
+
+static const goetzel_coeffs_t *calib_coeffs(int step)
+{
+    assert(step >= HFSDP_CALIB_TABLE_FIRST && step <= HFSDP_CALIB_TABLE_LAST);
+    return CALIB_TABLE + (step - HFSDP_CALIB_TABLE_FIRST);
+}
+
+// Call with each window following the one for which hfsdp_check_start()
+// returned true, until it returns true. Even windows look at frequencies
+// around f1, and odd windows at those around f2; since the preamble
+// alternates, each carrier is in half of the windows it's looked for in.
+bool hfsdp_calibrate(hfsdp_read_bit_state_t *s, const int16_t *buf, unsigned buflen)
+{
+    unsigned i, carrier = s->calib_count & 1;
+    if (s->calib_count == 0) {
+        for (i = 0; i < HFSDP_CALIB_CANDIDATES; ++i) {
+            s->u.calib.power[0][i] = 0;
+            s->u.calib.power[1][i] = 0;
+        }
     }
-    else if ((s->f1_less_than_f2 && p2 >= p1) ||
-             ((!s->f1_less_than_f2) && p1 < p2)) {
-        s->count = 0;
-        s->f1_less_than_f2 = -2;
+
+    // Keep track of where we are in the bit for hfsdp_read_bit().
+    s->phase = (s->phase + HFSDP_TIMING_SUBBLOCKS) % HFSDP_TIMING_BIT_SUBBLOCKS;
+
+    goetzel_result_t results[HFSDP_CALIB_CANDIDATES];
+    goetzel_bank(buf, buflen, 0,
+                 calib_coeffs((carrier ? HFSDP_CALIB_F2 : HFSDP_CALIB_F1) - HFSDP_CALIB_MAX_OFFSET),
+                 results, HFSDP_CALIB_CANDIDATES);
+    for (i = 0; i < HFSDP_CALIB_CANDIDATES; ++i)
+        s->u.calib.power[carrier][i] += goetzel_get_freq_power(results + i);
+
+    if (++(s->calib_count) < HFSDP_CALIB_WINDOWS)
+        return false;
+
+    int best[2] = { 0, 0 };
+    for (carrier = 0; carrier < 2; ++carrier) {
+        for (i = 1; i < HFSDP_CALIB_CANDIDATES; ++i) {
+            if (s->u.calib.power[carrier][i] > s->u.calib.power[carrier][best[carrier]])
+                best[carrier] = i;
+        }
+        best[carrier] -= HFSDP_CALIB_MAX_OFFSET;
     }
-    ++(s->count);
-    if (s->count == HFSDP_SAMPLE_MULTPLIER)
-        s->count = 0;
 
-    return false;
+    const goetzel_coeffs_t *c1 = calib_coeffs(HFSDP_CALIB_F1 + best[0]);
+    const goetzel_coeffs_t *c2 = calib_coeffs(HFSDP_CALIB_F2 + best[1]);
+    s->f1_coscoeff = c1->cos_coeff;
+    s->f1_sincoeff = c1->sin_coeff;
+    s->f2_coscoeff = c2->cos_coeff;
+    s->f2_sincoeff = c2->sin_coeff;
+    goetzel_sliding_init(&s->f1_sliding, s->f1_coscoeff, s->f1_sincoeff, HFSDP_TIMING_SUBBLOCK_LENGTH, HFSDP_TIMING_SUBBLOCKS);
+    goetzel_sliding_init(&s->f2_sliding, s->f2_coscoeff, s->f2_sincoeff, HFSDP_TIMING_SUBBLOCK_LENGTH, HFSDP_TIMING_SUBBLOCKS);
+
+    // The carriers are close enough together that they move by the same
+    // number of steps (give or take rounding).
+    int offset = best[0] + best[1];
+    s->calib_offset = (offset + (offset < 0 ? -1 : 1)) / 2;
+
+    return true;
 }
 
 int32_t hfsdp_read_bit_debug_last_f1;
 int32_t hfsdp_read_bit_debug_last_f2;
 
-int hfsdp_read_bit(hfsdp_read_bit_state_t *s, const int16_t *buf, unsigned buflen)
+#define GATE_EARLY  1
+#define GATE_ONTIME 2
+
+// Returns f1 power - f2 power over the last window, and sets '*total' (if
+// not NULL) to their sum.
+static int32_t sliding_power_difference(hfsdp_read_bit_state_t *s, int32_t *total)
 {
     goetzel_result_t r1, r2;
-    int32_t p1, p2;
-    goetzel2(buf, buflen, 0,
-             s->f1_coscoeff, s->f1_sincoeff,
-             s->f2_coscoeff, s->f2_sincoeff,
-             &r1, &r2);
-
-    p1 = goetzel_get_freq_power(&r1);
-    p2 = goetzel_get_freq_power(&r2);
+    goetzel_sliding_get_result(&s->f1_sliding, &r1);
+    goetzel_sliding_get_result(&s->f2_sliding, &r2);
 
+    int32_t p1 = goetzel_get_freq_power(&r1);
+    int32_t p2 = goetzel_get_freq_power(&r2);
     hfsdp_read_bit_debug_last_f1 = p1;
     hfsdp_read_bit_debug_last_f2 = p2;
+    if (total)
+        *total = p1 + p2;
+    return p1 - p2;
+}
 
-    ++(s->count);
-    if (s->count == HFSDP_SAMPLE_MULTPLIER/2)
-        return (p1 < p2);
+static int32_t abs32(int32_t x)
+{
+    return x < 0 ? -x : x;
+}
 
-    if (s->count == HFSDP_SAMPLE_MULTPLIER)
-        s->count = 0;
+// Returns 0 or 1 once per bit, otherwise HFSDP_READ_BIT_NOTHING_READ.
+// 's->bit_confidence' is then the difference between the carrier powers as
+// a fraction of their sum, from 0 (a guess) to HFSDP_BIT_CONFIDENCE_MAX.
+// 'buflen' must be HFSDP_WINDOW_LENGTH.
+int hfsdp_read_bit(hfsdp_read_bit_state_t *s, const int16_t *buf, unsigned buflen)
+{
+    assert(buflen == HFSDP_WINDOW_LENGTH);
 
-    return HFSDP_READ_BIT_NOTHING_READ;
+    int ret = HFSDP_READ_BIT_NOTHING_READ;
+    unsigned i;
+    for (i = 0; i < HFSDP_TIMING_SUBBLOCKS; ++i, buf += HFSDP_TIMING_SUBBLOCK_LENGTH) {
+        goetzel_sliding_add_block2(&s->f1_sliding, &s->f2_sliding, buf);
+
+        int8_t p = s->phase++;
+        bool full = (s->f1_sliding.count == HFSDP_TIMING_SUBBLOCKS);
+
+        if (p == HFSDP_TIMING_EARLY_GATE && full) {
+            s->early = sliding_power_difference(s, NULL);
+            s->gates_seen |= GATE_EARLY;
+        }
+        else if (p == HFSDP_TIMING_ONTIME_GATE && full) {
+            s->ontime = sliding_power_difference(s, &s->ontime_total);
+            s->gates_seen |= GATE_ONTIME;
+        }
+        else if (p == HFSDP_TIMING_LATE_GATE) {
+            int32_t late = (full ? sliding_power_difference(s, NULL) : 0);
+            int adjust = 0;
+
+            if (s->gates_seen & GATE_ONTIME) {
+                ret = (s->ontime < 0);
+                s->bit_confidence = ((uint32_t)abs32(s->ontime) * HFSDP_BIT_CONFIDENCE_MAX) / (uint32_t)(s->ontime_total + 1);
+            }
+
+            // If the decision point is late, the late window overlaps the
+            // next bit, reducing the difference between the carriers (and
+            // vice versa). Votes only count when the difference is large
+            // compared to the on-time difference, so that runs of equal
+            // bits and noise don't move the decision point.
+            if (s->timing_recovery && s->gates_seen == (GATE_EARLY | GATE_ONTIME)) {
+                int32_t e = abs32(s->early) - abs32(late);
+                int32_t threshold = abs32(s->ontime) / 4;
+                if (e > threshold)
+                    ++(s->timing_error);
+                else if (e < -threshold)
+                    --(s->timing_error);
+
+                if (s->timing_error >= HFSDP_TIMING_LOOP_GAIN)
+                    adjust = 1;
+                else if (s->timing_error <= -HFSDP_TIMING_LOOP_GAIN)
+                    adjust = -1;
+                if (adjust != 0) {
+                    s->timing_error = 0;
+                    s->timing_adjustments += adjust;
+                }
+            }
+
+            // Skip a sub-block (adjust == 1) or treat the next one as
+            // belonging to this bit (adjust == -1).
+            s->phase = adjust;
+            s->gates_seen = 0;
+        }
+    }
+
+    return ret;
+}
+
+// Sets up MFSK decoding with 4 or 8 tones, continuing from the symbol timing
+// established by hfsdp_check_start() and the tuning found by
+// hfsdp_calibrate() (if it was called).
+void init_hfsdp_mfsk_state(hfsdp_mfsk_state_t *s, const hfsdp_read_bit_state_t *started, unsigned ntones)
+{
+    assert(ntones == 4 || ntones == 8);
+
+    unsigned step = HFSDP_MFSK_MAX_TONES / ntones;
+    unsigned i;
+    for (i = 0; i < ntones; ++i) {
+        const goetzel_coeffs_t *c = calib_coeffs((HFSDP_MFSK_FIRST_BIN + i*step) * HFSDP_CALIB_STEPS_PER_BIN + started->calib_offset);
+        goetzel_sliding_init(s->tones + i, c->cos_coeff, c->sin_coeff, HFSDP_TIMING_SUBBLOCK_LENGTH, HFSDP_TIMING_SUBBLOCKS);
+    }
+    s->ntones = ntones;
+    s->bits_per_symbol = (ntones == 8 ? 3 : 2);
+    s->marker_seen = 0;
+    s->best = -1;
+    s->gates_seen = 0;
+    s->timing_error = 0;
+    s->timing_adjustments = 0;
+
+    // Binary bits are a whole number of MFSK symbols, so symbol boundaries
+    // fall on bit boundaries.
+    s->phase = started->phase % HFSDP_MFSK_SYMBOL_SUBBLOCKS;
+}
+
+// Returns the power of tone 't' over the last window.
+static int32_t mfsk_power(const hfsdp_mfsk_state_t *s, unsigned t)
+{
+    goetzel_result_t r;
+    goetzel_sliding_get_result(s->tones + t, &r);
+    return goetzel_get_freq_power(&r);
+}
+
+// Returns the value of a symbol (with 'bits_per_symbol' bits) once per symbol
+// after the marker, or HFSDP_READ_BIT_NOTHING_READ. 'buflen' must be
+// HFSDP_WINDOW_LENGTH.
+int hfsdp_mfsk_read_symbol(hfsdp_mfsk_state_t *s, const int16_t *buf, unsigned buflen)
+{
+    assert(buflen == HFSDP_WINDOW_LENGTH);
+
+    int ret = HFSDP_READ_BIT_NOTHING_READ;
+    unsigned i;
+    for (i = 0; i < HFSDP_TIMING_SUBBLOCKS; ++i, buf += HFSDP_TIMING_SUBBLOCK_LENGTH) {
+        unsigned t;
+        for (t = 0; t < s->ntones; t += 2)
+            goetzel_sliding_add_block2(s->tones + t, s->tones + t + 1, buf);
+
+        int8_t p = s->phase++;
+        bool full = (s->tones[0].count == HFSDP_TIMING_SUBBLOCKS);
+
+        if (p == HFSDP_MFSK_EARLY_GATE && full) {
+            for (t = 0; t < s->ntones; ++t)
+                s->early[t] = mfsk_power(s, t);
+            s->gates_seen |= GATE_EARLY;
+        }
+        else if (p == HFSDP_MFSK_ONTIME_GATE && full) {
+            unsigned best = 0;
+            int32_t best_power = -1;
+            for (t = 0; t < s->ntones; ++t) {
+                int32_t power = mfsk_power(s, t);
+                if (power > best_power) {
+                    best_power = power;
+                    best = t;
+                }
+            }
+            s->best = best;
+            s->ontime = best_power;
+            s->gates_seen |= GATE_ONTIME;
+
+            if (s->marker_seen < HFSDP_MFSK_MARKER_SYMBOLS) {
+                unsigned bin = HFSDP_MFSK_FIRST_BIN + best*(HFSDP_MFSK_MAX_TONES / s->ntones);
+                if (bin == HFSDP_MFSK_MARKER_BIN(s->marker_seen))
+                    ++(s->marker_seen);
+                else
+                    s->marker_seen = (bin == HFSDP_MFSK_MARKER_BIN(0));
+            }
+            else {
+                // Tone index is the Gray code of the symbol value.
+                unsigned v = best;
+                for (t = best >> 1; t; t >>= 1)
+                    v ^= t;
+                ret = v;
+            }
+        }
+        else if (p == HFSDP_MFSK_LATE_GATE) {
+            int adjust = 0;
+
+            // As in hfsdp_read_bit(), the late window overlaps the next
+            // symbol if the decision point is late, and the early window
+            // the previous one if it's early. Either reduces the power of
+            // the decided tone, unless the neighbouring symbol is the same.
+            if (s->gates_seen == (GATE_EARLY | GATE_ONTIME) && full) {
+                int32_t e = s->early[s->best] - mfsk_power(s, s->best);
+                int32_t threshold = s->ontime / 4;
+                if (e > threshold)
+                    ++(s->timing_error);
+                else if (e < -threshold)
+                    --(s->timing_error);
+
+                if (s->timing_error >= HFSDP_TIMING_LOOP_GAIN)
+                    adjust = 1;
+                else if (s->timing_error <= -HFSDP_TIMING_LOOP_GAIN)
+                    adjust = -1;
+                if (adjust != 0) {
+                    s->timing_error = 0;
+                    s->timing_adjustments += adjust;
+                }
+            }
+
+            s->phase = adjust;
+            s->gates_seen = 0;
+        }
+    }
+
+    return ret;
+}
+
+void init_hfsdp_receiver(hfsdp_receiver_t *r, uint8_t *buffer, unsigned bytes, uint8_t *confidences)
+{
+    init_hfsdp_read_bit_state(&r->s, HFSDP_COSCOEFF1, HFSDP_SINCOEFF1,
+                                     HFSDP_COSCOEFF2, HFSDP_SINCOEFF2);
+    r->buffer = buffer;
+    r->confidences = confidences;
+    r->bits = bytes*8;
+    r->nreceived = 0;
+    r->started = false;
+    r->calibrated = false;
+}
+
+// Takes the next window (HFSDP_WINDOW_LENGTH samples). Returns a bit as
+// hfsdp_read_bit() does, once the start sequence has been found and the
+// carriers calibrated. 'r->s.bit_confidence' is then its confidence. Nothing
+// is written to 'r->buffer'.
+int hfsdp_receive_bit(hfsdp_receiver_t *r, const int16_t *buf)
+{
+    if (! r->started) {
+        r->started = hfsdp_check_start(&r->s, buf, HFSDP_WINDOW_LENGTH);
+        return HFSDP_READ_BIT_NOTHING_READ;
+    }
+    if (! r->calibrated) {
+        r->calibrated = hfsdp_calibrate(&r->s, buf, HFSDP_WINDOW_LENGTH);
+        return HFSDP_READ_BIT_NOTHING_READ;
+    }
+    return hfsdp_read_bit(&r->s, buf, HFSDP_WINDOW_LENGTH);
+}
+
+// Takes the next window (HFSDP_WINDOW_LENGTH samples). Returns
+// HFSDP_RECEIVE_DONE once the buffer is full, HFSDP_RECEIVE_ERROR if
+// the bits can't be decoded, and otherwise HFSDP_RECEIVE_MORE.
+int hfsdp_receive_window(hfsdp_receiver_t *r, const int16_t *buf)
+{
+    int b = hfsdp_receive_bit(r, buf);
+    if (b == HFSDP_READ_BIT_DECODE_ERROR)
+        return HFSDP_RECEIVE_ERROR;
+    if (b == HFSDP_READ_BIT_NOTHING_READ)
+        return HFSDP_RECEIVE_MORE;
+
+    unsigned shiftup = r->nreceived % 8;
+    if (shiftup == 0)
+        r->buffer[r->nreceived/8] = b;
+    else
+        r->buffer[r->nreceived/8] |= (b << shiftup);
+    if (r->confidences)
+        r->confidences[r->nreceived] = r->s.bit_confidence;
+    ++(r->nreceived);
+
+    return r->nreceived == r->bits ? HFSDP_RECEIVE_DONE : HFSDP_RECEIVE_MORE;
 }
 
 #ifdef TEST
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
 
 #define SAMPLES_TO_SKIP_F_BITS 8
 #define SAMPLES_TO_SKIP ((int)(((float)(44100 << SAMPLES_TO_SKIP_F_BITS)/(HFSDP_SAMPLE_FREQ*1.0))))
@@ -279,8 +706,298 @@ static void test2(const char *filename)
     printf("Best c1 = %i, c2 = %i\n", best_c1, best_c2);
 }
 
+#define SYNTH_FS          (8000000.0/124)
+#define SYNTH_WINDOW      128
+#define SYNTH_PREAMBLE    24
+#define SYNTH_SYMBOLS     400
+
+static double mfsk_tone_freq(unsigned tone)
+{
+    return (HFSDP_MFSK_FIRST_BIN + tone) * (SYNTH_FS / SYNTH_WINDOW);
+}
+
+// Synthesises a binary preamble of alternating bits, the marker and random
+// MFSK symbols, with noise, and checks that they decode. Every window goes
+// through the same calls as in piezo_read_data_mfsk(), so the decoded symbols
+// have to line up with the transmitted ones without any help. The sample
+// rate is off by 'clock_error' (e.g. 0.01 for 1% slow), which makes symbols
+// shorter and frequencies higher, so that over SYNTH_SYMBOLS symbols the
+// boundaries drift by several windows.
+static int test_mfsk(unsigned ntones, unsigned noise_level, double clock_error)
+{
+    const double f1 = acos(HFSDP_COSCOEFF1_) * SYNTH_FS * (1 + clock_error) / (2*M_PI);
+    const double f2 = acos(HFSDP_COSCOEFF2_) * SYNTH_FS * (1 + clock_error) / (2*M_PI);
+    const double bit_samples = SYNTH_FS / (HFSDP_SIGNAL_FREQ * (1 + clock_error));
+    const double sym_samples = bit_samples / 2;
+    unsigned bits_per_symbol = (ntones == 8 ? 3 : 2);
+
+    unsigned nsamples = (unsigned)(SYNTH_PREAMBLE*bit_samples + (HFSDP_MFSK_MARKER_SYMBOLS+SYNTH_SYMBOLS+4)*sym_samples);
+    int16_t *samples = malloc(sizeof(int16_t) * nsamples);
+    unsigned symbols[SYNTH_SYMBOLS];
+
+    srand(ntones);
+    unsigned i;
+    for (i = 0; i < SYNTH_SYMBOLS; ++i)
+        symbols[i] = rand() % ntones;
+
+    double phase = 0;
+    for (i = 0; i < nsamples; ++i) {
+        double freq;
+        if (i < SYNTH_PREAMBLE*bit_samples) {
+            freq = ((unsigned)(i / bit_samples)) % 2 ? f2 : f1;
+        }
+        else {
+            unsigned si = (unsigned)((i - SYNTH_PREAMBLE*bit_samples) / sym_samples), tone;
+            if (si < HFSDP_MFSK_MARKER_SYMBOLS) {
+                tone = HFSDP_MFSK_MARKER_BIN(si) - HFSDP_MFSK_FIRST_BIN;
+            }
+            else {
+                si -= HFSDP_MFSK_MARKER_SYMBOLS;
+                unsigned v = (si < SYNTH_SYMBOLS ? symbols[si] : 0);
+                tone = (v ^ (v >> 1)) * (HFSDP_MFSK_MAX_TONES / ntones);
+            }
+            freq = mfsk_tone_freq(tone) * (1 + clock_error);
+        }
+        phase += 2*M_PI*freq/SYNTH_FS;
+        double noise = ((rand() % 2001) - 1000) / 1000.0;
+        samples[i] = (int16_t)(400*sin(phase) + noise_level*noise);
+    }
+
+    hfsdp_read_bit_state_t s;
+    init_hfsdp_read_bit_state(&s, HFSDP_COSCOEFF1, HFSDP_SINCOEFF1, HFSDP_COSCOEFF2, HFSDP_SINCOEFF2);
+    hfsdp_mfsk_state_t ms;
+    bool started = false, calibrated = false;
+    unsigned decoded[SYNTH_SYMBOLS*2], ndecoded = 0;
+    for (i = 0; i + SYNTH_WINDOW <= nsamples && ndecoded < SYNTH_SYMBOLS; i += SYNTH_WINDOW) {
+        if (! started) {
+            started = hfsdp_check_start(&s, samples + i, SYNTH_WINDOW);
+        }
+        else if (! calibrated) {
+            calibrated = hfsdp_calibrate(&s, samples + i, SYNTH_WINDOW);
+            if (calibrated)
+                init_hfsdp_mfsk_state(&ms, &s, ntones);
+        }
+        else {
+            int r = hfsdp_mfsk_read_symbol(&ms, samples + i, SYNTH_WINDOW);
+            if (r >= 0)
+                decoded[ndecoded++] = r;
+        }
+    }
+
+    // The first decoded symbol has to be the first transmitted one. Symbols
+    // that never arrived count as wrong in every bit.
+    unsigned errors = (SYNTH_SYMBOLS - ndecoded) * bits_per_symbol;
+    for (i = 0; i < ndecoded; ++i) {
+        unsigned d = decoded[i] ^ symbols[i];
+        for (; d; d &= d - 1)
+            ++errors;
+    }
+
+    double ber = ((double)errors) / (SYNTH_SYMBOLS * bits_per_symbol);
+    bool ok = ber < 0.01;
+    printf("MFSK %i tones, clock error %+.2f%%, noise %4i: offset %+i, %4i adjustments, %i symbols decoded, BER = %f %s\n",
+           ntones, clock_error*100, noise_level, s.calib_offset, ms.timing_adjustments, ndecoded, ber, ok ? "OK" : "FAIL");
+
+    free(samples);
+    return ok ? 0 : 1;
+}
+
+#define SYNTH_BITS        600
+
+// Synthesises a binary preamble followed by random bits, as received with a
+// sample rate that is off by 'clock_error' (e.g. 0.005 for 0.5% slow, which
+// makes bits shorter and frequencies higher), and checks how many bits
+// decode with and without timing recovery and calibration.
+static int test_binary(double clock_error, unsigned noise_level, bool timing_recovery, bool calibrate)
+{
+    const double f1 = acos(HFSDP_COSCOEFF1_) * SYNTH_FS * (1 + clock_error) / (2*M_PI);
+    const double f2 = acos(HFSDP_COSCOEFF2_) * SYNTH_FS * (1 + clock_error) / (2*M_PI);
+    const double bit_samples = SYNTH_FS / (HFSDP_SIGNAL_FREQ * (1 + clock_error));
+
+    unsigned nsamples = (unsigned)((SYNTH_PREAMBLE+SYNTH_BITS+2)*bit_samples);
+    int16_t *samples = malloc(sizeof(int16_t) * nsamples);
+    unsigned char bits[SYNTH_PREAMBLE+SYNTH_BITS];
+
+    srand(1);
+    unsigned i;
+    for (i = 0; i < SYNTH_PREAMBLE+SYNTH_BITS; ++i)
+        bits[i] = (i < SYNTH_PREAMBLE ? i % 2 : rand() % 2);
+
+    double phase = 0;
+    for (i = 0; i < nsamples; ++i) {
+        unsigned bi = (unsigned)(i / bit_samples);
+        double freq = (bi < SYNTH_PREAMBLE+SYNTH_BITS && bits[bi]) ? f2 : f1;
+        phase += 2*M_PI*freq/SYNTH_FS;
+        double noise = ((rand() % 2001) - 1000) / 1000.0;
+        samples[i] = (int16_t)(400*sin(phase) + noise_level*noise);
+    }
+
+    hfsdp_read_bit_state_t s;
+    init_hfsdp_read_bit_state(&s, HFSDP_COSCOEFF1, HFSDP_SINCOEFF1, HFSDP_COSCOEFF2, HFSDP_SINCOEFF2);
+    s.timing_recovery = timing_recovery;
+    bool started = false, calibrated = ! calibrate;
+    unsigned char decoded[SYNTH_PREAMBLE+SYNTH_BITS+8];
+    unsigned ndecoded = 0;
+    for (i = 0; i + SYNTH_WINDOW <= nsamples && ndecoded < sizeof(decoded); i += SYNTH_WINDOW) {
+        if (! started) {
+            started = hfsdp_check_start(&s, samples + i, SYNTH_WINDOW);
+        }
+        else if (! calibrated) {
+            calibrated = hfsdp_calibrate(&s, samples + i, SYNTH_WINDOW);
+        }
+        else {
+            int r = hfsdp_read_bit(&s, samples + i, SYNTH_WINDOW);
+            if (r >= 0)
+                decoded[ndecoded++] = r;
+        }
+    }
+
+    // Line up the decoded bits with the random bits, using the alignment
+    // at the start of the message.
+    unsigned start, best_start = 0, errors, best_errors = SYNTH_BITS;
+    for (start = 0; start + 32 <= ndecoded && start < SYNTH_PREAMBLE; ++start) {
+        errors = 0;
+        for (i = 0; i < 32; ++i)
+            errors += (decoded[start + i] != bits[SYNTH_PREAMBLE + i]);
+        if (errors < best_errors) {
+            best_errors = errors;
+            best_start = start;
+        }
+    }
+    errors = 0;
+    for (i = 0; i < SYNTH_BITS; ++i) {
+        if (best_start + i >= ndecoded || decoded[best_start + i] != bits[SYNTH_PREAMBLE + i])
+            ++errors;
+    }
+
+    double ber = ((double)errors) / SYNTH_BITS;
+    bool ok = true;
+    if (timing_recovery && calibrate)
+        ok = (ber < 0.01 && abs(s.calib_offset - (int)lround(clock_error*(HFSDP_CALIB_F1+HFSDP_CALIB_F2)/2)) <= 1);
+    printf("Binary, clock error %+.2f%%, noise %4i, timing recovery %s, calibration %s: %4i adjustments, offset %+i, BER = %f %s\n",
+           clock_error*100, noise_level, timing_recovery ? "on " : "off", calibrate ? "on " : "off",
+           s.timing_adjustments, s.calib_offset, ber, ok ? "OK" : "FAIL");
+
+    free(samples);
+    return ok ? 0 : 1;
+}
+
+#define SYNTH_NOISE_WINDOWS 20000
+
+// Checks that noise (and a steady tone on one carrier) doesn't look like
+// the preamble, and that the preamble is found quickly and with the right
+// symbol phase at various offsets and noise levels.
+static int test_sync()
+{
+    const double f1 = acos(HFSDP_COSCOEFF1_) * SYNTH_FS / (2*M_PI);
+    const double f2 = acos(HFSDP_COSCOEFF2_) * SYNTH_FS / (2*M_PI);
+    const double bit_samples = SYNTH_FS / HFSDP_SIGNAL_FREQ;
+    int16_t window[SYNTH_WINDOW];
+    int ret = 0;
+    unsigned i, j;
+
+    srand(2);
+    static const unsigned noise_levels[] = { 2, 50, 400, 1500 };
+    for (j = 0; j < sizeof(noise_levels)/sizeof(noise_levels[0]) * 2; ++j) {
+        unsigned level = noise_levels[j/2];
+        bool tone = j % 2;
+        hfsdp_read_bit_state_t s;
+        init_hfsdp_read_bit_state(&s, HFSDP_COSCOEFF1, HFSDP_SINCOEFF1, HFSDP_COSCOEFF2, HFSDP_SINCOEFF2);
+        unsigned false_locks = 0, max_confidence = 0;
+        double phase = 0;
+        for (i = 0; i < SYNTH_NOISE_WINDOWS; ++i) {
+            unsigned k;
+            for (k = 0; k < SYNTH_WINDOW; ++k) {
+                phase += 2*M_PI*f1/SYNTH_FS;
+                window[k] = (int16_t)((tone ? 400*sin(phase) : 0) + level*(((rand() % 2001) - 1000) / 1000.0));
+            }
+            if (hfsdp_check_start(&s, window, SYNTH_WINDOW)) {
+                ++false_locks;
+                init_hfsdp_read_bit_state(&s, HFSDP_COSCOEFF1, HFSDP_SINCOEFF1, HFSDP_COSCOEFF2, HFSDP_SINCOEFF2);
+            }
+            if (s.sync_confidence > max_confidence)
+                max_confidence = s.sync_confidence;
+        }
+        printf("Noise %4i%s: max confidence %3i, threshold %3i, %i false starts %s\n",
+               level, tone ? " + tone" : "       ", max_confidence, s.sync_threshold, false_locks, false_locks == 0 ? "OK" : "FAIL");
+        if (false_locks)
+            ret = 1;
+    }
+
+    static const unsigned signal_noise_levels[] = { 50, 400, 800 };
+    for (j = 0; j < sizeof(signal_noise_levels)/sizeof(signal_noise_levels[0]); ++j) {
+        unsigned level = signal_noise_levels[j];
+        unsigned trial, locks = 0, total_latency = 0;
+        int max_phase_error = 0;
+        for (trial = 0; trial < 200; ++trial) {
+            hfsdp_read_bit_state_t s;
+            init_hfsdp_read_bit_state(&s, HFSDP_COSCOEFF1, HFSDP_SINCOEFF1, HFSDP_COSCOEFF2, HFSDP_SINCOEFF2);
+
+            // Noise, then the preamble starting at a random sample.
+            unsigned start = SYNTH_WINDOW*40 + rand() % (unsigned)bit_samples;
+            double phase = 0;
+            for (i = 0; i < start + SYNTH_PREAMBLE*bit_samples; i += SYNTH_WINDOW) {
+                unsigned k;
+                for (k = 0; k < SYNTH_WINDOW; ++k) {
+                    double a = 0, freq = f1;
+                    if (i + k >= start) {
+                        a = 400;
+                        freq = ((unsigned)((i + k - start) / bit_samples)) % 2 ? f2 : f1;
+                    }
+                    phase += 2*M_PI*freq/SYNTH_FS;
+                    window[k] = (int16_t)(a*sin(phase) + level*(((rand() % 2001) - 1000) / 1000.0));
+                }
+                if (hfsdp_check_start(&s, window, SYNTH_WINDOW))
+                    break;
+            }
+            if (i >= start + SYNTH_PREAMBLE*bit_samples)
+                continue;
+
+            ++locks;
+            total_latency += (i + SYNTH_WINDOW - start) / SYNTH_WINDOW;
+
+            // Where the next window starts within a bit, in sub-blocks.
+            double next = fmod((i + SYNTH_WINDOW - start) / bit_samples, 1.0) * HFSDP_TIMING_BIT_SUBBLOCKS;
+            int err = (int)lround(s.phase - next);
+            err = ((err + 3*HFSDP_TIMING_BIT_SUBBLOCKS/2) % HFSDP_TIMING_BIT_SUBBLOCKS) - HFSDP_TIMING_BIT_SUBBLOCKS/2;
+            if (abs(err) > max_phase_error)
+                max_phase_error = abs(err);
+        }
+        bool ok = locks == trial && max_phase_error <= 2;
+        printf("Preamble, noise %4i: %i/%i starts found, mean latency %.1f windows, max phase error %i sub-blocks %s\n",
+               level, locks, trial, locks ? (double)total_latency / locks : 0.0, max_phase_error, ok ? "OK" : "FAIL");
+        if (! ok)
+            ret = 1;
+    }
+
+    return ret;
+}
+
 int main(int argc, char **argv)
 {
+    if (argc == 1) {
+        // Synthetic tests.
+        int r = test_sync();
+        static const double clock_errors[] = { 0, 0.005, -0.005, 0.01, -0.01 };
+        unsigned i;
+        for (i = 0; i < sizeof(clock_errors)/sizeof(clock_errors[0]); ++i) {
+            r |= test_mfsk(4, 150, clock_errors[i]);
+            r |= test_mfsk(8, 150, clock_errors[i]);
+            r |= test_mfsk(8, 500, clock_errors[i]);
+            r |= test_mfsk(8, 900, clock_errors[i]);
+        }
+
+        for (i = 0; i < sizeof(clock_errors)/sizeof(clock_errors[0]); ++i) {
+            r |= test_binary(clock_errors[i], 150, false, true);
+            r |= test_binary(clock_errors[i], 150, true, true);
+        }
+        r |= test_binary(0.01, 300, true, false);
+        r |= test_binary(0.01, 300, true, true);
+        r |= test_binary(-0.01, 300, true, false);
+        r |= test_binary(-0.01, 300, true, true);
+        return r;
+    }
+
     if (argc != 2) {
         fprintf(stderr, "Bad arguments\n");
         exit(1);
@@ -6,11 +6,10 @@
 #include <goetzel.h>
 
 //
-// We're sampling at 88888.89Hz.
-// (This is our approximation to 88400Hz (= 2*44100Hz) using the 8MHz clock.)
+// We're sampling at 64516.13Hz (PIEZO_MIC_SAMPLE_FREQ), in windows of 128
+// samples, giving HFSDP_SAMPLE_MULTPLIER windows per bit.
 //
-// Clock carrier frequency: 20000Hz
-// Data carrier frequency:  18000Hz
+// Carrier frequencies: 19148Hz and 20156Hz.
 //
 // Coefficients below calculated using calcoeffs.py
 //
@@ -19,11 +18,31 @@
 #define HFSDP_SAMPLE_MULTPLIER        4
 #define HFSDP_SAMPLE_FREQ             (HFSDP_SIGNAL_FREQ*HFSDP_SAMPLE_MULTPLIER)
 #define HFSDP_SAMPLE_CYCLES           (8000000/HFSDP_SAMPLE_FREQ)
+#define HFSDP_WINDOW_LENGTH           128
 
-#define HFSDP_COSCOEFF1_ 0.2155701619
-#define HFSDP_SINCOEFF1_ 0.9764883539
-#define HFSDP_COSCOEFF2_ 0.1455192152
-#define HFSDP_SINCOEFF2_ 0.9893554255
+//
+// Symbol timing recovery. Each window is split into
+// HFSDP_TIMING_SUBBLOCKS sub-blocks, and a sliding Goetzel gives the power
+// of each carrier over the last window's worth of samples at every sub-block
+// boundary. Three gates per bit look at windows at the start (early), middle
+// (on time) and end (late) of the bit. The on-time gate decides the bit. When
+// the bit is followed or preceded by a different bit, one of the early and
+// late windows overlaps it if the decision point has drifted, and the
+// difference between the two moves the decision point by a sub-block once
+// HFSDP_TIMING_LOOP_GAIN bits have agreed on the direction.
+//
+#define HFSDP_TIMING_SUBBLOCKS        4
+#define HFSDP_TIMING_SUBBLOCK_LENGTH  (HFSDP_WINDOW_LENGTH/HFSDP_TIMING_SUBBLOCKS)
+#define HFSDP_TIMING_BIT_SUBBLOCKS    (HFSDP_SAMPLE_MULTPLIER*HFSDP_TIMING_SUBBLOCKS)
+#define HFSDP_TIMING_EARLY_GATE       (HFSDP_TIMING_SUBBLOCKS-1)
+#define HFSDP_TIMING_ONTIME_GATE      ((HFSDP_TIMING_BIT_SUBBLOCKS+HFSDP_TIMING_SUBBLOCKS)/2-1)
+#define HFSDP_TIMING_LATE_GATE        (HFSDP_TIMING_BIT_SUBBLOCKS-1)
+#define HFSDP_TIMING_LOOP_GAIN        2
+
+#define HFSDP_COSCOEFF1_ -0.2898349320
+#define HFSDP_SINCOEFF1_ 0.9570766491
+#define HFSDP_COSCOEFF2_ -0.3822263578
+#define HFSDP_SINCOEFF2_ 0.9240687266
 
 #define HFSDP_COSCOEFF1 GOETZEL_FLOAT_TO_FIX(HFSDP_COSCOEFF1_)
 #define HFSDP_SINCOEFF1 GOETZEL_FLOAT_TO_FIX(HFSDP_SINCOEFF1_)
@@ -34,27 +53,174 @@
 #define HFSDP_COSCOEFF4 GOETZEL_FLOAT_TO_FIX(HFSDP_COSCOEFF4_)
 #define HFSDP_SINCOEFF4 GOETZEL_FLOAT_TO_FIX(HFSDP_SINCOEFF4_)
 
+//
+// MFSK mode: after the usual binary start sequence, each symbol is one of 4
+// or 8 tones and carries 2 or 3 bits (Gray coded, so that confusing
+// neighbouring tones costs one bit). Symbols last
+// HFSDP_MFSK_WINDOWS_PER_SYMBOL windows, i.e. half a binary bit, so 8 tones
+// give six times the binary bit rate. 4-tone mode uses every other tone.
+//
+// Tones are on consecutive Goetzel bins from HFSDP_MFSK_FIRST_BIN (17137Hz
+// to 20665Hz), so that they're orthogonal over a window. Their coefficients
+// come from the calibration table below.
+//
+// The receiver doesn't know how much of the preamble is left once it has
+// started (and calibrated), so the data starts after a marker of
+// HFSDP_MFSK_MARKER_SYMBOLS symbols alternating between bins
+// HFSDP_MFSK_FIRST_BIN and HFSDP_MFSK_FIRST_BIN+2, which are tones in both
+// modes. The preamble's carriers are at bins 38 and 40, so what's left of it
+// can't be mistaken for the marker.
+//
+// Symbol timing is tracked as for binary bits (see above), with a sliding
+// Goetzel per tone and gates at HFSDP_MFSK_EARLY_GATE,
+// HFSDP_MFSK_ONTIME_GATE and HFSDP_MFSK_LATE_GATE sub-blocks into the symbol.
+// The on-time gate decides the symbol, and the power of the decided tone at
+// the early and late gates votes on the timing. Every window is analysed, so
+// a window costs as much as goetzel_bank() with 'ntones' bins, and the
+// sliding state takes about 100 bytes of stack per tone.
+//
+
+#define HFSDP_MFSK_WINDOWS_PER_SYMBOL 2
+#define HFSDP_MFSK_MAX_TONES          8
+#define HFSDP_MFSK_FIRST_BIN          34
+#define HFSDP_MFSK_MARKER_SYMBOLS     2
+#define HFSDP_MFSK_MARKER_BIN(i)      (HFSDP_MFSK_FIRST_BIN + ((i) % 2)*2)
+#define HFSDP_MFSK_SYMBOL_SUBBLOCKS   (HFSDP_MFSK_WINDOWS_PER_SYMBOL*HFSDP_TIMING_SUBBLOCKS)
+#define HFSDP_MFSK_EARLY_GATE         (HFSDP_TIMING_SUBBLOCKS-1)
+#define HFSDP_MFSK_ONTIME_GATE        ((HFSDP_MFSK_SYMBOL_SUBBLOCKS+HFSDP_TIMING_SUBBLOCKS)/2-1)
+#define HFSDP_MFSK_LATE_GATE          (HFSDP_MFSK_SYMBOL_SUBBLOCKS-1)
+
+//
+// Carrier calibration. The carriers are at bins 38 and 40 of a window, but
+// the HSI clock (and so the sample rate) can be off by a percent or so,
+// which moves them by up to 0.4 of a bin. After the start sequence,
+// hfsdp_calibrate() looks at HFSDP_CALIB_CANDIDATES frequencies around each
+// carrier, 1/HFSDP_CALIB_STEPS_PER_BIN of a bin apart, over
+// HFSDP_CALIB_WINDOWS windows of the preamble, and retunes to the
+// strongest. The coefficients come from a table in hfsdp.c indexed in steps
+// (i.e. frequency in bins times HFSDP_CALIB_STEPS_PER_BIN), which covers
+// the MFSK tones as well.
+//
+// Table calculated using 'calccoeffs.py table first=269 last=331 steps=8 window=128'.
+//
+
+#define HFSDP_CALIB_STEPS_PER_BIN     8
+#define HFSDP_CALIB_MAX_OFFSET        3
+#define HFSDP_CALIB_CANDIDATES        (2*HFSDP_CALIB_MAX_OFFSET+1)
+#define HFSDP_CALIB_WINDOWS           (2*HFSDP_SAMPLE_MULTPLIER)
+#define HFSDP_CALIB_F1                (38*HFSDP_CALIB_STEPS_PER_BIN)
+#define HFSDP_CALIB_F2                (40*HFSDP_CALIB_STEPS_PER_BIN)
+#define HFSDP_CALIB_TABLE_FIRST       (HFSDP_MFSK_FIRST_BIN*HFSDP_CALIB_STEPS_PER_BIN - HFSDP_CALIB_MAX_OFFSET)
+#define HFSDP_CALIB_TABLE_LAST        ((HFSDP_MFSK_FIRST_BIN+HFSDP_MFSK_MAX_TONES-1)*HFSDP_CALIB_STEPS_PER_BIN + HFSDP_CALIB_MAX_OFFSET)
+
+typedef struct {
+    goetzel_sliding_t tones[HFSDP_MFSK_MAX_TONES];
+    int32_t early[HFSDP_MFSK_MAX_TONES]; // Tone powers at the early gate.
+    int32_t ontime;      // Power of the decided tone at the on-time gate.
+    uint8_t ntones;
+    uint8_t bits_per_symbol;
+    uint8_t marker_seen; // Number of symbols of the marker seen so far.
+    int8_t best;         // Tone decided at the on-time gate, or -1.
+    int8_t phase;        // Index within the symbol of the next sub-block.
+    uint8_t gates_seen;
+    int8_t timing_error; // Sum of the early/late gate's votes.
+    int16_t timing_adjustments; // Net number of sub-blocks skipped (for debugging).
+} hfsdp_mfsk_state_t;
+
+//
+// Start detection. The transmission starts with a preamble of alternating
+// bits. The difference between the carrier powers in each window is
+// correlated with the pattern over the last HFSDP_SYNC_WINDOWS windows, at
+// each of its HFSDP_SYNC_PERIOD window offsets, and normalized by the carrier
+// power to give a confidence between 0 and HFSDP_SYNC_CONFIDENCE_ONE.
+// Noise gives a low confidence, whatever its level, and the threshold
+// follows the average and spread of the confidences seen without a signal.
+// The best offset (interpolated from its neighbours) gives the symbol phase.
+//
+#define HFSDP_SYNC_PERIOD             (2*HFSDP_SAMPLE_MULTPLIER)
+#define HFSDP_SYNC_WINDOWS            (3*HFSDP_SYNC_PERIOD)
+#define HFSDP_SYNC_CONFIDENCE_ONE     256
+#define HFSDP_SYNC_MIN_POWER          16
+#define HFSDP_SYNC_MIN_THRESHOLD      112
+#define HFSDP_SYNC_MAX_THRESHOLD      160
+#define HFSDP_SYNC_NOISE_SHIFT        3
+#define HFSDP_SYNC_HOLD               2
+
 typedef struct {
-    int32_t calib_count;
-    int32_t min_f1, max_f1;
-    int32_t min_f2, max_f2;
-    int32_t avg;
-    int32_t vs[8];
-    int32_t highest_f1_low;
-    int32_t highest_f2_low;
+    union {
+        struct {
+            int32_t diff[HFSDP_SYNC_WINDOWS];  // f1 power - f2 power
+            int32_t total[HFSDP_SYNC_WINDOWS]; // f1 power + f2 power
+        } sync;
+        struct {
+            int32_t power[2][HFSDP_CALIB_CANDIDATES];
+        } calib;
+    } u;
+    uint8_t sync_head;
+    uint8_t sync_count;
+    uint8_t sync_hold;
+    uint16_t noise_confidence; // Average confidence without a signal << HFSDP_SYNC_NOISE_SHIFT.
+    uint16_t noise_deviation;  // Average absolute deviation from it << HFSDP_SYNC_NOISE_SHIFT.
+    uint16_t sync_confidence;  // Confidence of the last window.
+    uint16_t sync_threshold;
+
+    uint8_t calib_count;
+    int8_t calib_offset; // Average offset of the carriers from nominal, in steps.
+
     int32_t f1_coscoeff, f1_sincoeff;
     int32_t f2_coscoeff, f2_sincoeff;
-    int f1_less_than_f2; // -1 when first initialized, -2 when we've syncd, otherwise 0 or 1
-    unsigned count;
+
+    // Timing recovery (used by hfsdp_read_bit).
+    goetzel_sliding_t f1_sliding, f2_sliding;
+    int32_t early, ontime; // f1 power - f2 power at the early and on-time gates.
+    int32_t ontime_total;  // f1 power + f2 power at the on-time gate.
+    int8_t phase;          // Index within the bit of the next sub-block (set by hfsdp_check_start).
+    int8_t timing_error;   // Sum of the early/late gate's votes.
+    uint8_t gates_seen;
+    bool timing_recovery;
+    int16_t timing_adjustments; // Net number of sub-blocks skipped (for debugging).
+
+    uint8_t bit_confidence; // Confidence in the last bit read (see hfsdp_read_bit).
 } hfsdp_read_bit_state_t;
 
+#define HFSDP_BIT_CONFIDENCE_MAX 255
+
 void init_hfsdp_read_bit_state(hfsdp_read_bit_state_t *s, int32_t f1_coscoeff, int32_t f1_sincoeff, int32_t f2_coscoeff, int32_t f2_sincoeff);
 bool hfsdp_check_start(hfsdp_read_bit_state_t *s, const int16_t *buf, unsigned buflen);
+bool hfsdp_calibrate(hfsdp_read_bit_state_t *s, const int16_t *buf, unsigned buflen);
 int hfsdp_read_bit(hfsdp_read_bit_state_t *s, const int16_t *buf, unsigned buflen);
 
+void init_hfsdp_mfsk_state(hfsdp_mfsk_state_t *s, const hfsdp_read_bit_state_t *started, unsigned ntones);
+int hfsdp_mfsk_read_symbol(hfsdp_mfsk_state_t *s, const int16_t *buf, unsigned buflen);
+
 #define HFSDP_READ_BIT_DECODE_ERROR  -2
 #define HFSDP_READ_BIT_NOTHING_READ  -1
 
+//
+// Binary reception from start to finish: start detection, calibration and
+// then bits, either returned one at a time (hfsdp_receive_bit) or packed
+// lowest first into each byte of 'buffer' (hfsdp_receive_window). Windows
+// can come from the mic (piezo.c) or from anywhere else, e.g. synthesised
+// audio on the host.
+//
+typedef struct {
+    hfsdp_read_bit_state_t s;
+    uint8_t *buffer;
+    uint8_t *confidences; // One per bit (see hfsdp_read_bit), or NULL.
+    unsigned bits;
+    unsigned nreceived;
+    bool started;
+    bool calibrated;
+} hfsdp_receiver_t;
+
+#define HFSDP_RECEIVE_MORE  0
+#define HFSDP_RECEIVE_DONE  1
+#define HFSDP_RECEIVE_ERROR 2
+
+void init_hfsdp_receiver(hfsdp_receiver_t *r, uint8_t *buffer, unsigned bytes, uint8_t *confidences);
+int hfsdp_receive_bit(hfsdp_receiver_t *r, const int16_t *buf);
+int hfsdp_receive_window(hfsdp_receiver_t *r, const int16_t *buf);
+
 extern int32_t hfsdp_read_bit_debug_last_f1;
 extern int32_t hfsdp_read_bit_debug_last_f2;
 
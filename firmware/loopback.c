@@ -0,0 +1,475 @@
+//
+// Host loopback harness for HFSDP. Encodes random payloads with
+// hamming_encode_message() (or hamming_encode_frame()), modulates them into
+// PCM as the phone would, and passes the audio through a simulated channel
+// (resampling to the ADC rate with a clock offset, then adding noise and
+// optionally a dropout). The firmware's receive path (micfilter,
+// hfsdp_receive_bit and the streaming Hamming or frame decoder, as used by
+// piezo_read_message and piezo_read_frame) runs on the result, and the bit
+// and frame error rates and the CPU time it took are reported.
+//
+// Usage: testloopback [fs=48000] [snr=20] [clock=0] [frames=50] [bytes=24]
+//                     [framing=0] [burst=0] [seed=1]
+//
+// 'snr' is in dB, of the carrier against white noise over the whole band
+// at the ADC. 'clock' is the error in the meter's clock, e.g. 0.005 for
+// 0.5% slow (see test_binary in hfsdp.c). 'burst' is the length in ms of a
+// dropout (the signal is lost but the noise isn't) somewhere in the data.
+// With 'framing=1', frames only count as received if they pass their CRC.
+//
+// With no arguments, runs a sweep over a few conditions and fails if any
+// frame is lost at an SNR of 0dB or more with no clock error, or at 20dB
+// with a clock error of 0.5% or less, or if any framed transfer is lost to
+// a dropout shorter than the interleaving can absorb.
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <hfsdp.h>
+#include <hamming.h>
+#include <micfilter.h>
+
+// PIEZO_MIC_SAMPLE_FREQ (piezo.h can't be included on the host).
+#define LOOPBACK_ADC_FREQ        (8000000.0/124)
+#define LOOPBACK_ADC_MAX         4095
+#define LOOPBACK_AMPLITUDE       400.0
+#define LOOPBACK_PREAMBLE_BITS   24
+#define LOOPBACK_INIT_SEQUENCES  2
+#define LOOPBACK_TAIL_BITS       (LOOPBACK_PREAMBLE_BITS+8)
+#define LOOPBACK_MAX_LEAD_IN     48 // Windows of noise before the signal.
+#define LOOPBACK_INTERP_TAPS     64 // Each side of the interpolation filter.
+#define LOOPBACK_INTERP_PHASES   256
+
+typedef struct {
+    double fs;
+    double snr;
+    double clock_error;
+    unsigned frames;
+    unsigned bytes;
+    bool framing;
+    double burst;             // ms
+    unsigned seed;
+} loopback_params_t;
+
+typedef struct {
+    unsigned frames;
+    unsigned synced;
+    unsigned frame_errors, frame_errors_hard;
+    unsigned long bits, raw_bit_errors;
+    unsigned long payload_bits, bit_errors, bit_errors_hard;
+    double audio_seconds;
+    double cpu_seconds;
+} loopback_stats_t;
+
+static double gaussian()
+{
+    double u1 = (rand() + 1.0) / (RAND_MAX + 2.0), u2 = rand() / (RAND_MAX + 1.0);
+    return sqrt(-2*log(u1)) * cos(2*M_PI*u2);
+}
+
+static unsigned get_bit(const uint8_t *buf, unsigned i)
+{
+    return (buf[i/8] >> (i % 8)) & 1;
+}
+
+static unsigned encoded_length(const loopback_params_t *p)
+{
+    if (p->framing)
+        return hamming_get_encoded_frame_byte_length(p->bytes, LOOPBACK_INIT_SEQUENCES);
+    return (LOOPBACK_INIT_SEQUENCES + (p->bytes + 2)/3) * 4;
+}
+
+//
+// Transmitter.
+//
+
+// Carrier frequencies, as the phone sends them: bins 38 and 40 of a window
+// at the nominal ADC rate.
+static double carrier_freq(unsigned bit)
+{
+    unsigned step = bit ? HFSDP_CALIB_F2 : HFSDP_CALIB_F1;
+    return step * LOOPBACK_ADC_FREQ / (HFSDP_WINDOW_LENGTH * HFSDP_CALIB_STEPS_PER_BIN);
+}
+
+// Modulates the preamble, 'nbytes' bytes of 'data' (lowest bit of each byte
+// first) and a tail into continuous-phase FSK at 'fs' with amplitude 1.
+// Returns the number of samples written to '*out' (which must be freed).
+static unsigned transmit(const uint8_t *data, unsigned nbytes, double fs, float **out)
+{
+    unsigned nbits = LOOPBACK_PREAMBLE_BITS + nbytes*8 + LOOPBACK_TAIL_BITS;
+    double bit_samples = fs / HFSDP_SIGNAL_FREQ;
+    unsigned nsamples = (unsigned)ceil(nbits * bit_samples);
+    float *samples = malloc(sizeof(float) * nsamples);
+
+    double phase = 0;
+    unsigned i;
+    for (i = 0; i < nsamples; ++i) {
+        unsigned bi = (unsigned)(i / bit_samples);
+        unsigned bit = 0;
+        if (bi < LOOPBACK_PREAMBLE_BITS)
+            bit = bi % 2;
+        else if (bi < LOOPBACK_PREAMBLE_BITS + nbytes*8)
+            bit = get_bit(data, bi - LOOPBACK_PREAMBLE_BITS);
+        phase += 2*M_PI*carrier_freq(bit)/fs;
+        if (phase > 2*M_PI)
+            phase -= 2*M_PI;
+        samples[i] = (float)sin(phase);
+    }
+
+    *out = samples;
+    return nsamples;
+}
+
+//
+// Channel. The audio is resampled to the ADC's actual rate with a windowed
+// sinc (i.e. as if the phone's DAC and the mic were ideal), delayed by
+// 'lead_in' samples, scaled to ADC units around the mic's resting level and
+// given Gaussian noise. The signal is dropped between transmitted samples
+// 'burst_start' and 'burst_end'. Returns the number of samples (a whole
+// number of windows) written to '*out'.
+//
+
+// Blackman-windowed sinc, tabulated at LOOPBACK_INTERP_PHASES fractional
+// positions.
+static float interp_table[LOOPBACK_INTERP_PHASES][2*LOOPBACK_INTERP_TAPS];
+
+static void init_interp_table()
+{
+    unsigned ph;
+    int k;
+    for (ph = 0; ph < LOOPBACK_INTERP_PHASES; ++ph) {
+        for (k = 0; k < 2*LOOPBACK_INTERP_TAPS; ++k) {
+            double d = (double)ph / LOOPBACK_INTERP_PHASES + LOOPBACK_INTERP_TAPS - 1 - k;
+            double sinc = (d == 0 ? 1 : sin(M_PI*d) / (M_PI*d));
+            double w = 0.42 + 0.5*cos(M_PI*d/LOOPBACK_INTERP_TAPS) + 0.08*cos(2*M_PI*d/LOOPBACK_INTERP_TAPS);
+            interp_table[ph][k] = (float)(sinc * w);
+        }
+    }
+}
+
+static double interpolate(const float *x, unsigned n, double t)
+{
+    int c = (int)floor(t);
+    const float *taps = interp_table[(unsigned)((t - c) * LOOPBACK_INTERP_PHASES)];
+    int first = c - LOOPBACK_INTERP_TAPS + 1;
+    double v = 0;
+    int k;
+    for (k = 0; k < 2*LOOPBACK_INTERP_TAPS; ++k) {
+        int i = first + k;
+        if (i >= 0 && i < (int)n)
+            v += x[i] * taps[k];
+    }
+    return v;
+}
+
+static unsigned channel(const float *tx, unsigned ntx, const loopback_params_t *p, unsigned lead_in,
+                        double burst_start, double burst_end, int16_t **out)
+{
+    double adc_freq = LOOPBACK_ADC_FREQ / (1 + p->clock_error);
+    unsigned nsamples = lead_in + (unsigned)ceil(ntx * adc_freq / p->fs);
+    nsamples += HFSDP_WINDOW_LENGTH - (nsamples % HFSDP_WINDOW_LENGTH);
+    int16_t *samples = malloc(sizeof(int16_t) * nsamples);
+
+    double sigma = LOOPBACK_AMPLITUDE * sqrt(0.5 / pow(10, p->snr / 10));
+    unsigned i;
+    for (i = 0; i < nsamples; ++i) {
+        double v = MICFILTER_INITIAL_DC + sigma*gaussian();
+        double t = (i - lead_in) * p->fs / adc_freq;
+        if (i >= lead_in && (t < burst_start || t >= burst_end))
+            v += LOOPBACK_AMPLITUDE * interpolate(tx, ntx, t);
+        long s = lround(v);
+        samples[i] = (int16_t)(s < 0 ? 0 : (s > LOOPBACK_ADC_MAX ? LOOPBACK_ADC_MAX : s));
+    }
+
+    *out = samples;
+    return nsamples;
+}
+
+//
+// Receiver. sim_mic_get_block() stands in for piezo_mic_get_block().
+//
+
+typedef struct {
+    const int16_t *samples;
+    unsigned nsamples;
+    unsigned pos;
+    micfilter_t filter;
+    int16_t block[HFSDP_WINDOW_LENGTH];
+} sim_mic_t;
+
+static const int16_t *sim_mic_get_block(sim_mic_t *m)
+{
+    if (m->pos + HFSDP_WINDOW_LENGTH > m->nsamples)
+        return NULL;
+    memcpy(m->block, m->samples + m->pos, sizeof(m->block));
+    m->pos += HFSDP_WINDOW_LENGTH;
+    micfilter_process(&m->filter, m->block, HFSDP_WINDOW_LENGTH);
+    return m->block;
+}
+
+static double cpu_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned count_bit_errors(const uint8_t *a, const uint8_t *b, unsigned bytes)
+{
+    unsigned errors = 0, i;
+    for (i = 0; i < bytes; ++i) {
+        unsigned d = a[i] ^ b[i];
+        for (; d; d &= d - 1)
+            ++errors;
+    }
+    return errors;
+}
+
+static void run_frame(const loopback_params_t *p, loopback_stats_t *st)
+{
+    unsigned i;
+    uint8_t *payload = malloc(p->bytes);
+    for (i = 0; i < p->bytes; ++i)
+        payload[i] = rand() & 0xFF;
+
+    unsigned elen = encoded_length(p);
+    uint8_t *encoded = malloc(elen);
+    if (p->framing)
+        hamming_encode_frame(payload, p->bytes, encoded, LOOPBACK_INIT_SEQUENCES);
+    else
+        hamming_encode_message(payload, p->bytes, encoded, LOOPBACK_INIT_SEQUENCES);
+
+    float *tx;
+    unsigned ntx = transmit(encoded, elen, p->fs, &tx);
+    int16_t *adc;
+    unsigned lead_in = HFSDP_SYNC_WINDOWS*HFSDP_WINDOW_LENGTH + rand() % (LOOPBACK_MAX_LEAD_IN*HFSDP_WINDOW_LENGTH);
+
+    // The dropout falls somewhere after what would be the frame header
+    // (whether or not there is one), so both encodings lose the same data.
+    double burst_start = 0, burst_end = 0;
+    if (p->burst > 0) {
+        double bit_samples = p->fs / HFSDP_SIGNAL_FREQ;
+        double first = (LOOPBACK_PREAMBLE_BITS + (LOOPBACK_INIT_SEQUENCES+1)*32) * bit_samples;
+        double last = (LOOPBACK_PREAMBLE_BITS + encoded_length(p)*8) * bit_samples - p->burst*p->fs/1000;
+        burst_start = first + (last > first ? (last - first) * rand() / RAND_MAX : 0);
+        burst_end = burst_start + p->burst*p->fs/1000;
+    }
+    unsigned nadc = channel(tx, ntx, p, lead_in, burst_start, burst_end, &adc);
+
+    // The raw bits are kept only to measure the channel's bit error rate.
+    // Room for the end of the preamble before the init sequences.
+    unsigned rlen = elen + LOOPBACK_PREAMBLE_BITS/8 + 1, nraw = 0;
+    uint8_t *raw = calloc(rlen, 1);
+    uint8_t *soft = malloc(p->bytes), *hard = malloc(p->bytes);
+    unsigned nsoft = 0, nhard = 0;
+
+    sim_mic_t mic;
+    mic.samples = adc;
+    mic.nsamples = nadc;
+    mic.pos = 0;
+
+    double start = cpu_time();
+
+    // As piezo_read_message() or piezo_read_frame(), with a hard decoder
+    // alongside.
+    micfilter_init(&mic.filter, true);
+    hfsdp_receiver_t r;
+    init_hfsdp_receiver(&r, NULL, 0, NULL);
+    hamming_stream_t ss, hs;
+    hamming_stream_init(&ss, true, 'X');
+    hamming_stream_init(&hs, false, 'X');
+    hamming_frame_t sf, hf;
+    hamming_frame_init(&sf, true, soft, p->bytes);
+    hamming_frame_init(&hf, false, hard, p->bytes);
+    int sret = HAMMING_FRAME_MORE, hret = HAMMING_FRAME_MORE;
+    const int16_t *block;
+    while ((p->framing ? sret == HAMMING_FRAME_MORE || hret == HAMMING_FRAME_MORE : nsoft < p->bytes || nhard < p->bytes) &&
+           nraw < rlen*8 && (block = sim_mic_get_block(&mic))) {
+        int b = hfsdp_receive_bit(&r, block);
+        if (b == HFSDP_READ_BIT_DECODE_ERROR)
+            break;
+        if (b == HFSDP_READ_BIT_NOTHING_READ)
+            continue;
+
+        raw[nraw/8] |= b << (nraw % 8);
+        ++nraw;
+
+        if (p->framing) {
+            sret = hamming_frame_push_bit(&sf, b, r.s.bit_confidence);
+            hret = hamming_frame_push_bit(&hf, b, 0);
+            continue;
+        }
+
+        uint8_t out[3];
+        unsigned nout = hamming_stream_push_bit(&ss, b, r.s.bit_confidence, out);
+        for (i = 0; i < nout && nsoft < p->bytes; ++i)
+            soft[nsoft++] = out[i];
+        nout = hamming_stream_push_bit(&hs, b, 0, out);
+        for (i = 0; i < nout && nhard < p->bytes; ++i)
+            hard[nhard++] = out[i];
+    }
+
+    st->cpu_seconds += cpu_time() - start;
+    st->audio_seconds += nadc / LOOPBACK_ADC_FREQ;
+    ++(st->frames);
+
+    // Channel bit errors over the encoded payload.
+    hamming_scan_for_init_sequence_result_t sr = hamming_scan_for_init_sequence(raw, rlen);
+    if (sr.bit_index != -1) {
+        unsigned start_bit = sr.bit_index + (sr.count*32);
+        unsigned ebits = (elen - LOOPBACK_INIT_SEQUENCES*4) * 8;
+        for (i = 0; i < ebits; ++i) {
+            unsigned b = start_bit + i;
+            if (b >= nraw || get_bit(raw, b) != get_bit(encoded, LOOPBACK_INIT_SEQUENCES*32 + i))
+                ++(st->raw_bit_errors);
+        }
+        st->bits += ebits;
+    }
+
+    if (p->framing) {
+        // Only frames that pass their CRC get through, so there are no bit
+        // errors to count, just lost frames.
+        if (sf.stream.state != HAMMING_STREAM_SEARCHING)
+            ++(st->synced);
+        st->frame_errors += (sret != HAMMING_FRAME_DONE || memcmp(soft, payload, p->bytes) != 0);
+        st->frame_errors_hard += (hret != HAMMING_FRAME_DONE || memcmp(hard, payload, p->bytes) != 0);
+    }
+    else if (nsoft < p->bytes) {
+        ++(st->frame_errors);
+        ++(st->frame_errors_hard);
+    }
+    else {
+        ++(st->synced);
+        unsigned e = count_bit_errors(soft, payload, p->bytes);
+        unsigned eh = count_bit_errors(hard, payload, p->bytes);
+        st->payload_bits += p->bytes*8;
+        st->bit_errors += e;
+        st->bit_errors_hard += eh;
+        st->frame_errors += (e != 0);
+        st->frame_errors_hard += (eh != 0);
+    }
+
+    free(payload);
+    free(encoded);
+    free(tx);
+    free(adc);
+    free(raw);
+    free(soft);
+    free(hard);
+}
+
+static loopback_stats_t run(const loopback_params_t *p)
+{
+    loopback_stats_t st;
+    memset(&st, 0, sizeof(st));
+
+    srand(p->seed);
+    unsigned i;
+    for (i = 0; i < p->frames; ++i)
+        run_frame(p, &st);
+
+    printf("fs %5.0fHz, SNR %5.1fdB, clock %+.2f%%, burst %3.0fms%s: %u/%u frames synced, raw BER %.4f, "
+           "BER %.5f (hard %.5f), FER %.3f (hard %.3f), %.2fms CPU per second of audio\n",
+           p->fs, p->snr, p->clock_error*100, p->burst, p->framing ? " framed" : "", st.synced, st.frames,
+           st.bits ? (double)st.raw_bit_errors / st.bits : 0.0,
+           st.payload_bits ? (double)st.bit_errors / st.payload_bits : 0.0,
+           st.payload_bits ? (double)st.bit_errors_hard / st.payload_bits : 0.0,
+           (double)st.frame_errors / st.frames, (double)st.frame_errors_hard / st.frames,
+           st.cpu_seconds * 1000 / st.audio_seconds);
+
+    return st;
+}
+
+int main(int argc, char **argv)
+{
+    loopback_params_t p;
+    p.fs = 48000;
+    p.snr = 20;
+    p.clock_error = 0;
+    p.frames = 50;
+    p.bytes = 24;
+    p.framing = false;
+    p.burst = 0;
+    p.seed = 1;
+
+    init_interp_table();
+
+    if (argc == 1) {
+        static const double snrs[] = { 20, 0, -6, -9 };
+        static const double clock_errors[] = { 0, 0.005, -0.005, 0.01, -0.01 };
+        int ret = 0;
+        unsigned i, j;
+        p.frames = 25;
+        for (i = 0; i < sizeof(clock_errors)/sizeof(clock_errors[0]); ++i) {
+            for (j = 0; j < sizeof(snrs)/sizeof(snrs[0]); ++j) {
+                p.snr = snrs[j];
+                p.clock_error = clock_errors[i];
+                loopback_stats_t st = run(&p);
+                if ((p.clock_error == 0 ? p.snr >= 0 : p.snr >= 20 && fabs(p.clock_error) <= 0.005) && st.frame_errors != 0)
+                    ret = 1;
+            }
+        }
+        p.fs = 44100;
+        p.snr = 0;
+        p.clock_error = 0;
+        loopback_stats_t st = run(&p);
+        if (st.frame_errors != 0)
+            ret = 1;
+
+        // Dropouts, with and without framing. 48 bytes is 17 codewords,
+        // interleaved in blocks of 9 and 8, so the frame survives a dropout
+        // of 8 bits (63ms) or so. Give it 50ms.
+        p.fs = 48000;
+        p.snr = 20;
+        p.bytes = 48;
+        p.burst = 50;
+        for (i = 0; i < 2; ++i) {
+            p.framing = i;
+            st = run(&p);
+            if (p.framing && st.frame_errors != 0)
+                ret = 1;
+        }
+
+        printf(ret ? "FAIL\n" : "OK\n");
+        return ret;
+    }
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        char *eq = strchr(argv[i], '=');
+        if (! eq) {
+            fprintf(stderr, "Bad argument '%s'\n", argv[i]);
+            return 1;
+        }
+        *eq = '\0';
+        double v = atof(eq + 1);
+        if (! strcmp(argv[i], "fs"))
+            p.fs = v;
+        else if (! strcmp(argv[i], "snr"))
+            p.snr = v;
+        else if (! strcmp(argv[i], "clock"))
+            p.clock_error = v;
+        else if (! strcmp(argv[i], "frames"))
+            p.frames = (unsigned)v;
+        else if (! strcmp(argv[i], "bytes"))
+            p.bytes = (unsigned)v;
+        else if (! strcmp(argv[i], "framing"))
+            p.framing = (v != 0);
+        else if (! strcmp(argv[i], "burst"))
+            p.burst = v;
+        else if (! strcmp(argv[i], "seed"))
+            p.seed = (unsigned)v;
+        else {
+            fprintf(stderr, "Unknown parameter '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+
+    run(&p);
+    return 0;
+}
@@ -0,0 +1,153 @@
+import sys
+import os
+import re
+
+if sys.version < '3':
+    sys.stderr.write("Run this script using Python 3\n")
+    sys.exit(1)
+
+#
+# Static Cortex-M0 cycle estimates for the loops in the given functions,
+# from the output of 'arm-none-eabi-objdump -d' (llvm-objdump works too) on
+# standard input. See the 'dspcycles' target in the Makefile.
+#
+#     python3 m0cycles.py [window=N] [budget=N] function...
+#
+# A loop is the code between a backward branch and its target. Each loop's
+# cycles are for the straight-line path through it, with the backward
+# branch taken and any other conditional branches not taken, using the
+# timings in the Cortex-M0 TRM (the STM32F030 has the single cycle
+# multiplier and no flash wait states at 8MHz). Loops that load samples
+# (LDRSH) also get a cost per sample, and per window of 'window' samples
+# against the 'budget' in cycles. These default to HFSDP_WINDOW_LENGTH and
+# HFSDP_SAMPLE_CYCLES, read from hfsdp.h.
+#
+
+CONDITIONS = ('eq', 'ne', 'cs', 'hs', 'cc', 'lo', 'mi', 'pl', 'vs', 'vc', 'hi', 'ls', 'ge', 'lt', 'gt', 'le')
+LOADS_STORES = ('ldr', 'ldrb', 'ldrh', 'ldrsb', 'ldrsh', 'str', 'strb', 'strh')
+MULTIPLE = ('push', 'pop', 'ldm', 'ldmia', 'stm', 'stmia')
+
+LINE = re.compile(r"^\s*([0-9a-f]+):\s*([0-9a-f ]+?)\s*\t([a-z][a-z0-9.]*)\s*(.*)$")
+FUNCTION = re.compile(r"^[0-9a-f]+ <([^>]+)>:$")
+DEFINE = re.compile(r"^#define\s+([A-Z0-9_]+)\s+(.*?)\s*(//.*)?$")
+NAME = re.compile(r"[A-Z_][A-Z0-9_]*")
+
+def is_conditional_branch(m):
+    return len(m) == 3 and m[0] == 'b' and m[1:] in CONDITIONS
+
+def is_branch(m):
+    return m == 'b' or is_conditional_branch(m)
+
+def register_count(operands):
+    regs = operands[operands.find('{')+1:operands.find('}')]
+    n = 0
+    for r in regs.split(','):
+        r = r.strip()
+        if '-' in r:
+            lo, hi = r.split('-')
+            n += int(hi[1:]) - int(lo[1:]) + 1
+        elif r:
+            n += 1
+    return n
+
+# The value of the integer constant 'name' #defined in the given header, in
+# terms of other constants defined there.
+def header_constant(path, name):
+    defines = { }
+    with open(path) as f:
+        for l in f:
+            m = DEFINE.match(l)
+            if m:
+                defines[m.group(1)] = m.group(2)
+    def value(name):
+        expr = NAME.sub(lambda m: '(%i)' % value(m.group(0)), defines[name])
+        return int(eval(expr.replace('/', '//'), { '__builtins__': { } }))
+    return value(name)
+
+def cycles(m, operands, taken):
+    if m in LOADS_STORES:
+        return 2
+    if m in MULTIPLE:
+        n = register_count(operands)
+        return 1 + n + (3 if m == 'pop' and 'pc' in operands else 0)
+    if m == 'bl':
+        return 4
+    if m in ('bx', 'blx'):
+        return 3
+    if m == 'b':
+        return 3
+    if is_conditional_branch(m):
+        return 3 if taken else 1
+    if m in ('add', 'mov') and operands.startswith('pc'):
+        return 3
+    return 1
+
+def branch_target(operands):
+    t = operands.split()[0]
+    return int(t, 16)
+
+# Returns { function name: [ (address, mnemonic, operands) ] }.
+def parse(lines):
+    functions = { }
+    current = None
+    for l in lines:
+        l = l.rstrip('\n')
+        m = FUNCTION.match(l)
+        if m:
+            current = functions.setdefault(m.group(1), [ ])
+            continue
+        m = LINE.match(l)
+        if m and current is not None:
+            mnemonic = m.group(3).split('.')[0]
+            operands = m.group(4).split(';')[0].split('@')[0].strip()
+            current.append((int(m.group(1), 16), mnemonic, operands))
+    return functions
+
+# Returns [ (start index, end index) ] of each loop, innermost first.
+def find_loops(insns):
+    loops = [ ]
+    for i, (addr, m, ops) in enumerate(insns):
+        if is_branch(m):
+            target = branch_target(ops)
+            if target <= addr:
+                start = next(j for j, ins in enumerate(insns) if ins[0] >= target)
+                loops.append((start, i))
+    loops.sort(key=lambda l: l[1] - l[0])
+    return loops
+
+def report(name, insns, window, budget):
+    print("%s: %i instructions" % (name, len(insns)))
+    loops = find_loops(insns)
+    if not loops:
+        print("    no loops")
+    for start, end in loops:
+        body = insns[start:end+1]
+        c = sum(cycles(m, ops, i == len(body)-1) for i, (addr, m, ops) in enumerate(body))
+        nested = any(s >= start and e <= end and (s, e) != (start, end) for s, e in loops)
+        samples = sum(1 for addr, m, ops in body if m == 'ldrsh')
+        s = "    loop %x-%x%s: %i instructions, %i cycles" % \
+            (body[0][0], body[-1][0], " (outer)" if nested else "", len(body), c)
+        if samples and not nested:
+            per_sample = c / samples
+            s += ", %i samples, %.1f cycles/sample, %i cycles/window (%.1f%% of %i)" % \
+                 (samples, per_sample, per_sample*window, 100.0*per_sample*window/budget, budget)
+        print(s)
+
+if __name__ == '__main__':
+    hfsdp_h = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'hfsdp.h')
+    args = { 'window': header_constant(hfsdp_h, 'HFSDP_WINDOW_LENGTH'),
+             'budget': header_constant(hfsdp_h, 'HFSDP_SAMPLE_CYCLES') }
+    names = [ ]
+    for arg in sys.argv[1:]:
+        if '=' in arg:
+            name, val = arg.split('=')
+            args[name] = int(val)
+        else:
+            names.append(arg)
+
+    functions = parse(sys.stdin)
+    for name in names:
+        if name not in functions:
+            sys.stderr.write("No function '%s' in the disassembly\n" % name)
+            sys.exit(1)
+        report(name, functions[name], args['window'], args['budget'])
@@ -21,6 +21,8 @@
 #include <tables.h>
 #include <hfsdp.h>
 #include <hamming.h>
+#include <config.h>
+#include <update.h>
 
 void HardFault_Handler()
 {
@@ -32,15 +34,18 @@ static __attribute__ ((unused)) void test_mic()
     piezo_mic_init();
     unsigned i;
 
+    // Let the mic settle.
+    piezo_mic_start_capture(false);
     for (i = 0; i < 10; ++i)
-       piezo_mic_read_buffer();
+       piezo_mic_get_block();
+    piezo_mic_stop_capture();
 
     for (i = 0;; ++i) {
         // int32_t now = SysTick->VAL;
-        // piezo_mic_read_buffer();
+        // const int16_t *block = piezo_mic_get_block();
         // goetzel_result_t r1, r2;
         // int32_t pow1, pow2, tpow;
-        // goetzel2((const int16_t *)piezo_mic_buffer, PIEZO_MIC_BUFFER_N_SAMPLES, 0,
+        // goetzel2(block, PIEZO_MIC_BUFFER_N_SAMPLES, 0,
         //          HFSDP_COSCOEFF1, HFSDP_SINCOEFF1, HFSDP_COSCOEFF2, HFSDP_SINCOEFF2,
         //          &r1, &r2);
         // pow1 = goetzel_get_freq_power(&r1);
@@ -58,17 +63,16 @@ static __attribute__ ((unused)) void test_mic()
         // debugging_writec("]\n");
         // continue;
 
-        // piezo_mic_read_buffer();
+        // const int16_t *block = piezo_mic_get_block();
         // unsigned j;
         // for (j = 0; j < PIEZO_MIC_BUFFER_N_SAMPLES; ++j) {
-        //     debugging_write_int32(piezo_mic_buffer[j]);
+        //     debugging_write_int32(block[j]);
         //     debugging_writec("\n");
         // }
         // debugging_writec("****\n");
         // continue;
         //
-        // piezo_mic_read_buffer();
-        // debugging_write_int32(piezo_get_magnitude());
+        // debugging_write_int32(piezo_get_magnitude(piezo_mic_get_block()));
         // debugging_writec("\n");
         // continue;
 
@@ -76,58 +80,24 @@ static __attribute__ ((unused)) void test_mic()
         //continue;
 
         debugging_writec("Waiting...\n");
-        uint8_t buf[40];
-        memset8_zero(buf, sizeof(buf));
-        bool decoded_successfully = piezo_read_data(buf, sizeof(buf)/sizeof(buf[0]));
-
-        debugging_writec("DATA READ\n");
-
-        if (! decoded_successfully) {
+        // Decoded as it arrives, so there's no need for a buffer of raw bits.
+        uint8_t msg[24];
+        unsigned length;
+        if (piezo_read_frame(msg, sizeof(msg), &length) != PIEZO_FRAME_DONE) {
             debugging_writec("DECODE FAIL ");
             debugging_write_uint32(i);
             debugging_writec("\n");
             continue;
         }
 
-        hamming_scan_for_init_sequence_result_t sr;
-        sr = hamming_scan_for_init_sequence(buf, sizeof(buf));
-        debugging_writec("RES: ");
-        debugging_write_int32(sr.bit_index);
-        debugging_writec(", ");
-        debugging_write_uint32(sr.count);
-        debugging_writec("\n");
-
-        unsigned byte_index = 0;
-        if (sr.bit_index != -1) {
-            byte_index = (sr.bit_index / 8) + (sr.count*4);
-            if (sr.bit_index % 8 != 0) {
-                unsigned rbit_index = (8 - (sr.bit_index % 8));
-                hamming_bitshift_buffer_forward(buf+byte_index, sizeof(buf)-1-byte_index, rbit_index);
-                ++byte_index;
-            }
-            unsigned j;
-            debugging_writec("BYTE I: ");
-            debugging_write_uint32(byte_index);
-            debugging_writec("\nMSG: {");
-            unsigned len = hamming_decode_message(buf, sizeof(buf)/sizeof(buf[0]), 'X');
-            for (j = 0; j < len; ++j) {
-                debugging_write((char *)buf + j, 1);
-            }
-            debugging_writec("}\n");
-        }
-
-        debugging_writec("B: [");
-        unsigned i;
-        // bit by bit
-        /*for (i = 0; i < (sizeof(buf)/sizeof(buf[0]))*8; ++i) {
-            if (i != 0)
-                debugging_writec(", ");
-            debugging_write_uint32((buf[i / 8] >> (i % 8)) & 1);
-        }*/
-        for (i = byte_index; i < sizeof(buf)/sizeof(buf[0]); ++i) {
-            if (i != 0)
+        debugging_writec("MSG: {");
+        debugging_write((char *)msg, length);
+        debugging_writec("}\nB: [");
+        unsigned j;
+        for (j = 0; j < length; ++j) {
+            if (j != 0)
                 debugging_writec(", ");
-            debugging_write_uint32(buf[i]);
+            debugging_write_uint32(msg[j]);
         }
         debugging_writec("]\n*****\n\n");
     }
@@ -151,6 +121,66 @@ static __attribute__ ((unused)) void test_speaker()
     debugging_writec("Piezo init complete\n");
 }
 
+static __attribute__ ((unused)) void test_transmit()
+{
+    static const uint8_t msg[] = "Hello from the meter!";
+
+    piezo_out_init();
+    for (;;) {
+        piezo_write_message(msg, sizeof(msg) - 1);
+        debugging_writec("Sent\n");
+        unsigned i;
+        for (i = 0; i < 2000000; ++i);
+    }
+}
+
+static void show_message(ui_message_t message)
+{
+    global_meter_state.ui_mode = UI_MODE_MESSAGE;
+    global_meter_state.ui_mode_state.message.message = message;
+    ui_show_interface(0);
+}
+
+// The bracket for the last reading, shown in UI_MODE_BRACKET. It's planned
+// again whenever the bracket settings change, so the view is never stale.
+static void plan_bracket()
+{
+    meter_state_t *gms = &global_meter_state;
+    transient_meter_state_t *tms = &global_transient_meter_state;
+    ev_with_fracs_t isoev;
+    ev_with_fracs_init_from_thirds(isoev, gms->iso);
+    bracket_plan(&(tms->bracket), tms->aperture, isoev, tms->last_ev_with_fracs,
+                 gms->bracket_step, gms->bracket_count, gms->precision_mode);
+}
+
+// Listens for settings from the phone (see config.h), showing what happened
+// until the next button press.
+static void receive_config()
+{
+    show_message(UI_MESSAGE_SETTINGS_LISTENING);
+    // The mic is only set up while something is listening.
+    piezo_mic_init();
+    bool received = config_receive();
+    piezo_mic_deinit();
+    if (received) {
+        debugging_writec("ISO thirds: ");
+        debugging_write_uint32(global_meter_state.iso);
+        debugging_writec(", precision: ");
+        debugging_write_uint32(global_meter_state.precision_mode);
+        debugging_writec(", calibration 120ths: ");
+        debugging_write_int32(global_meter_state.calibration_offset);
+        debugging_writec(", ND 120ths: ");
+        debugging_write_uint32(global_meter_state.nd);
+        debugging_writec("\n");
+        if (global_transient_meter_state.exposure_ready)
+            plan_bracket();
+        show_message(UI_MESSAGE_SETTINGS_RECEIVED);
+    }
+    else {
+        show_message(UI_MESSAGE_SETTINGS_NOTHING_RECEIVED);
+    }
+}
+
 static __attribute__ ((unused)) void test_display()
 {/*
     display_init();
@@ -161,7 +191,8 @@ static __attribute__ ((unused)) void test_display()
     gms.bcd_iso_digits[0] = 1;
     gms.bcd_iso_digits[1] = 0;
     gms.bcd_iso_digits[2] = 0;
-    gms.bcd_iso_length = 3;
+    gms.bcd_iso_digits[3] = 0;
+    gms.bcd_iso_length = 4;
     ev_with_fracs_set_ev8(gms.stops_iso, 8*3);
     gms.priority = SHUTTER_PRIORITY;
     gms.exp_comp = 0;
@@ -373,6 +404,13 @@ static __attribute__ ((unused)) void test_menu_scroll()
     }
 }
 
+// A reading with the calibration offset and ND filter (set by
+// config_receive()) taken into account.
+static ev_with_fracs_t take_reading()
+{
+    return meter_take_integrated_reading() + global_meter_state.calibration_offset - global_meter_state.nd;
+}
+
 typedef enum after_release {
     AFTER_RELEASE_NOWAIT,
     AFTER_RELEASE_NOTHING,
@@ -439,9 +477,15 @@ int main()
                 buttons_clear_mask();
                 gms->ui_mode = UI_MODE_INIT;
             }
+            else if (gms->ui_mode == UI_MODE_MULTISPOT) {
+                // Add a spot to the multi-spot session.
+                multispot_add(&(tms->multispot), take_reading());
+                tms->multispot_changed = true;
+                wait_for_release = AFTER_RELEASE_NOTHING;
+            }
             else if (gms->ui_mode == UI_MODE_INIT) {
                 // If we're on the main screen, do a reading.
-                tms->last_ev_with_fracs = meter_take_integrated_reading();
+                tms->last_ev_with_fracs = take_reading();
 
                 debugging_writec("EV10: ");
                 debugging_write_uint32(ev_with_fracs_get_wholes(tms->last_ev_with_fracs)*10 + ev_with_fracs_get_nearest_tenths(tms->last_ev_with_fracs));
@@ -451,6 +495,7 @@ int main()
                 ev_with_fracs_t isoev;
                 ev_with_fracs_init_from_thirds(isoev, gms->iso);
                 tms->aperture = shutter_speed_given_aperture_iso_ev(tms->shutter_speed, isoev, tms->last_ev_with_fracs);
+                plan_bracket();
                 tms->exposure_ready = true;
                 gms->ui_mode = UI_MODE_METERING;
                 wait_for_release = AFTER_RELEASE_SHOW_READING;
@@ -461,5 +506,43 @@ int main()
             gms->ui_mode = UI_MODE_MAIN_MENU;
             gms->ui_mode_state.main_menu.start_line = 0;
         }
+        else if (mask == 4 && buttons_get_ticks_pressed_for() > 5000000) {
+            // Long press of the other button clears the multi-spot session.
+            if (gms->ui_mode == UI_MODE_MULTISPOT) {
+                multispot_init(&(tms->multispot));
+                tms->multispot_changed = true;
+                wait_for_release = AFTER_RELEASE_NOTHING;
+            }
+            // In the menu, it resets into the bootloader to receive a firmware
+            // update (see boot.c), unless the flash can't be written.
+            else if (gms->ui_mode == UI_MODE_MAIN_MENU) {
+                show_message(UI_MESSAGE_FIRMWARE_UPDATING);
+                update_request();
+                show_message(UI_MESSAGE_FIRMWARE_FAILED);
+                wait_for_release = AFTER_RELEASE_NOTHING;
+            }
+            // Otherwise it does nothing, but mustn't count as a short press
+            // when it's released.
+            else {
+                wait_for_release = AFTER_RELEASE_NOTHING;
+            }
+        }
+        else if (mask == 4 && buttons_get_ticks_pressed_for() == 0) {
+            // Go from a reading to its bracket, from there or the main screen
+            // to the multi-spot session, and from that back to the main
+            // screen. Or dismiss a message.
+            buttons_clear_mask();
+            if (gms->ui_mode == UI_MODE_MULTISPOT)
+                gms->ui_mode = UI_MODE_INIT;
+            else if (gms->ui_mode == UI_MODE_READING)
+                gms->ui_mode = UI_MODE_BRACKET;
+            else if (gms->ui_mode == UI_MODE_INIT || gms->ui_mode == UI_MODE_BRACKET)
+                gms->ui_mode = UI_MODE_MULTISPOT;
+            // In the menu, it listens for settings from the phone.
+            else if (gms->ui_mode == UI_MODE_MAIN_MENU)
+                receive_config();
+            else if (gms->ui_mode == UI_MODE_MESSAGE)
+                gms->ui_mode = UI_MODE_INIT;
+        }
     }
 }
@@ -0,0 +1,144 @@
+// Streaming front end for the mic.
+//
+// Raw (unsigned) ADC values are converted in place to signed samples with
+// the DC removed and, optionally, everything outside the HFSDP carriers
+// attenuated. All filter state is carried across calls, so consecutive
+// blocks are filtered as one continuous signal with no edge effects.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <micfilter.h>
+#ifdef TEST
+#include <stdio.h>
+#endif
+
+void micfilter_init(micfilter_t *f, bool bandpass)
+{
+    f->dc = MICFILTER_INITIAL_DC << MICFILTER_DC_FRAC;
+    f->x1 = f->x2 = 0;
+    f->y1 = f->y2 = 0;
+    f->bandpass = bandpass;
+}
+
+// One pass over the samples. On entry 'samples' holds raw 12-bit ADC values.
+//
+// Headroom: DC-blocked samples are within +/-2^12 and band-pass outputs
+// within about +/-2^13, so each product with a Q14 coefficient is below 2^28
+// and the sum of three stays within 32 bits.
+void micfilter_process(micfilter_t *f, int16_t *samples, unsigned length)
+{
+    int32_t dc = f->dc;
+    unsigned i;
+
+    if (! f->bandpass) {
+        for (i = 0; i < length; ++i) {
+            int32_t x = (uint16_t)samples[i];
+            samples[i] = (int16_t)(x - (dc >> MICFILTER_DC_FRAC));
+            dc += ((x << MICFILTER_DC_FRAC) - dc) >> MICFILTER_DC_SHIFT;
+        }
+    }
+    else {
+        int32_t x1 = f->x1, x2 = f->x2, y1 = f->y1, y2 = f->y2;
+        for (i = 0; i < length; ++i) {
+            int32_t x = (uint16_t)samples[i];
+            int32_t x0 = x - (dc >> MICFILTER_DC_FRAC);
+            dc += ((x << MICFILTER_DC_FRAC) - dc) >> MICFILTER_DC_SHIFT;
+
+            // b1 is 0 and b2 is -b0 for this band-pass.
+            int32_t y0 = (MICFILTER_BP_B0*(x0 - x2) - MICFILTER_BP_A1*y1 - MICFILTER_BP_A2*y2 +
+                          (1 << (MICFILTER_COEFF_BITS-1))) >> MICFILTER_COEFF_BITS;
+            x2 = x1;
+            x1 = x0;
+            y2 = y1;
+            y1 = y0;
+
+            samples[i] = (int16_t)y0;
+        }
+        f->x1 = x1;
+        f->x2 = x2;
+        f->y1 = y1;
+        f->y2 = y2;
+    }
+
+    f->dc = dc;
+}
+
+#ifdef TEST
+
+#include <math.h>
+
+#define FS         (8000000.0/124)
+#define NSAMPLES   (128*64)
+#define BLOCK      128
+#define SETTLE     1024
+
+// Amplitude of the component of 'samples' at 'freq'.
+static double amplitude(const int16_t *samples, unsigned length, double freq)
+{
+    double re = 0, im = 0;
+    unsigned i;
+    for (i = 0; i < length; ++i) {
+        re += samples[i] * cos(2*M_PI*freq*i/FS);
+        im += samples[i] * sin(2*M_PI*freq*i/FS);
+    }
+    return 2*sqrt(re*re + im*im)/length;
+}
+
+static double mean(const int16_t *samples, unsigned length)
+{
+    double t = 0;
+    unsigned i;
+    for (i = 0; i < length; ++i)
+        t += samples[i];
+    return t/length;
+}
+
+int main()
+{
+    static int16_t raw[NSAMPLES], whole[NSAMPLES], blocks[NSAMPLES];
+    const double CARRIER = 19148.4, HUM = 1000, DC = 1800;
+    unsigned i;
+    for (i = 0; i < NSAMPLES; ++i) {
+        double v = DC + 600*sin(2*M_PI*CARRIER*i/FS) + 400*sin(2*M_PI*HUM*i/FS);
+        raw[i] = (int16_t)v;
+    }
+
+    unsigned failures = 0;
+    int bp;
+    for (bp = 0; bp <= 1; ++bp) {
+        micfilter_t f;
+
+        for (i = 0; i < NSAMPLES; ++i)
+            whole[i] = blocks[i] = raw[i];
+
+        micfilter_init(&f, bp);
+        micfilter_process(&f, whole, NSAMPLES);
+
+        micfilter_init(&f, bp);
+        for (i = 0; i < NSAMPLES; i += BLOCK)
+            micfilter_process(&f, blocks + i, BLOCK);
+
+        bool same = true;
+        for (i = 0; i < NSAMPLES; ++i) {
+            if (whole[i] != blocks[i])
+                same = false;
+        }
+
+        const int16_t *settled = blocks + SETTLE;
+        unsigned n = NSAMPLES - SETTLE;
+        double m = mean(settled, n);
+        double carrier = amplitude(settled, n, CARRIER), hum = amplitude(settled, n, HUM);
+        printf("%s: mean %.2f, carrier %.1f (in 600), hum %.1f (in 400), blocks %s\n",
+               bp ? "DC blocker + band-pass" : "DC blocker", m, carrier, hum, same ? "match" : "DIFFER");
+
+        if (! same || fabs(m) > 2 || carrier < 500 || carrier > 700)
+            ++failures;
+        if (bp && hum > 400/100.0)
+            ++failures;
+    }
+
+    printf("%s\n", failures == 0 ? "OK" : "FAIL");
+    return failures != 0;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef MICFILTER_H
+#define MICFILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Empirically determined resting level of the mic, in ADC units. Used as the
+// starting DC estimate so that the DC blocker doesn't need to settle.
+//#define MICFILTER_INITIAL_DC ((int32_t)((1.3/3.3)*4096.0))
+#define MICFILTER_INITIAL_DC 1720
+
+// The DC estimate moves 1/2^MICFILTER_DC_SHIFT of the way towards each
+// sample (a cutoff of about 40Hz at 64516Hz).
+#define MICFILTER_DC_SHIFT   8
+#define MICFILTER_DC_FRAC    8
+
+// Band-pass biquad centred between the two HFSDP carriers, 4kHz wide.
+// Calculated using 'calccoeffs.py bandpass center=19652.3 bandwidth=4000 sample=64516.129'.
+#define MICFILTER_COEFF_BITS 14
+#define MICFILTER_FLOAT_TO_FIX(x) ((int32_t)((x)*(float)(1<<MICFILTER_COEFF_BITS) + ((x) < 0 ? -0.5 : 0.5)))
+#define MICFILTER_BP_B0 MICFILTER_FLOAT_TO_FIX(0.0874553460)
+#define MICFILTER_BP_A1 MICFILTER_FLOAT_TO_FIX(0.6140242470)
+#define MICFILTER_BP_A2 MICFILTER_FLOAT_TO_FIX(0.8250893081)
+
+typedef struct micfilter {
+    int32_t dc;       // With MICFILTER_DC_FRAC fractional bits.
+    int32_t x1, x2;   // Previous DC-blocked inputs to the band-pass.
+    int32_t y1, y2;   // Previous band-pass outputs.
+    bool bandpass;
+} micfilter_t;
+
+void micfilter_init(micfilter_t *f, bool bandpass);
+void micfilter_process(micfilter_t *f, int16_t *samples, unsigned length);
+
+#endif
@@ -0,0 +1,178 @@
+// Multi-spot metering session.
+//
+// Spot readings are added to a fixed-size ring. The min, max and mean of
+// the readings currently in the ring are updated incrementally each time a
+// reading is added, so that the display can be updated immediately.
+//
+// Zones follow the zone system: a reading which is exposed as metered falls
+// in zone V, and each stop of additional exposure moves it up one zone.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <multispot.h>
+#include <exposure.h>
+#include <mymemset.h>
+#include <myassert.h>
+#ifdef TEST
+#include <stdio.h>
+#endif
+
+#define RING_INDEX(start, i) (((start) + (i)) % MULTISPOT_MAX_READINGS)
+
+void multispot_init(multispot_t *ms)
+{
+    memset8_zero(ms, sizeof(multispot_t));
+}
+
+// Drops elements from the back of a monotonic queue for as long as they
+// compare 'op' against the new reading, then appends the new reading.
+#define QUEUE_PUSH(q, op)                                                           \
+    do {                                                                            \
+        while (ms->q ## _count > 0) {                                               \
+            uint8_t back = ms->q[RING_INDEX(ms->q ## _start, ms->q ## _count - 1)]; \
+            if (! (ms->readings[back] op ev))                                       \
+                break;                                                              \
+            --(ms->q ## _count);                                                    \
+        }                                                                           \
+        ms->q[RING_INDEX(ms->q ## _start, ms->q ## _count)] = slot;                 \
+        ++(ms->q ## _count);                                                        \
+    } while (0)
+
+// Removes the reading in the given slot from the front of a queue if it's there.
+#define QUEUE_EVICT(q, slot)                                                     \
+    do {                                                                         \
+        if (ms->q ## _count > 0 && ms->q[ms->q ## _start] == (slot)) {           \
+            ms->q ## _start = RING_INDEX(ms->q ## _start, 1);                    \
+            --(ms->q ## _count);                                                 \
+        }                                                                        \
+    } while (0)
+
+void multispot_add(multispot_t *ms, ev_with_fracs_t ev)
+{
+    uint8_t slot;
+    if (ms->count == MULTISPOT_MAX_READINGS) {
+        // Ring is full, so drop the oldest reading.
+        slot = ms->start;
+        ms->total -= ms->readings[slot];
+        QUEUE_EVICT(minq, slot);
+        QUEUE_EVICT(maxq, slot);
+        ms->start = RING_INDEX(ms->start, 1);
+    }
+    else {
+        slot = RING_INDEX(ms->start, ms->count);
+        ++(ms->count);
+    }
+
+    ms->readings[slot] = (int16_t)ev;
+    ms->total += ev;
+
+    QUEUE_PUSH(minq, >=);
+    QUEUE_PUSH(maxq, <=);
+
+    ms->min = ms->readings[ms->minq[ms->minq_start]];
+    ms->max = ms->readings[ms->maxq[ms->maxq_start]];
+
+    // Mean, rounded to nearest 1/120 EV.
+    int32_t t = ms->total, c = ms->count;
+    ms->mean = (t >= 0 ? (t + c/2) / c : -((-t + c/2) / c));
+}
+
+#undef QUEUE_PUSH
+#undef QUEUE_EVICT
+
+// The EV to expose at so that the given reading falls in the given zone.
+ev_with_fracs_t multispot_ev_placing_reading_in_zone(ev_with_fracs_t reading, int_fast8_t zone)
+{
+    return reading - ((zone - ZONE_MIDDLE_GREY) * EV_WITH_FRACS_TH);
+}
+
+// The zone (in 1/120ths) in which the given reading falls when exposing at 'ev'.
+ev_with_fracs_t multispot_zone_of_reading(ev_with_fracs_t reading, ev_with_fracs_t ev)
+{
+    return (ZONE_MIDDLE_GREY * EV_WITH_FRACS_TH) + (reading - ev);
+}
+
+// Expose for the shadows, then see where the highlights fall.
+void multispot_place_shadows(const multispot_t *ms, int_fast8_t shadow_zone, int_fast8_t target_highlight_zone, multispot_placement_t *p)
+{
+    assert(ms->count > 0);
+
+    p->ev = multispot_ev_placing_reading_in_zone(ms->min, shadow_zone);
+    p->shadow_zone = shadow_zone * EV_WITH_FRACS_TH;
+    p->highlight_zone = multispot_zone_of_reading(ms->max, p->ev);
+    p->development = (target_highlight_zone * EV_WITH_FRACS_TH) - p->highlight_zone;
+}
+
+// Expose for the highlights (e.g. for slide film), then see where the
+// shadows fall.
+void multispot_place_highlights(const multispot_t *ms, int_fast8_t highlight_zone, multispot_placement_t *p)
+{
+    assert(ms->count > 0);
+
+    p->ev = multispot_ev_placing_reading_in_zone(ms->max, highlight_zone);
+    p->highlight_zone = highlight_zone * EV_WITH_FRACS_TH;
+    p->shadow_zone = multispot_zone_of_reading(ms->min, p->ev);
+    p->development = 0;
+}
+
+#ifdef TEST
+
+#include <stdlib.h>
+
+static bool check_against_brute_force(const multispot_t *ms, const int16_t *all, unsigned n)
+{
+    unsigned first = (n > MULTISPOT_MAX_READINGS ? n - MULTISPOT_MAX_READINGS : 0);
+    int32_t min = 100000, max = -100000, total = 0;
+    unsigned i;
+    for (i = first; i < n; ++i) {
+        if (all[i] < min)
+            min = all[i];
+        if (all[i] > max)
+            max = all[i];
+        total += all[i];
+    }
+
+    double mean = ((double)total)/(n - first);
+    double meandiff = mean - ms->mean;
+    if (meandiff < 0)
+        meandiff = -meandiff;
+
+    return ms->min == min && ms->max == max && meandiff <= 0.5 && ms->count == n - first;
+}
+
+int main()
+{
+    multispot_t ms;
+    multispot_init(&ms);
+
+    static int16_t all[1000];
+    unsigned i, failures = 0;
+    srand(1);
+    for (i = 0; i < sizeof(all)/sizeof(all[0]); ++i) {
+        all[i] = (rand() % (31*EV_WITH_FRACS_TH)) - (5*EV_WITH_FRACS_TH);
+        multispot_add(&ms, all[i]);
+        if (! check_against_brute_force(&ms, all, i+1)) {
+            printf("FAILED after %i readings\n", i+1);
+            ++failures;
+        }
+    }
+    printf("Running statistics: %s\n", failures == 0 ? "OK" : "FAIL");
+
+    // Scene with shadows at EV 6, midtones at EV 9 and highlights at EV 13.
+    multispot_init(&ms);
+    multispot_add(&ms, 6*EV_WITH_FRACS_TH);
+    multispot_add(&ms, 9*EV_WITH_FRACS_TH);
+    multispot_add(&ms, 13*EV_WITH_FRACS_TH);
+
+    multispot_placement_t p;
+    multispot_place_shadows(&ms, 3, 8, &p);
+    printf("Shadows in III: EV %.2f, highlights in zone %.2f, N%+.2f\n",
+           ((float)p.ev)/120.0, ((float)p.highlight_zone)/120.0, ((float)p.development)/120.0);
+    multispot_place_highlights(&ms, 7, &p);
+    printf("Highlights in VII: EV %.2f, shadows in zone %.2f\n",
+           ((float)p.ev)/120.0, ((float)p.shadow_zone)/120.0);
+
+    return failures != 0;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef MULTISPOT_H
+#define MULTISPOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <exposure.h>
+
+// Number of spot readings kept. When the ring is full, adding a reading
+// drops the oldest one.
+#define MULTISPOT_MAX_READINGS 16
+
+#define ZONE_MIDDLE_GREY 5
+
+typedef struct multispot {
+    // Readings are stored as int16_t rather than ev_with_fracs_t to save RAM.
+    int16_t readings[MULTISPOT_MAX_READINGS];
+    uint8_t start;
+    uint8_t count;
+
+    // Monotonic queues (of indices into 'readings') used to track the
+    // min and max in O(1) amortized time as readings enter and leave the ring.
+    uint8_t minq[MULTISPOT_MAX_READINGS];
+    uint8_t maxq[MULTISPOT_MAX_READINGS];
+    uint8_t minq_start, minq_count;
+    uint8_t maxq_start, maxq_count;
+
+    int32_t total;
+
+    ev_with_fracs_t min, max, mean;
+} multispot_t;
+
+void multispot_init(multispot_t *ms);
+void multispot_add(multispot_t *ms, ev_with_fracs_t ev);
+#define multispot_count(ms)          ((ms)->count)
+#define multispot_min(ms)            ((ms)->min)
+#define multispot_max(ms)            ((ms)->max)
+#define multispot_mean(ms)           ((ms)->mean)
+#define multispot_contrast_range(ms) ((ms)->max - (ms)->min)
+
+ev_with_fracs_t multispot_ev_placing_reading_in_zone(ev_with_fracs_t reading, int_fast8_t zone);
+ev_with_fracs_t multispot_zone_of_reading(ev_with_fracs_t reading, ev_with_fracs_t ev);
+
+typedef struct multispot_placement {
+    ev_with_fracs_t ev;             // EV to expose at.
+    ev_with_fracs_t shadow_zone;    // Zone in which the darkest reading falls.
+    ev_with_fracs_t highlight_zone; // Zone in which the brightest reading falls.
+    // Development adjustment (N+/N-) needed to bring the highlights into
+    // the target highlight zone.
+    ev_with_fracs_t development;
+} multispot_placement_t;
+
+void multispot_place_shadows(const multispot_t *ms, int_fast8_t shadow_zone, int_fast8_t target_highlight_zone, multispot_placement_t *p);
+void multispot_place_highlights(const multispot_t *ms, int_fast8_t highlight_zone, multispot_placement_t *p);
+
+#endif
@@ -7,3 +7,11 @@ void memset8_zero(void *dest, uint8_t len)
         ((uint8_t *)dest)[len] = 0;
     } while (len > 0);
 }
+
+void memcpy8(void *dest, const void *src, uint8_t len)
+{
+    while (len > 0) {
+        --len;
+        ((uint8_t *)dest)[len] = ((const uint8_t *)src)[len];
+    }
+}
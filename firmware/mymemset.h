@@ -4,5 +4,6 @@
 #include <stdint.h>
 
 void memset8_zero(void *dest, uint8_t len);
+void memcpy8(void *dest, const void *src, uint8_t len);
 
 #endif
@@ -1,24 +1,46 @@
+#include <stddef.h>
 #include <myassert.h>
 #include <stm32f0xx_gpio.h>
 #include <stm32f0xx_tim.h>
 #include <stm32f0xx_rcc.h>
 #include <goetzel.h>
 #include <piezo.h>
+#include <micfilter.h>
 #include <hfsdp.h>
+#include <hamming.h>
 #include <deviceconfig.h>
 #include <debugging.h>
-#include <systime.h>
+#include <mymemset.h>
 
 
 //
 // Microphone stuff.
 //
 
-//#define MIC_OFFSET_ADC_V ((int32_t)((1.3/3.3)*4096.0))
-// Empirically determined.
-#define MIC_OFFSET_ADC_V 1720
+// Double buffer. The DMA fills it circularly, and the half-transfer and
+// transfer-complete interrupts mark each half as ready while the DMA goes
+// on to fill the other half.
+__IO int16_t piezo_mic_buffer[PIEZO_MIC_BUFFER_N_SAMPLES*2];
 
-__IO int16_t piezo_mic_buffer[PIEZO_MIC_BUFFER_N_SAMPLES];
+// Number of blocks (halves) filled by the DMA and handed to the caller of
+// piezo_mic_get_block() respectively. Blocks alternate between the two halves.
+static volatile uint32_t mic_blocks_filled;
+static uint32_t mic_blocks_taken;
+static uint32_t mic_overruns;
+
+static micfilter_t mic_filter;
+
+void DMA1_Channel1_IRQHandler()
+{
+    if (DMA1->ISR & DMA1_FLAG_HT1) {
+        DMA1->IFCR = DMA1_FLAG_HT1;
+        ++mic_blocks_filled;
+    }
+    if (DMA1->ISR & DMA1_FLAG_TC1) {
+        DMA1->IFCR = DMA1_FLAG_TC1;
+        ++mic_blocks_filled;
+    }
+}
 
 static inline void dma_config()
 {
@@ -30,15 +52,23 @@ static inline void dma_config()
     dmai.DMA_PeripheralBaseAddr = (uint32_t)(&(ADC1->DR));
     dmai.DMA_MemoryBaseAddr = (uint32_t)piezo_mic_buffer;
     dmai.DMA_DIR = DMA_DIR_PeripheralSRC;
-    dmai.DMA_BufferSize = PIEZO_MIC_BUFFER_N_SAMPLES;
+    dmai.DMA_BufferSize = PIEZO_MIC_BUFFER_N_SAMPLES*2;
     dmai.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
     dmai.DMA_MemoryInc = DMA_MemoryInc_Enable;
     dmai.DMA_PeripheralDataSize = DMA_PeripheralDataSize_HalfWord;
     dmai.DMA_MemoryDataSize = DMA_MemoryDataSize_HalfWord;
-    dmai.DMA_Mode = DMA_Mode_Normal;
+    dmai.DMA_Mode = DMA_Mode_Circular;
     dmai.DMA_Priority = DMA_Priority_High;
     dmai.DMA_M2M = DMA_M2M_Disable;
     DMA_Init(DMA1_Channel1, &dmai);
+
+    DMA_ITConfig(DMA1_Channel1, DMA_IT_HT | DMA_IT_TC, ENABLE);
+
+    NVIC_InitTypeDef nvic;
+    nvic.NVIC_IRQChannel = DMA1_Channel1_IRQn;
+    nvic.NVIC_IRQChannelPriority = 0;
+    nvic.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&nvic);
 }
 
 void piezo_mic_init()
@@ -58,7 +88,7 @@ void piezo_mic_init()
     GPIO_WriteBit(DISPLAY_POWER_GPIO_PORT, DISPLAY_POWER_PIN, 0);
 
     //
-    // Configure timer that will be used to trigger ADC at 44.1KHz.
+    // Configure timer that will be used to trigger ADC at PIEZO_MIC_SAMPLE_FREQ.
     // Timer appears to run on 8HMz clock (this is not abundantly clear from
     // the clock tree in the STM32F0 reference docs).
     //
@@ -68,7 +98,8 @@ void piezo_mic_init()
     TIM_TimeBaseStructInit(&tbi);
     tbi.TIM_Prescaler = 0;
     tbi.TIM_Period =    //181-1; // 44.1KHz
-                        91-1;  // 88.2KHz
+                        //91-1;  // 88.2KHz
+                        PIEZO_MIC_TIMER_PERIOD-1;
     tbi.TIM_ClockDivision = TIM_CKD_DIV1;
     tbi.TIM_CounterMode = TIM_CounterMode_Up;
     TIM_TimeBaseInit(TIM1, &tbi);
@@ -115,7 +146,7 @@ void piezo_mic_init()
     ADC_ChannelConfig(ADC1, ADC_Channel_9, ADC_SampleTime_13_5Cycles);
     ADC_GetCalibrationFactor(ADC1);
 
-    ADC_DMARequestModeConfig(ADC1, ADC_DMAMode_OneShot);
+    ADC_DMARequestModeConfig(ADC1, ADC_DMAMode_Circular);
     ADC_DMACmd(ADC1, ENABLE);
     ADC_Cmd(ADC1, ENABLE);
 
@@ -127,55 +158,67 @@ void piezo_mic_deinit()
 
 }
 
-void piezo_mic_read_buffer()
+// Starts continuous capture. Samples are taken on every TIM1 trigger until
+// piezo_mic_stop_capture() is called, whether or not the caller is keeping up.
+// If 'bandpass' is set, blocks are band-pass filtered around the HFSDP
+// carriers as well as having DC removed.
+void piezo_mic_start_capture(bool bandpass)
 {
-#define sbuf ((int16_t *)piezo_mic_buffer)
-#define ubuf ((uint16_t *)piezo_mic_buffer)
+    micfilter_init(&mic_filter, bandpass);
 
-    //uint32_t jt = SysTick->VAL;
+    mic_blocks_filled = 0;
+    mic_blocks_taken = 0;
+    mic_overruns = 0;
 
     while (! (ADC1->ISR & ADC_FLAG_ADRDY));
-    ADC1->CFGR1 |= ADC_CFGR1_WAIT;
-    ADC1->CR |= ADC_FLAG_ADSTART;
     dma_config();
     DMA1_Channel1->CCR |= DMA_CCR_EN;
-    while ((DMA1->ISR & DMA1_FLAG_TC1) == RESET);
-
-    /*while (! ADC_GetFlagStatus(ADC1, ADC_FLAG_ADRDY));
-    ADC_WaitModeCmd(ADC1, ENABLE);
-    ADC_StartOfConversion(ADC1);
-    dma_config();
-    DMA_Cmd(DMA1_Channel1, ENABLE);
-    while (DMA_GetFlagStatus(DMA1_FLAG_TC1) == RESET);*/
-
-    //debugging_writec("JITTER: ");
-    //debugging_write_uint32(jt-jt2);
-    //debugging_writec("\n");
+    ADC1->CR |= ADC_FLAG_ADSTART;
+}
 
-    DMA_ClearFlag(DMA1_FLAG_TC1);
+void piezo_mic_stop_capture()
+{
+    ADC1->CR |= ADC_CR_ADSTP;
+    while (ADC1->CR & ADC_CR_ADSTP);
+    DMA_ITConfig(DMA1_Channel1, DMA_IT_HT | DMA_IT_TC, DISABLE);
     DMA_Cmd(DMA1_Channel1, DISABLE);
+    DMA_ClearFlag(DMA1_FLAG_HT1 | DMA1_FLAG_TC1);
+}
 
-    unsigned i;
-    int32_t mean = 0;
-    for (i = 0; i < PIEZO_MIC_BUFFER_N_SAMPLES; ++i)
-        mean += ubuf[i];
-    mean /= PIEZO_MIC_BUFFER_N_SAMPLES;
+// Returns the oldest block that the caller hasn't yet seen, waiting for it to
+// fill if necessary. The block is filtered in place and remains valid until
+// the next call. If the caller falls more than a block
+// behind, the block it was due has already been overwritten, so we skip to
+// the most recent complete block and count an overrun.
+const int16_t *piezo_mic_get_block()
+{
+    while (mic_blocks_filled == mic_blocks_taken);
 
-    // Convert each value to signed 16-bit value using appropriate offset.
-    for (i = 0; i < PIEZO_MIC_BUFFER_N_SAMPLES; ++i) {
-        sbuf[i] -= mean;
+    uint32_t filled = mic_blocks_filled;
+    if (filled - mic_blocks_taken > 1) {
+        mic_overruns += filled - mic_blocks_taken - 1;
+        mic_blocks_taken = filled - 1;
     }
 
-#undef sbuf
-#undef ubuf
+    int16_t *block = (int16_t *)piezo_mic_buffer + ((mic_blocks_taken & 1) * PIEZO_MIC_BUFFER_N_SAMPLES);
+    ++mic_blocks_taken;
+
+    micfilter_process(&mic_filter, block, PIEZO_MIC_BUFFER_N_SAMPLES);
+
+    return block;
 }
 
-int32_t piezo_get_magnitude()
+uint32_t piezo_mic_get_overruns()
+{
+    return mic_overruns;
+}
+
+int32_t piezo_get_magnitude(const int16_t *block)
 {
     int32_t total = 0;
     unsigned i;
     for (i = 0; i < PIEZO_MIC_BUFFER_N_SAMPLES; ++i) {
-        int32_t v = piezo_mic_buffer[i];
+        int32_t v = block[i];
         total += v*v;
     }
     return (total/PIEZO_MIC_BUFFER_N_SAMPLES);
@@ -295,6 +338,180 @@ void piezo_out_deinit()
 }
 
 
+//
+// Transmitter. Sends an HFSDP message from the speaker (TIM1's channels,
+// i.e. channel 2 of piezo_set_period) for a phone to decode: an alternating
+// preamble, the output of hamming_encode_message(), then a tail, as binary
+// FSK on the carriers the meter itself listens on.
+//
+// Each bit is a whole number of cycles of its carrier, counted by TIM1's
+// repetition counter, so TIM1 only has an update event at the end of each
+// bit. The update event requests a DMA burst that writes ARR and RCR for
+// the bit after next (both are preloaded, so they take effect at the
+// following update event) from a circular double buffer. Tone changes are
+// therefore exactly on cycle boundaries, however busy the CPU is. The
+// half-transfer and transfer-complete interrupts refill each half of the
+// buffer, every PIEZO_TX_BUFFER_BITS bits, and otherwise the CPU sleeps.
+//
+// The number of cycles in each bit is chosen so that the bit ends as near
+// as possible to where it should (a multiple of 8000000/HFSDP_SIGNAL_FREQ
+// clocks from the start), so that timing errors don't accumulate.
+//
+// TIM1 also triggers the ADC, so call piezo_mic_init() again before
+// listening.
+//
+
+// Carrier periods in clocks. The carriers are at HFSDP_CALIB_F1 and
+// HFSDP_CALIB_F2 steps of a window at PIEZO_MIC_SAMPLE_FREQ.
+#define PERIOD_FOR_STEP(step) ((PIEZO_MIC_TIMER_PERIOD*HFSDP_WINDOW_LENGTH*HFSDP_CALIB_STEPS_PER_BIN + (step)/2) / (step))
+#define TX_PERIOD0    PERIOD_FOR_STEP(HFSDP_CALIB_F1)
+#define TX_PERIOD1    PERIOD_FOR_STEP(HFSDP_CALIB_F2)
+#define TX_PULSE      ((TX_PERIOD0 + TX_PERIOD1) / 4)
+#define TX_BIT_CYCLES (8000000/HFSDP_SIGNAL_FREQ)
+#define TX_BIT_REM    (8000000%HFSDP_SIGNAL_FREQ)
+
+// ARR and RCR for each bit.
+static uint16_t tx_buffer[PIEZO_TX_BUFFER_BITS*2*2];
+static uint8_t tx_encoded[PIEZO_TX_INIT_SEQUENCES*4 + (PIEZO_TX_MAX_LENGTH+2)/3*4];
+static unsigned tx_nbits;        // Including the preamble and tail.
+static unsigned tx_bit;          // The next bit to go in the buffer.
+static int32_t tx_error;         // Clocks behind where we should be.
+static uint8_t tx_rem;
+static bool tx_padding[2];       // Whether each half is all past the end.
+static volatile bool tx_done;
+
+static unsigned tx_get_bit(unsigned i)
+{
+    if (i < PIEZO_TX_PREAMBLE_BITS)
+        return i % 2;
+    i -= PIEZO_TX_PREAMBLE_BITS;
+    if (i < tx_nbits - PIEZO_TX_PREAMBLE_BITS - PIEZO_TX_TAIL_BITS)
+        return (tx_encoded[i/8] >> (i % 8)) & 1;
+    return 0;
+}
+
+// Writes ARR and RCR for the next 'n' bits to 'out'. Returns true if they're
+// all past the end of the message (and are just more tail).
+static bool tx_fill(uint16_t *out, unsigned n)
+{
+    bool padding = (tx_bit >= tx_nbits);
+    unsigned i;
+    for (i = 0; i < n; ++i, ++tx_bit) {
+        unsigned period = tx_get_bit(tx_bit) ? TX_PERIOD1 : TX_PERIOD0;
+
+        int32_t clocks = TX_BIT_CYCLES + tx_error;
+        tx_rem += TX_BIT_REM;
+        if (tx_rem >= HFSDP_SIGNAL_FREQ) {
+            tx_rem -= HFSDP_SIGNAL_FREQ;
+            ++clocks;
+        }
+        unsigned reps = (clocks + period/2) / period;
+        tx_error = clocks - (int32_t)(reps * period);
+
+        out[i*2] = period - 1;
+        out[i*2 + 1] = reps - 1;
+    }
+    return padding;
+}
+
+void DMA1_Channel4_5_IRQHandler()
+{
+    unsigned half;
+    if (DMA1->ISR & DMA1_FLAG_HT5) {
+        DMA1->IFCR = DMA1_FLAG_HT5;
+        half = 0;
+    }
+    else if (DMA1->ISR & DMA1_FLAG_TC5) {
+        DMA1->IFCR = DMA1_FLAG_TC5;
+        half = 1;
+    }
+    else {
+        return;
+    }
+
+    // Everything in this half has been sent to the timer, and none of it
+    // is more than two bits from being played. If it was all tail, the
+    // message has finished.
+    if (tx_padding[half]) {
+        TIM_Cmd(TIM1, DISABLE);
+        tx_done = true;
+        return;
+    }
+    tx_padding[half] = tx_fill(tx_buffer + half*PIEZO_TX_BUFFER_BITS*2, PIEZO_TX_BUFFER_BITS);
+}
+
+// Sends 'length' (at most PIEZO_TX_MAX_LENGTH) bytes of 'msg'. Returns once
+// it's been sent. piezo_out_init() must have been called.
+void piezo_write_message(const uint8_t *msg, unsigned length)
+{
+    assert(length <= PIEZO_TX_MAX_LENGTH);
+
+    hamming_encode_message(msg, length, tx_encoded, PIEZO_TX_INIT_SEQUENCES);
+    tx_nbits = PIEZO_TX_PREAMBLE_BITS + (PIEZO_TX_INIT_SEQUENCES + (length+2)/3)*32 + PIEZO_TX_TAIL_BITS;
+    tx_bit = 0;
+    tx_error = 0;
+    tx_rem = 0;
+    tx_done = false;
+
+    piezo_set_period(2, TX_PERIOD0 - 1);
+    TIM1->CCR3 = TX_PULSE;
+    TIM1->CCR4 = TX_PULSE;
+    TIM_ARRPreloadConfig(TIM1, ENABLE);
+
+    // The first bit is loaded straight away and the second is preloaded.
+    // The DMA starts with the third.
+    uint16_t first[2*2];
+    tx_fill(first, 2);
+    TIM1->ARR = first[0];
+    TIM1->RCR = first[1];
+    TIM_GenerateEvent(TIM1, TIM_EventSource_Update);
+    TIM1->ARR = first[2];
+    TIM1->RCR = first[3];
+    TIM_ClearFlag(TIM1, TIM_FLAG_Update);
+
+    tx_padding[0] = tx_fill(tx_buffer, PIEZO_TX_BUFFER_BITS);
+    tx_padding[1] = tx_fill(tx_buffer + PIEZO_TX_BUFFER_BITS*2, PIEZO_TX_BUFFER_BITS);
+
+    RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+    DMA_InitTypeDef dmai;
+    DMA_DeInit(DMA1_Channel5);
+    dmai.DMA_PeripheralBaseAddr = (uint32_t)(&(TIM1->DMAR));
+    dmai.DMA_MemoryBaseAddr = (uint32_t)tx_buffer;
+    dmai.DMA_DIR = DMA_DIR_PeripheralDST;
+    dmai.DMA_BufferSize = sizeof(tx_buffer)/sizeof(tx_buffer[0]);
+    dmai.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    dmai.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    dmai.DMA_PeripheralDataSize = DMA_PeripheralDataSize_HalfWord;
+    dmai.DMA_MemoryDataSize = DMA_MemoryDataSize_HalfWord;
+    dmai.DMA_Mode = DMA_Mode_Circular;
+    dmai.DMA_Priority = DMA_Priority_High;
+    dmai.DMA_M2M = DMA_M2M_Disable;
+    DMA_Init(DMA1_Channel5, &dmai);
+    DMA_ITConfig(DMA1_Channel5, DMA_IT_HT | DMA_IT_TC, ENABLE);
+
+    NVIC_InitTypeDef nvic;
+    nvic.NVIC_IRQChannel = DMA1_Channel4_5_IRQn;
+    nvic.NVIC_IRQChannelPriority = 0;
+    nvic.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&nvic);
+
+    DMA_Cmd(DMA1_Channel5, ENABLE);
+    TIM_DMAConfig(TIM1, TIM_DMABase_ARR, TIM_DMABurstLength_2Transfers);
+    TIM_DMACmd(TIM1, TIM_DMA_Update, ENABLE);
+    piezo_turn_on(2);
+
+    while (! tx_done)
+        __WFI();
+
+    TIM_CtrlPWMOutputs(TIM1, DISABLE);
+    TIM_DMACmd(TIM1, TIM_DMA_Update, DISABLE);
+    DMA_ITConfig(DMA1_Channel5, DMA_IT_HT | DMA_IT_TC, DISABLE);
+    DMA_Cmd(DMA1_Channel5, DISABLE);
+    TIM_ARRPreloadConfig(TIM1, DISABLE);
+    TIM1->RCR = 0;
+}
+
+
 //
 // HFSDP stuff.
 //
@@ -306,31 +523,32 @@ static int32_t debugbuf[PIEZO_MIC_BUFFER_N_SAMPLES*2];
 static int32_t debugbufi;
 #endif
 
-bool piezo_read_data(uint8_t *buffer, unsigned bytes)
+// Reads 'bytes' bytes into 'buffer'. If 'confidences' isn't NULL, it
+// receives the confidence (see hfsdp_read_bit) of each of the bytes*8 bits.
+// The decoding itself is in hfsdp_receive_window(), so that it can be run
+// on the host.
+bool piezo_read_data(uint8_t *buffer, unsigned bytes, uint8_t *confidences)
 {
-    unsigned bits = bytes*8;
-
-    hfsdp_read_bit_state_t s;
-    init_hfsdp_read_bit_state(&s, HFSDP_COSCOEFF1, HFSDP_SINCOEFF1,
-                                  HFSDP_COSCOEFF2, HFSDP_SINCOEFF2);
+    hfsdp_receiver_t r;
+    init_hfsdp_receiver(&r, buffer, bytes, confidences);
 
 #ifdef DEBUG_OUTPUT
     debugbufi = 0;
 #endif
 
-    bool started = false;
-    unsigned nreceived = 0;
-    SYSTIME_START(t);
+    piezo_mic_start_capture(true);
     for (;;) {
-        piezo_mic_read_buffer();
+        // Blocks arrive at HFSDP_SAMPLE_FREQ, timed by TIM1.
+        const int16_t *block = piezo_mic_get_block();
 
-        if (! started) {
-            started = hfsdp_check_start(&s, (const int16_t *)piezo_mic_buffer, PIEZO_MIC_BUFFER_N_SAMPLES);
-        }
-        else {
-            int r = hfsdp_read_bit(&s, (const int16_t *)piezo_mic_buffer, PIEZO_MIC_BUFFER_N_SAMPLES);
+#ifdef DEBUG_OUTPUT
+        bool reading = r.calibrated;
+#endif
+
+        int ret = hfsdp_receive_window(&r, block);
 
 #ifdef DEBUG_OUTPUT
+        if (reading) {
             debugbuf[debugbufi++] = hfsdp_read_bit_debug_last_f1;
             debugbuf[debugbufi++] = hfsdp_read_bit_debug_last_f2;
 
@@ -348,39 +566,147 @@ bool piezo_read_data(uint8_t *buffer, unsigned bytes)
                 }
                 debugging_writec("*****\n");
             }
+        }
 #endif
 
-            if (r == HFSDP_READ_BIT_DECODE_ERROR) {
-                return false;
-            }
-            else if (r == HFSDP_READ_BIT_NOTHING_READ) {
-                ;//debugging_writec("N\n");
-            }
-            else {
-                //debugging_writec("B: ");
-                //debugging_write_uint32(r);
-                //debugging_writec("\n");
-
-                unsigned shiftup = nreceived % 8;
-                if (shiftup == 0)
-                    buffer[nreceived/8] = r;
-                else
-                    buffer[nreceived/8] |= (r << shiftup);
-                ++nreceived;
-
-                if (nreceived == bits)
-                    return true;
-            }
+        if (ret != HFSDP_RECEIVE_MORE) {
+            piezo_mic_stop_capture();
+            return ret == HFSDP_RECEIVE_DONE;
+        }
+    }
+}
+
+// Receives a message encoded by hamming_encode_message() (with at least one
+// init sequence) and decodes the first 'length' bytes of it into 'msg' as
+// each codeword arrives, without buffering the raw bits. Bytes from codewords
+// that can't be decoded are set to 'errval'. Returns false if there's no
+// start sequence within PIEZO_MESSAGE_MAX_WAIT_WINDOWS windows, or no init
+// sequence within PIEZO_MESSAGE_MAX_SEARCH_BITS bits of the start.
+bool piezo_read_message(uint8_t *msg, unsigned length, uint8_t errval)
+{
+    hfsdp_receiver_t r;
+    init_hfsdp_receiver(&r, NULL, 0, NULL);
+    hamming_stream_t hs;
+    hamming_stream_init(&hs, true, errval);
+
+    bool ok = false;
+    unsigned n = 0, searched = 0, waited = 0;
+    piezo_mic_start_capture(true);
+    for (;;) {
+        int b = hfsdp_receive_bit(&r, piezo_mic_get_block());
+        if (b == HFSDP_READ_BIT_DECODE_ERROR)
+            break;
+        if (b == HFSDP_READ_BIT_NOTHING_READ) {
+            if (! r.started && ++waited > PIEZO_MESSAGE_MAX_WAIT_WINDOWS)
+                break;
+            continue;
+        }
+
+        uint8_t out[3];
+        unsigned i, nout = hamming_stream_push_bit(&hs, b, r.s.bit_confidence, out);
+        if (hs.state == HAMMING_STREAM_SEARCHING && ++searched > PIEZO_MESSAGE_MAX_SEARCH_BITS)
+            break;
+        for (i = 0; i < nout && n < length; ++i)
+            msg[n++] = out[i];
+        if (n == length) {
+            ok = true;
+            break;
         }
+    }
+    piezo_mic_stop_capture();
+    return ok;
+}
+
+// Too big to go on the stack.
+static hamming_frame_t frame_decoder;
+
+// Receives a frame encoded by hamming_encode_frame() and decodes its payload
+// into 'msg', which has room for 'capacity' bytes, setting 'length' to the
+// payload length. Returns PIEZO_FRAME_NOTHING if there's no start sequence
+// within PIEZO_MESSAGE_MAX_WAIT_WINDOWS windows (so that callers don't wait
+// forever when nothing is being sent), and PIEZO_FRAME_ERROR if there's no
+// init sequence within PIEZO_MESSAGE_MAX_SEARCH_BITS bits of the start, or
+// if the frame is too long or fails its CRC.
+int piezo_read_frame(uint8_t *msg, unsigned capacity, unsigned *length)
+{
+    hfsdp_receiver_t r;
+    init_hfsdp_receiver(&r, NULL, 0, NULL);
+    hamming_frame_t *f = &frame_decoder;
+    hamming_frame_init(f, true, msg, capacity);
+
+    int ret = HAMMING_FRAME_ERROR;
+    unsigned searched = 0, waited = 0;
+    piezo_mic_start_capture(true);
+    for (;;) {
+        int b = hfsdp_receive_bit(&r, piezo_mic_get_block());
+        if (b == HFSDP_READ_BIT_DECODE_ERROR)
+            break;
+        if (b == HFSDP_READ_BIT_NOTHING_READ) {
+            if (! r.started && ++waited > PIEZO_MESSAGE_MAX_WAIT_WINDOWS)
+                break;
+            continue;
+        }
+
+        ret = hamming_frame_push_bit(f, b, r.s.bit_confidence);
+        if (ret != HAMMING_FRAME_MORE)
+            break;
+        if (f->stream.state == HAMMING_STREAM_SEARCHING && ++searched > PIEZO_MESSAGE_MAX_SEARCH_BITS) {
+            ret = HAMMING_FRAME_ERROR;
+            break;
+        }
+    }
+    piezo_mic_stop_capture();
+
+    *length = f->length;
+    if (! r.started)
+        return PIEZO_FRAME_NOTHING;
+    return ret == HAMMING_FRAME_DONE ? PIEZO_FRAME_DONE : PIEZO_FRAME_ERROR;
+}
+
+// As piezo_read_data, but after the start sequence the data is sent using
+// MFSK with 'ntones' (4 or 8) tones, starting after the marker (see
+// hfsdp.h). Bits are packed in the same order as for
+// piezo_read_data, lowest bits of each symbol first.
+bool piezo_read_data_mfsk(uint8_t *buffer, unsigned bytes, unsigned ntones)
+{
+    unsigned bits = bytes*8;
 
-        // Wait until it's time to take the next sample.
-        SYSTIME_WAIT_UNTIL_CYCLES(t, HFSDP_SAMPLE_CYCLES);
+    hfsdp_read_bit_state_t s;
+    init_hfsdp_read_bit_state(&s, HFSDP_COSCOEFF1, HFSDP_SINCOEFF1,
+                                  HFSDP_COSCOEFF2, HFSDP_SINCOEFF2);
+    hfsdp_mfsk_state_t ms;
+
+    memset8_zero(buffer, bytes);
+
+    bool started = false, calibrated = false;
+    unsigned nreceived = 0;
+    piezo_mic_start_capture(true);
+    for (;;) {
+        const int16_t *block = piezo_mic_get_block();
 
-        //uint32_t v = SysTick->VAL;
-        //debugging_writec("TE: ");
-        //debugging_write_uint32(t.st - v);
-        //debugging_writec("\n");
+        if (! started) {
+            started = hfsdp_check_start(&s, block, PIEZO_MIC_BUFFER_N_SAMPLES);
+            continue;
+        }
+        if (! calibrated) {
+            calibrated = hfsdp_calibrate(&s, block, PIEZO_MIC_BUFFER_N_SAMPLES);
+            if (calibrated)
+                init_hfsdp_mfsk_state(&ms, &s, ntones);
+            continue;
+        }
+
+        int r = hfsdp_mfsk_read_symbol(&ms, block, PIEZO_MIC_BUFFER_N_SAMPLES);
+        if (r == HFSDP_READ_BIT_NOTHING_READ)
+            continue;
 
-        SYSTIME_UPDATE(t);
+        unsigned i;
+        for (i = 0; i < ms.bits_per_symbol && nreceived < bits; ++i, ++nreceived) {
+            buffer[nreceived/8] |= ((r >> i) & 1) << (nreceived % 8);
+        }
+
+        if (nreceived == bits) {
+            piezo_mic_stop_capture();
+            return true;
+        }
     }
 }
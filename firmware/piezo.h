@@ -8,13 +8,22 @@
 #include <stm32f0xx_dma.h>
 #include <stm32f0xx_adc.h>
 
-#define PIEZO_MIC_BUFFER_N_SAMPLES 80
+// The ADC is triggered by TIM1 every PIEZO_MIC_TIMER_PERIOD cycles of the 8MHz
+// clock, giving 64516Hz. Samples are delivered in blocks of
+// PIEZO_MIC_BUFFER_N_SAMPLES, one block per HFSDP window (504.03Hz, within
+// 0.01% of HFSDP_SAMPLE_FREQ).
+#define PIEZO_MIC_TIMER_PERIOD     124
+#define PIEZO_MIC_SAMPLE_FREQ      (8000000/PIEZO_MIC_TIMER_PERIOD)
+#define PIEZO_MIC_BUFFER_N_SAMPLES 128
 
 void piezo_mic_init(void);
 void piezo_mic_deinit(void);
 
-void piezo_mic_read_buffer();
-int32_t piezo_get_magnitude();
+void piezo_mic_start_capture(bool bandpass);
+void piezo_mic_stop_capture(void);
+const int16_t *piezo_mic_get_block(void);
+uint32_t piezo_mic_get_overruns(void);
+int32_t piezo_get_magnitude(const int16_t *block);
 
 void piezo_out_init(void);
 void piezo_set_period(unsigned channels, uint16_t period);
@@ -23,7 +32,30 @@ void piezo_pause(unsigned channels);
 void piezo_unpause(unsigned channels);
 void piezo_out_deinit(void);
 
-bool piezo_read_data(uint8_t *buffer, unsigned nbits);
+// Messages sent by piezo_write_message() start with PIEZO_TX_PREAMBLE_BITS
+// alternating bits, then PIEZO_TX_INIT_SEQUENCES init sequences, and end
+// with PIEZO_TX_TAIL_BITS bits of the lower carrier. The buffer refilled by
+// interrupt holds PIEZO_TX_BUFFER_BITS bits in each half.
+#define PIEZO_TX_PREAMBLE_BITS  24
+#define PIEZO_TX_INIT_SEQUENCES 2
+#define PIEZO_TX_TAIL_BITS      8
+#define PIEZO_TX_BUFFER_BITS    16
+#define PIEZO_TX_MAX_LENGTH     48
+void piezo_write_message(const uint8_t *msg, unsigned length);
+
+bool piezo_read_data(uint8_t *buffer, unsigned bytes, uint8_t *confidences);
+
+// Bits after the start sequence within which piezo_read_message() and
+// piezo_read_frame() must find an init sequence, and windows (about four
+// seconds) within which they must find the start sequence.
+#define PIEZO_MESSAGE_MAX_SEARCH_BITS 128
+#define PIEZO_MESSAGE_MAX_WAIT_WINDOWS 2048
+bool piezo_read_message(uint8_t *msg, unsigned length, uint8_t errval);
+#define PIEZO_FRAME_DONE    0
+#define PIEZO_FRAME_ERROR   1 // Something was sent, but not a valid frame.
+#define PIEZO_FRAME_NOTHING 2 // Nothing was sent.
+int piezo_read_frame(uint8_t *msg, unsigned capacity, unsigned *length);
+bool piezo_read_data_mfsk(uint8_t *buffer, unsigned bytes, unsigned ntones);
 
 extern __IO int16_t piezo_mic_buffer[];
 
@@ -1,18 +1,109 @@
 #include <state.h>
 #include <exposure.h>
 #include <mymemset.h>
+#include <flash.h>
 
 meter_state_t global_meter_state;
 transient_meter_state_t global_transient_meter_state;
 
+// The meter state is saved by appending a record to the flash page at
+// FLASH_STATE_PAGE, so that the page only has to be erased once it's full.
+// The last record with a good magic number and checksum is the current
+// state. The magic number includes the size of meter_state_t, so that a
+// record saved by firmware with a different meter_state_t is ignored.
+typedef struct saved_meter_state {
+    uint16_t magic;
+    uint16_t checksum;
+    meter_state_t state;
+} saved_meter_state_t;
+
+#define SAVED_STATE_MAGIC    ((uint16_t)(0x5300 ^ sizeof(meter_state_t)))
+#define SAVED_STATE_EMPTY    0xFFFF
+#define SAVED_STATE_RECORDS  (FLASH_PAGE_SIZE / sizeof(saved_meter_state_t))
+
+static const saved_meter_state_t *saved_state_record(unsigned i)
+{
+    return (const saved_meter_state_t *)FLASH_STATE_PAGE + i;
+}
+
+// Fletcher-16.
+static uint16_t state_checksum(const meter_state_t *ms)
+{
+    const uint8_t *p = (const uint8_t *)ms;
+    unsigned i, a = 0, b = 0;
+    for (i = 0; i < sizeof(meter_state_t); ++i) {
+        a = (a + p[i]) % 255;
+        b = (b + a) % 255;
+    }
+    return (b << 8) | a;
+}
+
+static bool saved_state_record_ok(const saved_meter_state_t *r)
+{
+    return r->magic == SAVED_STATE_MAGIC && r->checksum == state_checksum(&(r->state));
+}
+
+// Returns the index of the current record, or -1 if there isn't one. Sets
+// '*next' to the index of the first empty record, SAVED_STATE_RECORDS if
+// there's no room left.
+static int find_saved_state(unsigned *next)
+{
+    int current = -1;
+    unsigned i;
+    for (i = 0; i < SAVED_STATE_RECORDS; ++i) {
+        const saved_meter_state_t *r = saved_state_record(i);
+        if (r->magic == SAVED_STATE_EMPTY)
+            break;
+        if (saved_state_record_ok(r))
+            current = i;
+    }
+    *next = i;
+    return current;
+}
+
 void write_meter_state(const meter_state_t *ms)
 {
-    // TODO.
+    saved_meter_state_t r;
+    r.magic = SAVED_STATE_MAGIC;
+    r.checksum = state_checksum(ms);
+    memcpy8(&(r.state), ms, sizeof(r.state));
+
+    unsigned next;
+    int current = find_saved_state(&next);
+    if (current != -1) {
+        const saved_meter_state_t *c = saved_state_record(current);
+        const uint8_t *a = (const uint8_t *)c, *b = (const uint8_t *)&r;
+        unsigned i;
+        for (i = 0; i < sizeof(r) && a[i] == b[i]; ++i)
+            ;
+        // Nothing's changed, so save the flash the wear.
+        if (i == sizeof(r))
+            return;
+    }
+
+    if (next == SAVED_STATE_RECORDS) {
+        if (! flash_erase_page(FLASH_STATE_PAGE))
+            return;
+        next = 0;
+    }
+    // If this fails (the power going off half way through, say) the record
+    // fails its checksum when it's read back, and the previous one is used.
+    flash_write((uint32_t)saved_state_record(next), (const uint8_t *)&r, sizeof(r));
 }
 
-void read_meter_state(meter_state_t *ms)
+// Leaves 'ms' alone and returns false if nothing has been saved. The UI
+// always starts in UI_MODE_INIT.
+bool read_meter_state(meter_state_t *ms)
 {
-    // TODO.
+    unsigned next;
+    int current = find_saved_state(&next);
+    if (current == -1)
+        return false;
+
+    memcpy8(ms, &(saved_state_record(current)->state), sizeof(*ms));
+    ms->ui_mode = UI_MODE_INIT;
+    memset8_zero(&(ms->ui_mode_state), sizeof(ms->ui_mode_state));
+    return true;
 }
 
 void initialize_global_meter_state()
@@ -23,10 +114,8 @@ void initialize_global_meter_state()
     memset8_zero(gms, sizeof(global_meter_state));
 
     // Set ISO 100 as default ISO.
-    memset8_zero(&(gms->bcd_iso_digits), sizeof(global_meter_state.bcd_iso_digits));
-    gms->bcd_iso_digits[0] = 1;
-    gms->bcd_iso_length = 3;
     gms->iso = 21;
+    gms->bcd_iso_length = iso_in_third_stops_to_bcd(gms->iso, gms->bcd_iso_digits);
 
     // Set default fixing to ISO.
     gms->fixing = FIXING_ISO;
@@ -44,6 +133,15 @@ void initialize_global_meter_state()
     ev_with_fracs_init(gms->fixed_shutter_speed);
     ev_with_fracs_init(gms->fixed_aperture);
     gms->fixed_iso = 6; // TODO TODO CHECK
+
+    gms->bracket_step = BRACKET_STEP_WHOLE;
+    gms->bracket_count = 3;
+
+    ev_with_fracs_init(gms->calibration_offset);
+    ev_with_fracs_init(gms->nd);
+
+    // Overwrite the defaults with whatever was last saved.
+    read_meter_state(gms);
 }
 
 void initialize_global_transient_meter_state()
@@ -55,5 +153,9 @@ void initialize_global_transient_meter_state()
     ev_with_fracs_init(tms->shutter_speed);
     tms->iso = 0;
 
+    multispot_init(&(tms->multispot));
+    tms->multispot_changed = false;
+    tms->bracket.count = 0;
+
     tms->exposure_ready = false;
 }
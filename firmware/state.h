@@ -7,6 +7,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <exposure.h>
+#include <multispot.h>
+#include <bracket.h>
 
 typedef enum fixing {
     FIXING_ISO = 0,
@@ -24,8 +26,20 @@ typedef enum ui_mode {
     UI_MODE_METERING,
     UI_MODE_MAIN_MENU,
     UI_MODE_CALIBRATE,
+    UI_MODE_MULTISPOT,
+    UI_MODE_BRACKET,
+    UI_MODE_MESSAGE,
 } ui_mode_t;
 
+// Shown in UI_MODE_MESSAGE.
+typedef enum ui_message {
+    UI_MESSAGE_SETTINGS_LISTENING=0,
+    UI_MESSAGE_SETTINGS_RECEIVED,
+    UI_MESSAGE_SETTINGS_NOTHING_RECEIVED,
+    UI_MESSAGE_FIRMWARE_UPDATING,
+    UI_MESSAGE_FIRMWARE_FAILED,
+} ui_message_t;
+
 typedef union ui_mode_state {
     struct {
         uint8_t start_line;
@@ -33,6 +47,9 @@ typedef union ui_mode_state {
         int8_t current_accel_y;
         uint32_t ticks_waited;
     } main_menu;
+    struct {
+        uint8_t message; // A ui_message_t.
+    } message;
 } ui_mode_state_t;
 
 typedef enum meter_mode {
@@ -73,12 +90,18 @@ typedef struct meter_state {
     ev_with_fracs_t fixed_aperture;
     ev_with_fracs_t fixed_shutter_speed;
     uint8_t fixed_iso; // In 1/3 stops
+
+    uint8_t bracket_step; // A bracket_step_t, in 1/120 EV.
+    uint8_t bracket_count;
+
+    ev_with_fracs_t calibration_offset; // Added to every reading, in 1/120 EV.
+    ev_with_fracs_t nd; // ND filter in front of the lens, in 1/120 EV.
 } meter_state_t;
 
 extern meter_state_t global_meter_state;
 
 void write_meter_state(const meter_state_t *ms);
-void read_meter_state(meter_state_t *ms);
+bool read_meter_state(meter_state_t *ms);
 void initialize_global_meter_state();
 void initialize_global_transient_meter_state();
 
@@ -88,6 +111,10 @@ typedef struct transient_meter_state {
     ev_with_fracs_t shutter_speed;
     uint8_t iso; // In 1/3 stops.
 
+    multispot_t multispot;
+    bool multispot_changed; // Since the multi-spot view was last drawn.
+    bracket_t bracket;
+
     bool exposure_ready;
 } transient_meter_state_t;
 
@@ -330,6 +330,223 @@ static void show_metering()
     display_write_page_array(pages, 8, 1, (DISPLAY_LCDWIDTH/2)+4, DISPLAY_NUM_PAGES/2);
 }
 
+// Zones that the multi-spot view places the shadows in, and aims to bring
+// the highlights into by development.
+#define MULTISPOT_SHADOW_ZONE    3
+#define MULTISPOT_HIGHLIGHT_ZONE 8
+
+// Marks a blank in a line of 8px chars.
+#define CHAR_8PX_BLANK_O 0xFF
+
+// Writes a whole line of 8px chars (as offsets into CHAR_PIXELS_8PX) to the
+// given page, blanking the rest of the line.
+static void write_8px_line(const uint8_t *chars, uint8_t length, uint8_t page)
+{
+    uint8_t out[CHAR_WIDTH_8PX];
+    uint8_t i, x;
+    for (i = 0, x = 0; DISPLAY_LCDWIDTH - x >= CHAR_WIDTH_8PX; ++i, x += CHAR_WIDTH_8PX) {
+        memset8_zero(out, sizeof(out));
+        if (i < length && chars[i] != CHAR_8PX_BLANK_O)
+            display_bwrite_8px_char(CHAR_PIXELS_8PX + chars[i], out, 1, 0);
+        display_write_page_array(out, CHAR_WIDTH_8PX, 1, x, page);
+    }
+}
+
+// Writes 'ev' to the nearest tenth, with a '+' if it's positive and 'sign'
+// is true. Returns the number of chars written (at most 7).
+static uint8_t ev_to_8px_chars(ev_with_fracs_t ev, uint8_t *chars, bool sign)
+{
+    uint8_t l = 0;
+    int32_t t = ev_with_fracs_to_int32_120th(ev);
+    if (t < 0) {
+        chars[l++] = CHAR_8PX_MINUS_O;
+        t = -t;
+    }
+    else if (sign) {
+        chars[l++] = CHAR_8PX_PLUS_O;
+    }
+
+    t = (t + (EV_WITH_FRACS_TH/20)) / (EV_WITH_FRACS_TH/10);
+    uint8_t n = uint32_to_bcd(t / 10, chars + l), i;
+    for (i = 0; i < n; ++i, ++l)
+        chars[l] = CHAR_8PX_0_O + CHAR_OFFSET_8PX(chars[l]);
+    chars[l++] = CHAR_8PX_PERIOD_O;
+    chars[l++] = CHAR_8PX_0_O + CHAR_OFFSET_8PX(t % 10);
+    return l;
+}
+
+// Writes a label followed by a space and an EV.
+static void write_8px_ev_line(const uint8_t *label, uint8_t label_length, ev_with_fracs_t ev, bool sign, uint8_t page)
+{
+    uint8_t chars[DISPLAY_LCDWIDTH/CHAR_WIDTH_8PX];
+    uint8_t l;
+    for (l = 0; l < label_length; ++l)
+        chars[l] = label[l];
+    chars[l++] = CHAR_8PX_BLANK_O;
+    l += ev_to_8px_chars(ev, chars + l, sign);
+    write_8px_line(chars, l, page);
+}
+
+// The multi-spot session: the number of spots, their min, max and mean, the
+// contrast range, and the EV that places the shadows in
+// MULTISPOT_SHADOW_ZONE, with the zone the highlights then fall in and the
+// development needed to bring them to MULTISPOT_HIGHLIGHT_ZONE. It's redrawn
+// when a spot is added or the session is cleared (multispot_changed).
+static void show_multispot(bool first_time)
+{
+    static const uint8_t SPOTS[] = { CHAR_8PX_S_O, CHAR_8PX_P_O, CHAR_8PX_O_O, CHAR_8PX_T_O, CHAR_8PX_S_O };
+    static const uint8_t MIN[] = { CHAR_8PX_M_O, CHAR_8PX_I_O, CHAR_8PX_N_O };
+    static const uint8_t MAX[] = { CHAR_8PX_M_O, CHAR_8PX_A_O, CHAR_8PX_X_O };
+    static const uint8_t MEAN[] = { CHAR_8PX_M_O, CHAR_8PX_E_O, CHAR_8PX_A_O, CHAR_8PX_N_O };
+    static const uint8_t RANGE[] = { CHAR_8PX_R_O, CHAR_8PX_A_O, CHAR_8PX_N_O, CHAR_8PX_G_O, CHAR_8PX_E_O };
+    static const uint8_t EV[] = { CHAR_8PX_E_O, CHAR_8PX_V_O };
+    static const uint8_t HIGH_ZONE[] = { CHAR_8PX_H_O, CHAR_8PX_I_O, CHAR_8PX_BLANK_O, CHAR_8PX_Z_O, CHAR_8PX_O_O, CHAR_8PX_N_O, CHAR_8PX_E_O };
+    static const uint8_t DEVELOPMENT[] = { CHAR_8PX_D_O, CHAR_8PX_E_O, CHAR_8PX_V_O, CHAR_8PX_BLANK_O, CHAR_8PX_N_O };
+
+    // Only redrawn when the session changes, since it's all 8 pages.
+    if (! first_time && ! tms.multispot_changed)
+        return;
+    tms.multispot_changed = false;
+
+    const multispot_t *m = &(tms.multispot);
+
+    display_command(DISPLAY_SETSTARTLINE + 0);
+
+    uint8_t chars[sizeof(SPOTS) + 3];
+    uint8_t l, n, i;
+    for (l = 0; l < sizeof(SPOTS); ++l)
+        chars[l] = SPOTS[l];
+    chars[l++] = CHAR_8PX_BLANK_O;
+    n = uint32_to_bcd(multispot_count(m), chars + l);
+    for (i = 0; i < n; ++i, ++l)
+        chars[l] = CHAR_8PX_0_O + CHAR_OFFSET_8PX(chars[l]);
+    write_8px_line(chars, l, 0);
+
+    if (multispot_count(m) == 0) {
+        for (i = 1; i < DISPLAY_NUM_PAGES; ++i)
+            write_8px_line(NULL, 0, i);
+        return;
+    }
+
+    multispot_placement_t p;
+    multispot_place_shadows(m, MULTISPOT_SHADOW_ZONE, MULTISPOT_HIGHLIGHT_ZONE, &p);
+
+    write_8px_ev_line(MIN, sizeof(MIN), multispot_min(m), false, 1);
+    write_8px_ev_line(MAX, sizeof(MAX), multispot_max(m), false, 2);
+    write_8px_ev_line(MEAN, sizeof(MEAN), multispot_mean(m), false, 3);
+    write_8px_ev_line(RANGE, sizeof(RANGE), multispot_contrast_range(m), false, 4);
+    write_8px_ev_line(EV, sizeof(EV), p.ev, false, 5);
+    write_8px_ev_line(HIGH_ZONE, sizeof(HIGH_ZONE), p.highlight_zone, false, 6);
+    write_8px_ev_line(DEVELOPMENT, sizeof(DEVELOPMENT), p.development, true, 7);
+}
+
+// Shutter speed strings (see shutter_speed_to_string()) as 8px chars.
+static uint8_t shutter_char_to_8px_char(uint8_t c)
+{
+    if (c >= '0' && c <= '9')
+        return CHAR_8PX_0_O + CHAR_OFFSET_8PX(c - '0');
+    if (c == '/')
+        return CHAR_8PX_SLASH_O;
+    if (c == '.')
+        return CHAR_8PX_PERIOD_O;
+    if (c == 'S')
+        return CHAR_8PX_S_O;
+    return CHAR_8PX_BLANK_O;
+}
+
+// Width of each of the two columns of frames in the bracket view.
+#define BRACKET_COLUMN_CHARS 11
+
+// The bracket for the last reading (tms.bracket): the number of frames and
+// the step between them, then the frames' shutter speeds two to a line,
+// from the most exposure to the least. A frame whose speed had to be
+// clamped to the range of speeds is followed by an X. The bracket only
+// changes with a new reading or new settings, both of which leave this
+// view, so it's only drawn when it's first shown.
+static void show_bracket(bool first_time)
+{
+    static const uint8_t FRAMES[] = { CHAR_8PX_F_O, CHAR_8PX_R_O, CHAR_8PX_A_O, CHAR_8PX_M_O, CHAR_8PX_E_O, CHAR_8PX_S_O };
+    static const uint8_t NO_READING[] = { CHAR_8PX_N_O, CHAR_8PX_O_O, CHAR_8PX_BLANK_O, CHAR_8PX_R_O, CHAR_8PX_E_O, CHAR_8PX_A_O, CHAR_8PX_D_O, CHAR_8PX_I_O, CHAR_8PX_N_O, CHAR_8PX_G_O };
+
+    if (! first_time)
+        return;
+
+    const bracket_t *b = &(tms.bracket);
+
+    display_command(DISPLAY_SETSTARTLINE + 0);
+
+    uint8_t chars[DISPLAY_LCDWIDTH/CHAR_WIDTH_8PX];
+    uint8_t l = 0, i, j, page;
+
+    if (! tms.exposure_ready || b->count == 0) {
+        write_8px_line(NO_READING, sizeof(NO_READING), 0);
+        for (page = 1; page < DISPLAY_NUM_PAGES; ++page)
+            write_8px_line(NULL, 0, page);
+        return;
+    }
+
+    uint8_t n = uint32_to_bcd(b->count, chars);
+    for (i = 0; i < n; ++i, ++l)
+        chars[l] = CHAR_8PX_0_O + CHAR_OFFSET_8PX(chars[l]);
+    chars[l++] = CHAR_8PX_BLANK_O;
+    for (i = 0; i < sizeof(FRAMES); ++i)
+        chars[l++] = FRAMES[i];
+    chars[l++] = CHAR_8PX_BLANK_O;
+    ev_with_fracs_t step;
+    ev_with_fracs_init_from_120ths(step, ms.bracket_step);
+    l += ev_to_8px_chars(step, chars + l, false);
+    chars[l++] = CHAR_8PX_BLANK_O;
+    chars[l++] = CHAR_8PX_E_O;
+    chars[l++] = CHAR_8PX_V_O;
+    write_8px_line(chars, l, 0);
+
+    for (page = 1, i = 0; page < DISPLAY_NUM_PAGES; ++page) {
+        for (l = 0; l < sizeof(chars); ++l)
+            chars[l] = CHAR_8PX_BLANK_O;
+        uint8_t column;
+        for (column = 0; column < 2 && i < b->count; ++column, ++i) {
+            l = column*BRACKET_COLUMN_CHARS;
+            const uint8_t *s = SHUTTER_STRING_OUTPUT_STRING(b->strings[i]);
+            for (j = 0; j < b->strings[i].length; ++j)
+                chars[l + j] = shutter_char_to_8px_char(s[j]);
+            if (bracket_frame_is_clamped(b, i))
+                chars[l + j] = CHAR_8PX_X_O;
+        }
+        write_8px_line(chars, sizeof(chars), page);
+    }
+}
+
+// Title and status line of each ui_message_t.
+static const const_ptr_to_uint8_t ui_message_strings[][2] = {
+    { MENU_STRING_SETTINGS, MENU_STRING_LISTENING },        // UI_MESSAGE_SETTINGS_LISTENING
+    { MENU_STRING_SETTINGS, MENU_STRING_RECEIVED },         // UI_MESSAGE_SETTINGS_RECEIVED
+    { MENU_STRING_SETTINGS, MENU_STRING_NOTHING_RECEIVED }, // UI_MESSAGE_SETTINGS_NOTHING_RECEIVED
+    { MENU_STRING_FIRMWARE, MENU_STRING_UPDATING },         // UI_MESSAGE_FIRMWARE_UPDATING
+    { MENU_STRING_FIRMWARE, MENU_STRING_FAILED },           // UI_MESSAGE_FIRMWARE_FAILED
+};
+
+static void show_message()
+{
+    uint8_t title_str[MENU_MAX_SHORT_STRING_LENGTH+1];
+    uint8_t status_str[MENU_MAX_SHORT_STRING_LENGTH+1];
+    menu_string_decode_short(ui_message_strings[ms.ui_mode_state.message.message][0], title_str);
+    menu_string_decode_short(ui_message_strings[ms.ui_mode_state.message.message][1], status_str);
+
+    // Every column is written, so that a shorter message replaces a longer
+    // one without the screen being cleared.
+    uint8_t i;
+    uint8_t buf[CHAR_WIDTH_12PX*(DISPLAY_NUM_PAGES+1)];
+    uint_fast8_t finished_mask = 0;
+    for (i = 0; i < DISPLAY_LCDWIDTH/CHAR_WIDTH_12PX; ++i) {
+        memset8_zero(buf, sizeof(buf));
+        if (! (finished_mask & 1))
+            finished_mask |= menu_bwrite_12px_char(title_str[i], buf, 12);
+        if (! (finished_mask & 2))
+            finished_mask |= (menu_bwrite_12px_char(status_str[i], buf, 36) << 1);
+        display_write_page_array(buf, CHAR_WIDTH_12PX, DISPLAY_NUM_PAGES, i*CHAR_WIDTH_12PX, 0);
+    }
+}
+
 void ui_show_interface(uint32_t ticks_since_ui_last_shown)
 {
     // Used to make measurements of display power consumption.
@@ -369,6 +586,15 @@ void ui_show_interface(uint32_t ticks_since_ui_last_shown)
     else if (ms.ui_mode == UI_MODE_MAIN_MENU) {
         show_main_menu(ticks_since_ui_last_shown, first_time);
     }
+    else if (ms.ui_mode == UI_MODE_MULTISPOT) {
+        show_multispot(first_time);
+    }
+    else if (ms.ui_mode == UI_MODE_BRACKET) {
+        show_bracket(first_time);
+    }
+    else if (ms.ui_mode == UI_MODE_MESSAGE) {
+        show_message();
+    }
 }
 
 void ui_top_status_line_at_6col(ui_top_status_line_state_t *func_state,
@@ -400,7 +626,22 @@ void ui_top_status_line_at_6col(ui_top_status_line_state_t *func_state,
     // ISO
     //
 
-    uint8_t iso_start_x = DISPLAY_LCDWIDTH - (ms.bcd_iso_length << 2) - (ms.bcd_iso_length << 1) - (4*CHAR_WIDTH_8PX);
+    if (func_state->iso_length == 0) { // State is not initialized; initialize it.
+        // The ISO digits are stored in tenths, so we drop the last digit
+        // unless it's non-zero (e.g. ISO 0.8 or 2.5).
+        uint8_t l = 0, i;
+        if (ms.bcd_iso_length == 1)
+            func_state->iso_chars[l++] = CHAR_8PX_0_O;
+        for (i = 0; i < ms.bcd_iso_length - 1; ++i)
+            func_state->iso_chars[l++] = CHAR_8PX_0_O + CHAR_OFFSET_8PX(ms.bcd_iso_digits[i]);
+        if (ms.bcd_iso_digits[i] != 0) {
+            func_state->iso_chars[l++] = CHAR_8PX_PERIOD_O;
+            func_state->iso_chars[l++] = CHAR_8PX_0_O + CHAR_OFFSET_8PX(ms.bcd_iso_digits[i]);
+        }
+        func_state->iso_length = l;
+    }
+
+    uint8_t iso_start_x = DISPLAY_LCDWIDTH - (func_state->iso_length << 2) - (func_state->iso_length << 1) - (4*CHAR_WIDTH_8PX);
 
     if (x >= iso_start_x - 2 && x < DISPLAY_LCDWIDTH) {
         const uint8_t *px_grid;
@@ -419,9 +660,8 @@ void ui_top_status_line_at_6col(ui_top_status_line_state_t *func_state,
             uint8_t di;
             for (di = 0; x > iso_start_x - 2 + 24; x -= 6, ++di);
 
-            if (di < ms.bcd_iso_length) {
-                uint8_t digit = ms.bcd_iso_digits[di];
-                px_grid = CHAR_PIXELS_8PX + CHAR_8PX_0_O + CHAR_OFFSET_8PX(digit);
+            if (di < func_state->iso_length) {
+                px_grid = CHAR_PIXELS_8PX + func_state->iso_chars[di];
             }
             else {
                 px_grid = NULL;
@@ -10,6 +10,10 @@
 void ui_show_interface(uint32_t ticks_since_ui_last_shown);
 
 typedef struct ui_top_status_line_state {
+    // Char offsets for the ISO (including decimal point if any).
+    uint8_t iso_chars[ISO_DECIMAL_MAX_DIGITS+1]; // Max length example: "225179981368524"
+    uint8_t iso_length;
+
     uint8_t charbuffer[6];
     bool charbuffer_has_contents;
 } ui_top_status_line_state_t;
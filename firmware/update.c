@@ -0,0 +1,411 @@
+// Firmware update over audio (see update.h for the protocol).
+//
+// Nothing about the progress of an update is kept in RAM: it's all in the
+// update control page, so that an update survives the meter being turned
+// off half way through, and there's no RAM to spare for it anyway. Each
+// block is decoded into a frame-sized buffer and flashed before the next
+// one arrives.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <update.h>
+#include <flash.h>
+#include <crc32.h>
+#ifndef TEST
+#include <stm32f0xx.h>
+#include <piezo.h>
+#endif
+#ifdef TEST
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#endif
+
+#ifdef TEST
+// Flash is simulated on the host (see the tests at the end).
+static uint32_t test_flash[32*FLASH_PAGE_SIZE/4];
+#define FLASH_PTR(address) ((uint8_t *)test_flash + ((address) - FLASH_START))
+#else
+#define FLASH_PTR(address) ((const uint8_t *)(address))
+#endif
+
+#define CONTROL ((const update_control_t *)FLASH_PTR(UPDATE_CONTROL_ADDRESS))
+
+static unsigned block_count(unsigned length)
+{
+    return (length + UPDATE_BLOCK_SIZE - 1) / UPDATE_BLOCK_SIZE;
+}
+
+// 'offset' is the offset of the flag in update_control_t.
+static bool set_flag(unsigned offset)
+{
+    static const uint8_t set[2] = { UPDATE_FLAG_SET & 0xFF, UPDATE_FLAG_SET >> 8 };
+    return flash_write(UPDATE_CONTROL_ADDRESS + offset, set, sizeof(set));
+}
+
+// Throws away whatever was received before, and the application with it.
+// The control page goes first, so that if the power goes off part way
+// through there's no header claiming blocks that have been erased.
+static update_status_t start_update(unsigned length, uint32_t crc)
+{
+    if (! flash_erase_page(UPDATE_CONTROL_ADDRESS))
+        return UPDATE_STATUS_ERROR;
+    unsigned p;
+    for (p = 0; p < (length + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE; ++p) {
+        if (! flash_erase_page(UPDATE_APP_ADDRESS + p*FLASH_PAGE_SIZE))
+            return UPDATE_STATUS_ERROR;
+    }
+
+    const uint8_t header[] = {
+        UPDATE_CONTROL_MAGIC & 0xFF, UPDATE_CONTROL_MAGIC >> 8,
+        length & 0xFF, length >> 8,
+        crc & 0xFF, (crc >> 8) & 0xFF, (crc >> 16) & 0xFF, crc >> 24
+    };
+    if (! flash_write(UPDATE_CONTROL_ADDRESS, header, sizeof(header)))
+        return UPDATE_STATUS_ERROR;
+    return UPDATE_STATUS_MORE;
+}
+
+static uint32_t get_uint32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static update_status_t handle_info(const uint8_t *msg, unsigned length)
+{
+    if (length != UPDATE_INFO_LENGTH)
+        return UPDATE_STATUS_MORE;
+    unsigned ilength = msg[2] | (msg[3] << 8);
+    uint32_t crc = get_uint32(msg + 4);
+    if (ilength == 0 || ilength > UPDATE_MAX_LENGTH)
+        return UPDATE_STATUS_MORE;
+    if (get_uint32(msg + 8) != update_boot_id())
+        return UPDATE_STATUS_WRONG_BOOT;
+
+    // Carry on with the update in progress if it's the same image.
+    const update_control_t *c = CONTROL;
+    if (c->magic == UPDATE_CONTROL_MAGIC && c->length == ilength && c->crc == crc)
+        return c->verified == UPDATE_FLAG_SET ? UPDATE_STATUS_READY : UPDATE_STATUS_MORE;
+
+    return start_update(ilength, crc);
+}
+
+// Called once every block has been written.
+static update_status_t verify()
+{
+    const update_control_t *c = CONTROL;
+    if (crc32(FLASH_PTR(UPDATE_APP_ADDRESS), c->length) != c->crc) {
+        // A block was wrong despite passing the frame CRC, or the phone sent
+        // the wrong image. Either way, there's no telling which blocks are
+        // bad, so start again.
+        return start_update(c->length, c->crc);
+    }
+    if (! set_flag(offsetof(update_control_t, verified)))
+        return UPDATE_STATUS_ERROR;
+    return UPDATE_STATUS_READY;
+}
+
+static update_status_t handle_block(const uint8_t *msg, unsigned length)
+{
+    const update_control_t *c = CONTROL;
+    if (c->magic != UPDATE_CONTROL_MAGIC) // Still waiting for the info message.
+        return UPDATE_STATUS_MORE;
+    if (c->verified == UPDATE_FLAG_SET)
+        return UPDATE_STATUS_READY;
+
+    unsigned n = msg[2] | (msg[3] << 8);
+    unsigned nblocks = block_count(c->length);
+    if (n >= nblocks)
+        return UPDATE_STATUS_MORE;
+    unsigned size = (n == nblocks - 1 ? c->length - n*UPDATE_BLOCK_SIZE : UPDATE_BLOCK_SIZE);
+    if (length != 4 + size)
+        return UPDATE_STATUS_MORE;
+    if (c->blocks[n] == UPDATE_FLAG_SET) // Already got it.
+        return UPDATE_STATUS_MORE;
+
+    // Flash is written in half words, so an odd last block is padded.
+    uint32_t address = UPDATE_APP_ADDRESS + n*UPDATE_BLOCK_SIZE;
+    bool ok = flash_write(address, msg + 4, size & ~1u);
+    if (ok && size % 2 == 1) {
+        const uint8_t last[2] = { msg[4 + size - 1], 0xFF };
+        ok = flash_write(address + size - 1, last, sizeof(last));
+    }
+    if (! ok) {
+        // The block was partly written when the power went off, so it can't
+        // be written again without erasing the page it's in. It's simplest
+        // to start again; this shouldn't happen often.
+        return start_update(c->length, c->crc);
+    }
+    if (! set_flag(offsetof(update_control_t, blocks) + n*sizeof(c->blocks[0])))
+        return UPDATE_STATUS_ERROR;
+
+    unsigned i;
+    for (i = 0; i < nblocks; ++i) {
+        if (c->blocks[i] != UPDATE_FLAG_SET)
+            return UPDATE_STATUS_MORE;
+    }
+    return verify();
+}
+
+#ifdef TEST
+static uint32_t test_boot_id = 0x12345678;
+
+uint32_t update_boot_id()
+{
+    return test_boot_id;
+}
+#else
+// The CRC-32 of the bootloader's image, which the Makefile works out from
+// boot.bin in the same way for the application's header. The bootloader
+// can't hold its own CRC, so it's calculated each time (about a tenth of a
+// second).
+uint32_t update_boot_id()
+{
+    return crc32(FLASH_PTR(FLASH_START), (uint32_t)_boot_end - FLASH_START);
+}
+#endif
+
+// Handles the payload of one frame from the phone.
+update_status_t update_handle_message(const uint8_t *msg, unsigned length)
+{
+    if (length < 4 || msg[0] != UPDATE_MAGIC)
+        return UPDATE_STATUS_MORE;
+    if (msg[1] == UPDATE_MSG_INFO)
+        return handle_info(msg, length);
+    if (msg[1] == UPDATE_MSG_BLOCK)
+        return handle_block(msg, length);
+    return UPDATE_STATUS_MORE;
+}
+
+#ifndef TEST
+
+// Listens for update frames until the whole image has been written over the
+// application and verified, in which case it returns true. Returns false on
+// a flash error, if the image is for a different bootloader, or if the phone
+// isn't sending or seems to have stopped.
+// Only the bootloader calls this, since it overwrites the application.
+bool update_receive()
+{
+    uint8_t msg[UPDATE_MAX_MESSAGE];
+    unsigned length, failures = 0, silences = 0;
+    while (failures < UPDATE_MAX_FAILURES && silences < UPDATE_MAX_SILENCES) {
+        int r = piezo_read_frame(msg, sizeof(msg), &length);
+        if (r == PIEZO_FRAME_NOTHING) {
+            ++silences;
+            continue;
+        }
+        silences = 0;
+        if (r != PIEZO_FRAME_DONE) {
+            ++failures;
+            continue;
+        }
+        failures = 0;
+
+        update_status_t s = update_handle_message(msg, length);
+        if (s != UPDATE_STATUS_MORE)
+            return s == UPDATE_STATUS_READY;
+    }
+    return false;
+}
+
+// Asks the bootloader to listen for an update (see boot.c), by setting the
+// requested flag in a freshly erased control page and resetting. Only
+// returns if the flash couldn't be written.
+void update_request()
+{
+    if (! flash_erase_page(UPDATE_CONTROL_ADDRESS))
+        return;
+    if (! set_flag(offsetof(update_control_t, requested)))
+        return;
+    NVIC_SystemReset();
+}
+
+#endif
+
+#ifdef TEST
+
+static unsigned test_erases, test_block_writes;
+
+bool flash_erase_page(uint32_t address)
+{
+    assert(address % FLASH_PAGE_SIZE == 0);
+    memset(FLASH_PTR(address), 0xFF, FLASH_PAGE_SIZE);
+    ++test_erases;
+    return true;
+}
+
+// As on the STM32F0, a half word that isn't erased can only be programmed
+// to 0.
+bool flash_write(uint32_t address, const uint8_t *data, unsigned length)
+{
+    assert(address % 2 == 0 && length % 2 == 0);
+    if (address >= UPDATE_APP_ADDRESS && address < UPDATE_CONTROL_ADDRESS &&
+        (address - UPDATE_APP_ADDRESS) % UPDATE_BLOCK_SIZE == 0) {
+        ++test_block_writes;
+    }
+
+    unsigned i;
+    for (i = 0; i < length; i += 2) {
+        uint16_t *p = (uint16_t *)FLASH_PTR(address + i);
+        uint16_t v = data[i] | (data[i+1] << 8);
+        if (*p != 0xFFFF && v != 0)
+            return false;
+        *p = v;
+    }
+    return true;
+}
+
+static update_status_t send_info_for(unsigned length, uint32_t crc, uint32_t boot_id)
+{
+    uint8_t msg[UPDATE_INFO_LENGTH] = {
+        UPDATE_MAGIC, UPDATE_MSG_INFO, length & 0xFF, length >> 8,
+        crc & 0xFF, (crc >> 8) & 0xFF, (crc >> 16) & 0xFF, crc >> 24,
+        boot_id & 0xFF, (boot_id >> 8) & 0xFF, (boot_id >> 16) & 0xFF, boot_id >> 24
+    };
+    return update_handle_message(msg, sizeof(msg));
+}
+
+static update_status_t send_info(unsigned length, uint32_t crc)
+{
+    return send_info_for(length, crc, test_boot_id);
+}
+
+static update_status_t send_block(const uint8_t *image, unsigned length, unsigned n)
+{
+    uint8_t msg[UPDATE_MAX_MESSAGE] = { UPDATE_MAGIC, UPDATE_MSG_BLOCK, n & 0xFF, n >> 8 };
+    unsigned size = length - n*UPDATE_BLOCK_SIZE;
+    if (size > UPDATE_BLOCK_SIZE)
+        size = UPDATE_BLOCK_SIZE;
+    memcpy(msg + 4, image + n*UPDATE_BLOCK_SIZE, size);
+    return update_handle_message(msg, 4 + size);
+}
+
+// Sends the info message and then every block, each lost with probability
+// 'drop' (the info message too). Stops early if the meter is ready.
+static update_status_t send_round(const uint8_t *image, unsigned length, double drop)
+{
+    update_status_t s = UPDATE_STATUS_MORE;
+    if (rand() >= drop * RAND_MAX)
+        s = send_info(length, crc32(image, length));
+    unsigned n;
+    for (n = 0; n < block_count(length) && s == UPDATE_STATUS_MORE; ++n) {
+        if (rand() >= drop * RAND_MAX)
+            s = send_block(image, length, n);
+    }
+    return s;
+}
+
+// Number of rounds it takes, or 0 if the update never completes.
+static unsigned send_until_ready(const uint8_t *image, unsigned length, double drop)
+{
+    unsigned r;
+    for (r = 1; r <= 100; ++r) {
+        update_status_t s = send_round(image, length, drop);
+        if (s == UPDATE_STATUS_ERROR)
+            return 0;
+        if (s == UPDATE_STATUS_READY)
+            return r;
+    }
+    return 0;
+}
+
+static bool written(const uint8_t *image, unsigned length)
+{
+    return CONTROL->verified == UPDATE_FLAG_SET &&
+           memcmp(FLASH_PTR(UPDATE_APP_ADDRESS), image, length) == 0;
+}
+
+static unsigned failures;
+
+static void check(const char *name, bool ok)
+{
+    printf("%s: %s\n", name, ok ? "OK" : "FAIL");
+    if (! ok)
+        ++failures;
+}
+
+int main()
+{
+    static uint8_t image1[5001], image2[UPDATE_MAX_LENGTH];
+    unsigned i, rounds;
+    srand(1);
+    for (i = 0; i < sizeof(image1); ++i)
+        image1[i] = rand();
+    for (i = 0; i < sizeof(image2); ++i)
+        image2[i] = rand();
+    memset(test_flash, 0xFF, sizeof(test_flash));
+
+    // update_request() leaves nothing but the requested flag, so blocks are
+    // ignored until the info message arrives.
+    ((update_control_t *)FLASH_PTR(UPDATE_CONTROL_ADDRESS))->requested = UPDATE_FLAG_SET;
+    check("Block before info ignored", send_block(image1, sizeof(image1), 0) == UPDATE_STATUS_MORE && test_block_writes == 0);
+
+    // With a third of the frames lost, each block should still be written
+    // exactly once.
+    test_block_writes = 0;
+    rounds = send_until_ready(image1, sizeof(image1), 0.33);
+    printf("5001 byte image, a third of frames lost: %u rounds\n", rounds);
+    check("Image written with dropouts", rounds != 0 && written(image1, sizeof(image1)));
+    check("Each block written once", test_block_writes == block_count(sizeof(image1)));
+    check("Request cleared", CONTROL->requested == UPDATE_FLAG_CLEAR);
+    check("Info after image is ready", send_info(sizeof(image1), crc32(image1, sizeof(image1))) == UPDATE_STATUS_READY);
+
+    // A different image starts a new update. Stop half way, as if the meter
+    // had been turned off, and then carry on.
+    test_block_writes = 0;
+    send_info(sizeof(image2), crc32(image2, sizeof(image2)));
+    for (i = 0; i < block_count(sizeof(image2)) / 2; ++i)
+        send_block(image2, sizeof(image2), i);
+    unsigned erases = test_erases;
+    rounds = send_until_ready(image2, sizeof(image2), 0.1);
+    check("Resumed update written", rounds != 0 && written(image2, sizeof(image2)));
+    check("Resumed without erasing", test_erases == erases);
+    check("Resumed without rewriting blocks", test_block_writes == block_count(sizeof(image2)));
+
+    // A block that's wrong but passed its frame CRC is caught by the CRC of
+    // the whole image, and the update starts again.
+    uint32_t good_crc = crc32(image1, sizeof(image1));
+    send_info(sizeof(image1), good_crc ^ 1); // Clear out the last update.
+    send_info(sizeof(image1), good_crc);
+    image1[100] ^= 0x10;
+    for (i = 0; i < block_count(sizeof(image1)); ++i)
+        send_block(image1, sizeof(image1), i);
+    image1[100] ^= 0x10;
+    check("Bad block not verified", CONTROL->verified == UPDATE_FLAG_CLEAR && CONTROL->blocks[0] == UPDATE_FLAG_CLEAR);
+    rounds = send_until_ready(image1, sizeof(image1), 0);
+    check("Bad block resent", rounds != 0 && written(image1, sizeof(image1)));
+
+    // A block that was partly written when the power went off.
+    send_info(sizeof(image1), good_crc ^ 1);
+    send_info(sizeof(image1), good_crc);
+    *(uint16_t *)FLASH_PTR(UPDATE_APP_ADDRESS + 5*UPDATE_BLOCK_SIZE) = 0x1234;
+    rounds = send_until_ready(image1, sizeof(image1), 0);
+    check("Partly written block", rounds != 0 && written(image1, sizeof(image1)));
+
+    // Messages that should be ignored.
+    send_info(sizeof(image1), good_crc ^ 1);
+    erases = test_erases;
+    test_block_writes = 0;
+    uint8_t short_block[UPDATE_MAX_MESSAGE] = { UPDATE_MAGIC, UPDATE_MSG_BLOCK, 0, 0 };
+    uint8_t far_block[UPDATE_MAX_MESSAGE] = { UPDATE_MAGIC, UPDATE_MSG_BLOCK, 0xFF, 0 };
+    uint8_t big_info[UPDATE_INFO_LENGTH] = { UPDATE_MAGIC, UPDATE_MSG_INFO, 0x01, UPDATE_MAX_LENGTH >> 8 };
+    uint8_t bad_type[UPDATE_INFO_LENGTH] = { UPDATE_MAGIC, 7 };
+    bool ignored = update_handle_message(short_block, 4 + UPDATE_BLOCK_SIZE - 1) == UPDATE_STATUS_MORE &&
+                   update_handle_message(far_block, sizeof(far_block)) == UPDATE_STATUS_MORE &&
+                   update_handle_message(big_info, sizeof(big_info)) == UPDATE_STATUS_MORE &&
+                   update_handle_message(bad_type, sizeof(bad_type)) == UPDATE_STATUS_MORE;
+    check("Bad messages ignored", ignored && test_erases == erases && test_block_writes == 0);
+
+    // An image linked against a different bootloader is turned away before
+    // anything is erased.
+    erases = test_erases;
+    check("Image for another bootloader rejected",
+          send_info_for(sizeof(image2), crc32(image2, sizeof(image2)), test_boot_id ^ 1) == UPDATE_STATUS_WRONG_BOOT &&
+          test_erases == erases);
+
+    return failures != 0;
+}
+
+#endif
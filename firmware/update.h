@@ -0,0 +1,100 @@
+#ifndef UPDATE_H
+#define UPDATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <flash.h>
+
+//
+// Firmware update over audio. The phone sends the image as a series of
+// frames (see hamming_encode_frame), each sent as a separate transmission.
+// Each payload starts with UPDATE_MAGIC and a message type:
+//
+//     UPDATE_MSG_INFO:  image length (uint16_t), CRC-32 of the image
+//                       (uint32_t), bootloader ID (uint32_t)
+//     UPDATE_MSG_BLOCK: block number (uint16_t), then UPDATE_BLOCK_SIZE bytes
+//                       of the image (fewer for the last block)
+//
+// All little endian. The phone sends the info message and then every block,
+// and keeps going round until the meter has all of them.
+//
+// The application calls the bootloader's copy of the shared code at fixed
+// addresses, so an image only works with the bootloader it was linked
+// against. The build puts that bootloader's ID (the CRC-32 of its image,
+// boot.bin) in the application's header, UPDATE_APP_BOOT_ID_OFFSET bytes in,
+// and the phone sends it (as read from the image) in the info message. An image for a different
+// bootloader is turned away before anything is erased, and the bootloader
+// won't start an application with the wrong ID.
+//
+// The update is received by the bootloader (boot.c), which the application
+// asks to listen with update_request(). There's no room in flash for a
+// second copy of the application, so each block is written straight over
+// the application as soon as it arrives, and blocks which are already there
+// are skipped, so dropouts only cost the blocks they hit. An interrupted
+// update carries on where it left off, even after the meter has been turned
+// off: until every block is there and the CRC of the whole image checks
+// out, the bootloader listens for the rest of it instead of starting the
+// application.
+//
+
+#define UPDATE_MAGIC           'U'
+#define UPDATE_MSG_INFO        0
+#define UPDATE_MSG_BLOCK       1
+#define UPDATE_BLOCK_SIZE      64
+#define UPDATE_MAX_MESSAGE     (4 + UPDATE_BLOCK_SIZE)
+#define UPDATE_INFO_LENGTH     12
+
+// After this many transmissions in a row that can't be decoded, or this
+// many silences of PIEZO_MESSAGE_MAX_WAIT_WINDOWS (about four seconds each)
+// in a row, update_receive() gives up.
+#define UPDATE_MAX_FAILURES    16
+#define UPDATE_MAX_SILENCES    5
+
+// The update control page. Flash can only be changed from 1s to 0s without
+// erasing a whole page, so each field is written once: the header when an
+// update starts, blocks[i] (to 0) when block i has been written, and
+// verified when the image has passed its CRC. requested is set (in an
+// otherwise erased page) by update_request().
+#define UPDATE_CONTROL_MAGIC   0x5550
+#define UPDATE_FLAG_CLEAR      0xFFFF
+#define UPDATE_FLAG_SET        0x0000
+
+#define UPDATE_CONTROL_ADDRESS FLASH_PAGE(FLASH_UPDATE_CONTROL_PAGE)
+#ifdef TEST
+// Anywhere after a bootloader of about the right size will do for the tests.
+#define UPDATE_APP_ADDRESS     FLASH_PAGE(12)
+#else
+// The first page after the bootloader, whose image ends at _boot_end (see
+// stm/STM32F030K6_BOOT.ld).
+extern const uint8_t _app_start[], _boot_end[];
+#define UPDATE_APP_ADDRESS     ((uint32_t)_app_start)
+#endif
+#define UPDATE_MAX_LENGTH      (UPDATE_CONTROL_ADDRESS - UPDATE_APP_ADDRESS)
+// _app_start isn't known until the bootloader has been linked, so there's
+// room for every block up to the control page.
+#define UPDATE_MAX_BLOCKS      (FLASH_UPDATE_CONTROL_PAGE*FLASH_PAGE_SIZE/UPDATE_BLOCK_SIZE)
+// Just after the application's vector table (see stm/STM32F030K6_FLASH.ld).
+#define UPDATE_APP_BOOT_ID_OFFSET 0x10C
+
+typedef struct update_control {
+    uint16_t magic;
+    uint16_t length;
+    uint32_t crc;
+    uint16_t verified;
+    uint16_t requested;
+    uint16_t blocks[UPDATE_MAX_BLOCKS];
+} update_control_t;
+
+typedef enum update_status {
+    UPDATE_STATUS_MORE=0,  // Keep sending.
+    UPDATE_STATUS_READY,   // The whole image has been written and verified.
+    UPDATE_STATUS_ERROR,   // The flash couldn't be written.
+    UPDATE_STATUS_WRONG_BOOT // The image is for a different bootloader.
+} update_status_t;
+
+uint32_t update_boot_id(void);
+update_status_t update_handle_message(const uint8_t *msg, unsigned length);
+bool update_receive(void);
+void update_request(void);
+
+#endif